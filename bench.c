@@ -0,0 +1,342 @@
+/*
+ * joyemu 
+ *
+ * End-to-end input to pin latency benchmark using virtual uinput devices.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+#include "defaults.h"
+#include "input.h"
+#include "io.h"
+#include "logging.h"
+#include "pinmap.h"
+#include "stats.h"
+#include "timing.h"
+
+// event types measured by the benchmark
+#define BENCH_DPAD		0
+#define BENCH_FIRE		1
+#define BENCH_MOUSE_MOTION	2
+#define BENCH_MOUSE_BUTTON	3
+#define BENCH_TYPES		4
+
+// mouse reports written to the virtual mouse at once and the number of
+// such bursts, a burst every millisecond, when measuring the cost of
+// reading events
+#define BENCH_BURST_REPORTS	8
+#define BENCH_BURSTS		500
+
+const char *bench_type_name[BENCH_TYPES]={
+  "dpad", "fire", "mouse motion", "mouse buttons"
+};
+
+// virtual devices injecting the events
+struct libevdev_uinput *bench_gamepad=NULL, *bench_mouse=NULL;
+
+// ports the benchmark devices end up on, numbered from 0
+int bench_mouse_port, bench_gamepad_port;
+
+// the pin change the output observer is waiting for, in GPIO bits of the
+// expander of the port. when bench_change is set any change of the masked
+// bits from bench_value is accepted
+int bench_armed=0;
+int bench_expander, bench_change;
+uint16_t bench_mask, bench_value;
+uint64_t bench_t_seen;
+
+// GPIO bits of each expander as last written
+uint16_t bench_gpio[MAX_EXPANDERS];
+sem_t bench_done;
+
+// latency from event injection to pin change for each event type
+struct stats_hist bench_latency[BENCH_TYPES];
+
+
+// create a virtual device through uinput and return its event device number
+static int bench_create_uinput(const char *name, const unsigned int *codes, int ncodes, struct libevdev_uinput **uidev) {
+  struct libevdev *dev=libevdev_new();
+  const char *node;
+  int i, rc, devno=-1;
+
+  libevdev_set_name(dev, name);
+  libevdev_set_id_bustype(dev, BUS_VIRTUAL);
+  for(i=0;i<ncodes;i+=2) {
+    libevdev_enable_event_code(dev, codes[i], codes[i+1], NULL);
+  }
+  rc=libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, uidev);
+  libevdev_free(dev);
+  if (rc < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create uinput device \"%s\" (%s)", name, strerror(-rc));
+    return -1;
+  }
+
+  // udev may take a moment to create the node and set its permissions
+  node=libevdev_uinput_get_devnode(*uidev);
+  for(i=0;node && i<100 && access(node, R_OK);i++) usleep(10000);
+  if (!node || sscanf(node, "/dev/input/event%d", &devno)!=1) {
+    debug_log(LOGLEVEL_ERROR, "No event device node for uinput device \"%s\"", name);
+    return -1;
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Created uinput device \"%s\" as %s", name, node);
+  return devno;
+}
+
+
+// output observer, called by the output backend after each GPIO write
+static void bench_observe(int expander, uint16_t gpio, uint64_t t_ns) {
+  uint16_t v;
+
+  if (expander < 0 || expander >= MAX_EXPANDERS) return;
+  __atomic_store_n(&bench_gpio[expander], gpio, __ATOMIC_RELAXED);
+  if (expander!=bench_expander || !__atomic_load_n(&bench_armed, __ATOMIC_ACQUIRE)) return;
+  v=gpio & bench_mask;
+  if ((bench_change ? (v != bench_value) : (v == bench_value)) && __atomic_exchange_n(&bench_armed, 0, __ATOMIC_ACQ_REL)) {
+    bench_t_seen=t_ns;
+    sem_post(&bench_done);
+  }
+}
+
+
+// create the virtual gamepad and mouse, and designate them as the devices
+// to use so that input_scan_devices() ignores any real ones in their place.
+// only the first joystick is designated: it goes to the joystick port
+// measured, and the gamepad attached to a second port as well would
+// dispatch each event twice
+int bench_create_devices(void) {
+  static const unsigned int gamepad_codes[]={
+    EV_KEY, BTN_DPAD_UP, EV_KEY, BTN_DPAD_DOWN, EV_KEY, BTN_DPAD_LEFT, EV_KEY, BTN_DPAD_RIGHT,
+    EV_KEY, BTN_SOUTH, EV_KEY, BTN_EAST
+  };
+  static const unsigned int mouse_codes[]={
+    EV_REL, REL_X, EV_REL, REL_Y, EV_KEY, BTN_LEFT, EV_KEY, BTN_RIGHT
+  };
+  int devno;
+
+  devno=bench_create_uinput("joyemu benchmark gamepad", gamepad_codes, sizeof(gamepad_codes)/sizeof(unsigned int), &bench_gamepad);
+  if (devno < 0) return -1;
+  input_set_joystick_device(0, devno);
+
+  devno=bench_create_uinput("joyemu benchmark mouse", mouse_codes, sizeof(mouse_codes)/sizeof(unsigned int), &bench_mouse);
+  if (devno < 0) return -1;
+  input_set_mouse_device(devno);
+
+  // follow the output from the first write on, so the current pin states
+  // are known when the benchmark starts
+  io_set_observer(bench_observe);
+  return 0;
+}
+
+
+// GPIO bits of the expander of a port which the given DB9 pins are wired
+// to, for a zero terminated list of pins
+static uint16_t bench_pin_bits(int port, const int *pins) {
+  uint16_t bits=0;
+  int bit;
+
+  for(;*pins;pins++) {
+    bit=pinmap_gpio_bit(port, *pins);
+    if (bit!=PINMAP_UNCONNECTED) bits|=1<<bit;
+  }
+  return bits;
+}
+
+
+// inject an event and wait for the expected pin state of the given pins of
+// a port, all low when pressed and high otherwise, or any change of them.
+// returns the latency in nanoseconds or 0 on timeout
+static uint64_t bench_inject(struct libevdev_uinput *uidev, unsigned int type, unsigned int code, int value,
+                             int port, const int *pins, int pressed, int change) {
+  struct timespec deadline;
+  uint64_t t_inject;
+
+  bench_expander=pinmap_expander[port];
+  bench_mask=bench_pin_bits(port, pins);
+  bench_change=change;
+  bench_value=change ? (__atomic_load_n(&bench_gpio[bench_expander], __ATOMIC_RELAXED) & bench_mask) : (pressed ? 0 : bench_mask);
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec+=BENCH_TIMEOUT_MS*NSEC_PER_MSEC;
+  deadline.tv_sec+=deadline.tv_nsec/NSEC_PER_SEC;
+  deadline.tv_nsec%=NSEC_PER_SEC;
+
+  // drop any post left over from an earlier sample, which would end this
+  // one before its own pin change
+  while (sem_trywait(&bench_done)==0);
+
+  __atomic_store_n(&bench_armed, 1, __ATOMIC_RELEASE);
+  t_inject=timing_now_ns();
+  libevdev_uinput_write_event(uidev, type, code, value);
+  libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
+
+  // on a timeout the observer may have taken the pin change already, in
+  // which case its post is on the way
+  while (sem_timedwait(&bench_done, &deadline) < 0) {
+    if (errno!=EINTR) {
+      if (__atomic_exchange_n(&bench_armed, 0, __ATOMIC_ACQ_REL)) return 0;
+      while (sem_wait(&bench_done) < 0);
+      break;
+    }
+  }
+  return bench_t_seen > t_inject ? bench_t_seen-t_inject : 1;
+}
+
+
+// take one latency sample of an event type
+static uint64_t bench_sample(int type, int n) {
+  static const int up[]={ 1, 0 }, fire[]={ 6, 0 }, encoders[]={ 1, 2, 3, 4, 0 }, right[]={ 9, 0 };
+  int press=!(n&1);
+
+  switch (type) {
+    case BENCH_DPAD:
+    // pin 1 of the gamepad port goes low while up is pressed
+    return bench_inject(bench_gamepad, EV_KEY, BTN_DPAD_UP, press, bench_gamepad_port, up, press, 0);
+
+    case BENCH_FIRE:
+    return bench_inject(bench_gamepad, EV_KEY, BTN_SOUTH, press, bench_gamepad_port, fire, press, 0);
+
+    case BENCH_MOUSE_MOTION:
+    // any of the encoder pins 1-4 changing counts, the direction alternates
+    // so that every axis and both directions are covered
+    return bench_inject(bench_mouse, EV_REL, (n&2) ? REL_Y : REL_X, (n&1) ? -2 : 2, bench_mouse_port, encoders, 0, 1);
+
+    case BENCH_MOUSE_BUTTON:
+    // left button on pin 6 and right button on pin 9
+    if (n&2) return bench_inject(bench_mouse, EV_KEY, BTN_RIGHT, press, bench_mouse_port, right, press, 0);
+    return bench_inject(bench_mouse, EV_KEY, BTN_LEFT, press, bench_mouse_port, fire, press, 0);
+  }
+  return 0;
+}
+
+
+// flood the input thread with bursts of mouse reports and measure the read
+// calls and cpu time it takes to handle them. the movement goes back and
+// forth so that the mouse stays put
+static void bench_throughput(void) {
+  struct input_event burst[BENCH_BURST_REPORTS*3];
+  uint64_t cpu_start, cpu_end, reads_start, reads_end, events;
+  int i, n;
+
+  if (input_thread_usage(&cpu_start, &reads_start) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Unable to measure the cpu time and reads of the input thread");
+    return;
+  }
+  memset(burst, 0, sizeof(burst));
+  for(i=0;i<BENCH_BURST_REPORTS;i++) {
+    burst[3*i].type=EV_REL;
+    burst[3*i].code=REL_X;
+    burst[3*i].value=(i&1) ? -1 : 1;
+    burst[3*i+1].type=EV_REL;
+    burst[3*i+1].code=REL_Y;
+    burst[3*i+1].value=(i&1) ? 1 : -1;
+    burst[3*i+2].type=EV_SYN;
+    burst[3*i+2].code=SYN_REPORT;
+  }
+  for(n=0;n<BENCH_BURSTS;n++) {
+    if (write(libevdev_uinput_get_fd(bench_mouse), burst, sizeof(burst)) < 0) {
+      debug_log(LOGLEVEL_ERROR, "Failed to write events to the virtual mouse, errno %d", errno);
+      return;
+    }
+    usleep(1000);
+  }
+  // let the input thread catch up
+  usleep(50000);
+
+  if (input_thread_usage(&cpu_end, &reads_end) < 0 || reads_end==reads_start) return;
+  events=(uint64_t)BENCH_BURSTS*BENCH_BURST_REPORTS*3;
+  debug_log(LOGLEVEL_INFO, "reading events: %llu events in %llu reads, %.1f events per read, %.0f ns cpu per event",
+    (unsigned long long)events, (unsigned long long)(reads_end-reads_start), (double)events/(reads_end-reads_start),
+    (double)(cpu_end-cpu_start)/events);
+}
+
+
+// run the benchmark against the already started input and port threads,
+// with the mouse and the gamepad in the given ports. returns nonzero if
+// any sample timed out or the pins measured aren't wired
+int bench_run(int samples, int mouse_port, int joystick_port) {
+  static const int mouse_pins[]={ 1, 2, 3, 4, 6, 9, 0 }, gamepad_pins[]={ 1, 6, 0 };
+  unsigned long timeouts[BENCH_TYPES];
+  uint64_t latency;
+  int i, type, failed=0;
+
+  bench_mouse_port=mouse_port-1;
+  bench_gamepad_port=joystick_port-1;
+  for(i=0;mouse_pins[i];i++) {
+    if (pinmap_gpio_bit(bench_mouse_port, mouse_pins[i])==PINMAP_UNCONNECTED) {
+      debug_log(LOGLEVEL_ERROR, "The benchmark needs pin %d of the mouse port %d wired in the pin map", mouse_pins[i], mouse_port);
+      return -1;
+    }
+  }
+  for(i=0;gamepad_pins[i];i++) {
+    if (pinmap_gpio_bit(bench_gamepad_port, gamepad_pins[i])==PINMAP_UNCONNECTED) {
+      debug_log(LOGLEVEL_ERROR, "The benchmark needs pin %d of the joystick port %d wired in the pin map", gamepad_pins[i], joystick_port);
+      return -1;
+    }
+  }
+  sem_init(&bench_done, 0, 0);
+  for(type=0;type<BENCH_TYPES;type++) {
+    stats_hist_reset(&bench_latency[type]);
+    timeouts[type]=0;
+  }
+
+  debug_log(LOGLEVEL_INFO, "Measuring input to pin latency, %d samples per event type", samples);
+  for(i=0;i<samples;i++) {
+    for(type=0;type<BENCH_TYPES;type++) {
+      latency=bench_sample(type, i);
+      if (latency) stats_hist_add(&bench_latency[type], latency);
+      else timeouts[type]++;
+
+      // give the encoders time to drain and avoid locking on to the step
+      // interval of the port thread
+      usleep((type==BENCH_MOUSE_MOTION ? 5000 : 1000) + rand()%1000);
+    }
+  }
+
+  io_set_observer(NULL);
+  debug_log(LOGLEVEL_INFO, "Measuring the cost of reading events, %d bursts of %d mouse reports", BENCH_BURSTS, BENCH_BURST_REPORTS);
+  bench_throughput();
+  for(type=0;type<BENCH_TYPES;type++) {
+    stats_hist_log(LOGLEVEL_INFO, bench_type_name[type], &bench_latency[type]);
+    if (timeouts[type]) {
+      debug_log(LOGLEVEL_ERROR, "%s: %lu samples saw no pin change within %d ms", bench_type_name[type], timeouts[type], BENCH_TIMEOUT_MS);
+      failed=1;
+    }
+  }
+
+  libevdev_uinput_destroy(bench_gamepad);
+  libevdev_uinput_destroy(bench_mouse);
+  return failed;
+}
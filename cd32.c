@@ -0,0 +1,162 @@
+/*
+ * joyemu 
+ *
+ * CD32 pad shift register responder
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cd32.h"
+#include "defaults.h"
+#include "io.h"
+#include "logging.h"
+#include "metrics.h"
+#include "pinmap.h"
+#include "ports.h"
+#include "stats.h"
+#include "timing.h"
+
+// a port emulating a CD32 pad and the state of the read in progress, owned
+// by the input thread of its expander
+struct cd32_pad {
+  int port, expander, clock_bit;
+  int shifting;
+  uint16_t shifter;
+  struct stats_hist latency;
+  char latency_name[48];
+  uint64_t report_time;
+  struct metrics_hist *metric_latency;
+  int64_t *metric_reads;
+};
+
+struct cd32_pad cd32_pads[MAX_PORTS];
+
+// pad buttons in the order the CD32 pad shifts them out: blue, red,
+// yellow, green, forward, reverse and play
+const int cd32_button_order[CD32_BUTTONS]={
+  PORT_BUTTON_EAST, PORT_BUTTON_SOUTH, PORT_BUTTON_WEST, PORT_BUTTON_NORTH,
+  PORT_BUTTON_TR, PORT_BUTTON_TL, PORT_BUTTON_START
+};
+
+
+// record the time from a host edge to the pin update answering it
+static void cd32_add_latency(struct cd32_pad *p, uint64_t t_edge) {
+  uint64_t t=timing_now_ns();
+
+  stats_hist_add(&p->latency, t > t_edge ? t-t_edge : 0);
+  metrics_hist_add(p->metric_latency, t > t_edge ? t-t_edge : 0);
+  if (t >= p->report_time) {
+    stats_hist_log(LOGLEVEL_VERBOSE, p->latency_name, &p->latency);
+    stats_hist_reset(&p->latency);
+    p->report_time+=STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  }
+}
+
+
+// the host pulls pin 5 low to load the buttons into the shift register
+// and puts it back high to make the pad a joystick again. while it's low
+// pin 6 is the clock driven by the host, so it's turned into an input
+static void cd32_latch(void *arg, int level, uint64_t t_edge) {
+  struct cd32_pad *p=arg;
+  uint32_t state;
+  int i;
+
+  // a repeated level is an edge too short for the input to see
+  if ((level==0) == p->shifting) return;
+  if (!level) {
+    state=port_get_state(p->port);
+    p->shifter=CD32_ID_BIT;
+    for(i=0;i<CD32_BUTTONS;i++) {
+      if (!(state & PORT_BUTTON(cd32_button_order[i]))) p->shifter|=1<<i;
+    }
+    p->shifting=1;
+    mcp_set_input(p->expander, p->clock_bit, 1);
+    port_set_pins(p->port, PORT_CD32_SHIFTING|DB9_PIN(CD32_DATA_PIN), PORT_CD32_SHIFTING|DB9_PIN_LEVEL(CD32_DATA_PIN, p->shifter));
+    port_update_now();
+    metrics_add(p->metric_reads, 1);
+  } else {
+    // the latch is written with the red button before pin 6 drives it
+    p->shifting=0;
+    port_set_pins(p->port, PORT_CD32_SHIFTING, 0);
+    port_update_now();
+    mcp_set_input(p->expander, p->clock_bit, 0);
+  }
+  cd32_add_latency(p, t_edge);
+}
+
+
+// each rising edge of the clock shifts the next button out on pin 9
+static void cd32_clock(void *arg, int level, uint64_t t_edge) {
+  struct cd32_pad *p=arg;
+
+  if (!level || !p->shifting) return;
+  p->shifter>>=1;
+  port_set_pins(p->port, DB9_PIN(CD32_DATA_PIN), DB9_PIN_LEVEL(CD32_DATA_PIN, p->shifter));
+  port_update_now();
+  cd32_add_latency(p, t_edge);
+}
+
+
+// answer the host reading a CD32 pad on a port once the expander input
+// threads are started. pins 5 and 6 have to be wired to GPIO pins in the
+// pin map, pin 5 is made an input and pin 6 is one during reads. returns
+// nonzero if the pins can't be read
+int cd32_start(int port) {
+  struct cd32_pad *p=&cd32_pads[port-1];
+  int latch_bit=pinmap_gpio_bit(port-1, CD32_LATCH_PIN), clock_bit=pinmap_gpio_bit(port-1, CD32_CLOCK_PIN);
+  char labels[32];
+
+  if (latch_bit==PINMAP_UNCONNECTED || clock_bit==PINMAP_UNCONNECTED) {
+    debug_log(LOGLEVEL_ERROR, "The CD32 pad needs pins %d and %d of port %d wired in the pin map", CD32_LATCH_PIN, CD32_CLOCK_PIN, port);
+    return -1;
+  }
+  if (!io_backend->fast_inputs) {
+    debug_log(LOGLEVEL_ERROR, "The CD32 pad can't keep up with the host clock through the %s backend - use '-o gpio'", io_backend->name);
+    return -1;
+  }
+  p->port=port-1;
+  p->expander=pinmap_expander[port-1];
+  p->clock_bit=clock_bit;
+  p->shifting=0;
+  stats_hist_reset(&p->latency);
+  snprintf(p->latency_name, sizeof(p->latency_name), "CD32 pad on port %d edge to response latency", port);
+  p->report_time=timing_now_ns()+STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  snprintf(labels, sizeof(labels), "port=\"%d\"", port);
+  p->metric_latency=metrics_histogram("joyemu_cd32_response_seconds", "Time from a CD32 pad latch or clock edge to the pin update", labels);
+  p->metric_reads=metrics_counter("joyemu_cd32_reads_total", "Reads of the CD32 pad buttons by the host", labels);
+
+  // the clock is only watched while the host holds the latch low, and
+  // turned back into an output until then
+  if (mcp_watch_input(p->expander, latch_bit, cd32_latch, p) < 0 ||
+      mcp_watch_input(p->expander, clock_bit, cd32_clock, p) < 0 ||
+      mcp_set_input(p->expander, clock_bit, 0) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to read pins %d and %d of port %d as inputs", CD32_LATCH_PIN, CD32_CLOCK_PIN, port);
+    return -1;
+  }
+  return 0;
+}
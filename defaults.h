@@ -27,11 +27,19 @@
 #ifndef _CONST_H_
 #define _CONST_H
 
+// maximum number of I/O expanders, each of which drives two joystick
+// ports with the default wiring
+#define MAX_EXPANDERS		4
+#define MAX_PORTS		(2*MAX_EXPANDERS)
+
 // maximum number of joysticks supported
-#define MAX_JOYSTICKS		2
+#define MAX_JOYSTICKS		MAX_PORTS
 
-// bus and address for MCP23017
+// bus and address for the first MCP23017
 #define MCP_I2C_BUS_NUMBER      1
 #define MCP_I2C_BASE_ADDR       0x20
 
+// seconds between periodic statistics reports
+#define STATS_REPORT_INTERVAL	10
+
 #endif
@@ -0,0 +1,172 @@
+#!/bin/sh
+#
+# joyemu
+#
+# Check the gpio output backend on the kernel's gpio-sim driver
+#
+#
+# Copyright (c) 2017 Noora Halme
+#
+# Redistribution and use in source and binary forms, with or without modification,
+# are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this list
+#    of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice, this
+#    list of conditions and the following disclaimer in the documentation and/or other
+#    materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+# EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+# SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+# TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+# BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+# WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+#
+# usage: sudo ./gpio-sim-test.sh [bus:addr]
+#
+# creates a 16 line gpio-sim chip standing in for one MCP23017 and checks
+#  - that the lines start out high and the pins of an update land on the
+#    lines together, by answering MSX mouse strobes and reading pins 1-4
+#  - that every strobe edge is reported, against the MSX read metrics
+#  - the quadrature of the mouse encoders at every step rate
+# and then measures the input to pin latency with -B. given the bus and
+# address of a real MCP23017 the latency is measured on it as well for
+# comparison. exits with 0 if all checks passed, 1 if any failed and 77 if
+# gpio-sim isn't available
+
+
+JOYEMU=${JOYEMU:-./joyemu}
+SAMPLES=${SAMPLES:-1000}
+EDGES=${EDGES:-64}
+CONFIGFS=/sys/kernel/config/gpio-sim
+SIM=$CONFIGFS/joyemu-test
+LINES=0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+STROBE_LINE=6
+TMP=$(mktemp -d)
+failed=0
+pid=
+
+
+skip() {
+  echo "SKIP: $*"
+  cleanup
+  exit 77
+}
+
+fail() {
+  echo "FAIL: $*"
+  failed=1
+}
+
+cleanup() {
+  if [ -n "$pid" ]; then
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    pid=
+  fi
+  if [ -d $SIM ]; then
+    echo 0 > $SIM/live
+    rmdir $SIM/bank0 $SIM
+  fi
+  rm -rf "$TMP"
+}
+
+# value of a simulated line as driven by joyemu or pulled by us
+line_value() {
+  cat $SYSFS/sim_gpio$1/value
+}
+
+# read a metric from the socket of the running joyemu, summed over its
+# labels
+metric() {
+  socat -u UNIX-CONNECT:$TMP/metrics.sock - 2>/dev/null | awk -v name="$1" '
+    $1==name || index($1, name "{")==1 { sum+=$2; found=1 }
+    END { if (found) print sum }'
+}
+
+# average of a histogram metric in microseconds
+metric_avg_us() {
+  awk -v sum="$(metric $1_sum)" -v count="$(metric $1_count)" 'BEGIN { if (count > 0) printf "%.1f", sum*1000000/count; else print "-" }'
+}
+
+
+[ "$(id -u)" = 0 ] || skip "needs root for configfs and the GPIO lines"
+[ -x "$JOYEMU" ] || skip "$JOYEMU hasn't been built"
+command -v socat >/dev/null || skip "needs socat to read the metrics"
+modprobe gpio-sim 2>/dev/null
+[ -d /sys/kernel/config/gpio-sim ] || mount -t configfs none /sys/kernel/config 2>/dev/null
+[ -d $CONFIGFS ] || skip "gpio-sim isn't available in configfs"
+
+trap 'cleanup; exit 1' INT TERM
+mkdir $SIM $SIM/bank0 || skip "failed to create a gpio-sim chip"
+echo 16 > $SIM/bank0/num_lines
+echo 1 > $SIM/live || skip "failed to enable the gpio-sim chip"
+CHIP=$(cat $SIM/bank0/chip_name)
+SYSFS=/sys/devices/platform/$(cat $SIM/dev_name)/$CHIP
+echo "Using $CHIP with 16 lines"
+
+
+# MSX mouse on port 1 with the strobe on the spare bit 6 of GPIOA. nothing
+# moves, so every nibble is 0 and a strobe takes pins 1-4 low at once while
+# pins 6 and 9 stay high
+echo "port 1 pin 8 A6" > $TMP/pinmap
+$JOYEMU -v -m 1 -e 2 -p $TMP/pinmap -o gpio:$CHIP:$LINES -M $TMP/metrics.sock > $TMP/msx.log 2>&1 &
+pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S $TMP/metrics.sock ] && [ -n "$(metric joyemu_msx_reads_total)" ] && break
+  sleep 0.5
+done
+[ -n "$(metric joyemu_msx_reads_total)" ] || { cat $TMP/msx.log; skip "joyemu didn't start on $CHIP"; }
+
+for bit in 0 1 2 3 4 5; do
+  [ "$(line_value $bit)" = 1 ] || fail "line $bit isn't high before the first update"
+done
+
+echo pull-up > $SYSFS/sim_gpio$STROBE_LINE/pull
+sleep 0.1
+edges=$(metric joyemu_msx_response_seconds_count)
+for i in $(seq 1 $EDGES); do
+  if [ $((i%2)) = 1 ]; then
+    echo pull-down > $SYSFS/sim_gpio$STROBE_LINE/pull
+  else
+    echo pull-up > $SYSFS/sim_gpio$STROBE_LINE/pull
+  fi
+  sleep 0.01
+  levels="$(line_value 0)$(line_value 1)$(line_value 2)$(line_value 3)$(line_value 4)$(line_value 5)"
+  [ "$levels" = "000011" ] || fail "pins 1-4, 6 and 9 read $levels after strobe $i, expected 000011"
+done
+edges=$(( $(metric joyemu_msx_response_seconds_count)-edges ))
+[ $edges = $EDGES ] || fail "$edges strobe edges answered out of $EDGES"
+echo "MSX strobe to response latency $(metric_avg_us joyemu_msx_response_seconds)us on average over $edges edges"
+echo "GPIO write latency $(metric_avg_us joyemu_io_write_latency_seconds)us on average"
+kill $pid
+wait $pid 2>/dev/null
+pid=
+
+
+# quadrature of the encoders on the gpio lines
+if ! $JOYEMU -m 1 -o gpio:$CHIP:$LINES -Q 256 > $TMP/quad.log 2>&1; then
+  fail "quadrature verifier"
+fi
+grep "steps/s\|Highest" $TMP/quad.log
+
+
+# input to pin latency on the gpio lines and, if given, on a real MCP23017
+echo "Input to pin latency with -o gpio:"
+$JOYEMU -o gpio:$CHIP:$LINES -B $SAMPLES 2>&1 | grep "p50" || fail "benchmark on $CHIP"
+if [ -n "$1" ]; then
+  echo "Input to pin latency with an MCP23017 at $1:"
+  $JOYEMU -o i2c -i ${1%%:*} -a ${1#*:} -B $SAMPLES 2>&1 | grep "p50" || fail "benchmark on the MCP23017"
+else
+  echo "No MCP23017 given, skipping the I2C comparison"
+fi
+
+cleanup
+[ $failed = 0 ] && echo "PASS"
+exit $failed
@@ -0,0 +1,269 @@
+/*
+ * joyemu 
+ *
+ * Output backend driving host GPIO lines through the Linux GPIO character device.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "gpiochip.h"
+#include "io.h"
+#include "logging.h"
+
+// MCP23017 registers the backend acts on in BANK=0 mode
+#define MCP_GPIOA	0x12
+#define MCP_OLATA	0x14
+#define MCP_REGISTERS	0x16
+
+// the lines standing in for one expander. the register file is kept only
+// so that reads return what was written
+struct gpiochip_lines {
+  int fd;  // line request
+  int nlines;
+  int8_t line_of_bit[GPIOCHIP_BITS];  // index in the request, or GPIOCHIP_NO_LINE
+  int offset_of_bit[GPIOCHIP_BITS];  // line offset on the chip
+  uint64_t inputs;  // lines in the request reconfigured as inputs
+  uint8_t regs[MCP_REGISTERS];
+};
+
+// number of expanders opened so far, each takes the next 16 lines from the
+// line list
+int gpiochip_count=0;
+
+
+// parse "chip:line,line,..." into the chip device path and the line offset
+// for each GPIO bit of the nth expander. "-" leaves a bit without a line.
+// returns the number of lines or -1 if the string is invalid
+static int gpiochip_parse(const char *arg, int n, char *chip, size_t chip_len, int *offsets) {
+  const char *colon=arg ? strchr(arg, ':') : NULL;
+  const char *p;
+  char *end;
+  int bit=0, nlines=0;
+  long offset;
+
+  if (!colon || colon==arg) return -1;
+  snprintf(chip, chip_len, "%s%.*s", strchr(arg, '/') ? "" : "/dev/", (int)(colon-arg), arg);
+  for(bit=0;bit<GPIOCHIP_BITS;bit++) offsets[bit]=GPIOCHIP_NO_LINE;
+
+  // skip the lines of the expanders before this one
+  p=colon+1;
+  for(bit=0;bit<n*GPIOCHIP_BITS;bit++) {
+    p=strchr(p, ',');
+    if (!p) return -1;
+    p++;
+  }
+  for(bit=0;bit<GPIOCHIP_BITS && *p;bit++) {
+    if (*p=='-') {
+      end=(char *)p+1;
+    } else {
+      offset=strtol(p, &end, 10);
+      if (end==p || offset<0) return -1;
+      offsets[bit]=offset;
+      nlines++;
+    }
+    if (*end==',') p=end+1;
+    else if (*end) return -1;
+    else p=end;
+  }
+  return nlines;
+}
+
+
+// request the lines for an expander as outputs, all high so that the DB9
+// pins start out idle
+static void *gpiochip_backend_open(int bus, uint16_t addr, const char *arg) {
+  struct gpio_v2_line_request req;
+  struct gpiochip_lines *g;
+  int offsets[GPIOCHIP_BITS], bit, chip_fd, n;
+  char chip[256];
+
+  n=gpiochip_parse(arg, gpiochip_count, chip, sizeof(chip), offsets);
+  if (n < 1) {
+    debug_log(LOGLEVEL_ERROR, "GPIO: no lines given for expander %d - expected \"gpio:chip:line,line,...\" with 16 lines per expander", gpiochip_count+1);
+    return NULL;
+  }
+  g=calloc(1, sizeof(struct gpiochip_lines));
+  if (!g) return NULL;
+
+  memset(&req, 0, sizeof(struct gpio_v2_line_request));
+  for(bit=0;bit<GPIOCHIP_BITS;bit++) {
+    g->line_of_bit[bit]=GPIOCHIP_NO_LINE;
+    g->offset_of_bit[bit]=offsets[bit];
+    if (offsets[bit]==GPIOCHIP_NO_LINE) continue;
+    g->line_of_bit[bit]=req.num_lines;
+    req.offsets[req.num_lines++]=offsets[bit];
+  }
+  g->nlines=req.num_lines;
+  snprintf(req.consumer, sizeof(req.consumer), "%s", GPIOCHIP_CONSUMER);
+  req.config.flags=GPIO_V2_LINE_FLAG_OUTPUT;
+  req.config.num_attrs=1;
+  req.config.attrs[0].attr.id=GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  req.config.attrs[0].attr.values=(1ULL<<req.num_lines)-1;
+  req.config.attrs[0].mask=(1ULL<<req.num_lines)-1;
+
+  chip_fd=open(chip, O_RDWR|O_CLOEXEC);
+  if (chip_fd < 0) {
+    debug_log(LOGLEVEL_ERROR, "GPIO: failed to open %s, errno %d", chip, errno);
+    free(g);
+    return NULL;
+  }
+  if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+    debug_log(LOGLEVEL_ERROR, "GPIO: failed to request %d lines from %s, errno %d", g->nlines, chip, errno);
+    close(chip_fd);
+    free(g);
+    return NULL;
+  }
+  close(chip_fd);
+  g->fd=req.fd;
+  debug_log(LOGLEVEL_DEBUG, "GPIO: using %d lines of %s for expander %d", g->nlines, chip, gpiochip_count+1);
+  gpiochip_count++;
+  return g;
+}
+
+
+// write consecutive registers. the output latches of the banks written are
+// set on the lines in a single ioctl, so that all pins of a port change at
+// the same time
+static int gpiochip_backend_write(void *handle, uint8_t regno, const uint8_t *data, int len) {
+  struct gpiochip_lines *g=handle;
+  struct gpio_v2_line_values values;
+  uint8_t r=regno;
+  int i, bit, bank, banks=0;
+
+  if (regno >= MCP_REGISTERS) return -1;
+  for(i=0;i<len;i++) {
+    g->regs[r]=data[i];
+    if (r>=MCP_GPIOA && r<MCP_REGISTERS) {
+      bank=r&1;
+      g->regs[MCP_GPIOA+bank]=g->regs[MCP_OLATA+bank]=data[i];
+      banks|=1<<bank;
+    }
+    r=(r+1)%MCP_REGISTERS;
+  }
+  if (!banks) return 0;
+
+  values.bits=0;
+  values.mask=0;
+  for(bit=0;bit<GPIOCHIP_BITS;bit++) {
+    if (g->line_of_bit[bit]==GPIOCHIP_NO_LINE || !(banks & (1<<(bit/8)))) continue;
+    values.mask|=1ULL<<g->line_of_bit[bit];
+    if (g->regs[MCP_OLATA+bit/8] & (1<<(bit%8))) values.bits|=1ULL<<g->line_of_bit[bit];
+  }
+  values.mask&=~__atomic_load_n(&g->inputs, __ATOMIC_ACQUIRE);
+  if (!values.mask) return 0;
+  if (ioctl(g->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+    debug_log(LOGLEVEL_ERROR, "GPIO: setting line values failed with errno %d", errno);
+    return -1;
+  }
+  debug_log(LOGLEVEL_EXTRADEBUG, "GPIO: set lines to 0x%llx under mask 0x%llx", (unsigned long long)values.bits, (unsigned long long)values.mask);
+  return 0;
+}
+
+
+// read back a register as it was last written
+static int gpiochip_backend_read(void *handle, uint8_t regno, uint8_t *data) {
+  struct gpiochip_lines *g=handle;
+  if (regno >= MCP_REGISTERS) return -1;
+  *data=g->regs[regno];
+  return 0;
+}
+
+
+// turn the line of a GPIO bit into an input reporting both edges, or back
+// into an output at the level of its latch. the other lines keep their
+// direction and level
+static int gpiochip_backend_watch(void *handle, int bit, int input) {
+  struct gpiochip_lines *g=handle;
+  struct gpio_v2_line_config config;
+  uint64_t all=(1ULL<<g->nlines)-1, line, inputs;
+  int b;
+
+  if (g->line_of_bit[bit]==GPIOCHIP_NO_LINE) return -1;
+  line=1ULL<<g->line_of_bit[bit];
+  inputs=input ? (g->inputs | line) : (g->inputs & ~line);
+
+  // lines on their way to becoming inputs are no longer written, while
+  // lines turning back into outputs are written only once they are
+  if (input) __atomic_store_n(&g->inputs, inputs, __ATOMIC_RELEASE);
+  memset(&config, 0, sizeof(struct gpio_v2_line_config));
+  config.flags=GPIO_V2_LINE_FLAG_OUTPUT;
+  config.attrs[config.num_attrs].attr.id=GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  for(b=0;b<GPIOCHIP_BITS;b++) {
+    if (g->line_of_bit[b]!=GPIOCHIP_NO_LINE && (g->regs[MCP_OLATA+b/8] & (1<<(b%8)))) config.attrs[config.num_attrs].attr.values|=1ULL<<g->line_of_bit[b];
+  }
+  config.attrs[config.num_attrs++].mask=all & ~inputs;
+  if (inputs) {
+    config.attrs[config.num_attrs].attr.id=GPIO_V2_LINE_ATTR_ID_FLAGS;
+    config.attrs[config.num_attrs].attr.flags=GPIO_V2_LINE_FLAG_INPUT|GPIO_V2_LINE_FLAG_EDGE_RISING|GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    config.attrs[config.num_attrs++].mask=inputs;
+  }
+  if (ioctl(g->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+    debug_log(LOGLEVEL_ERROR, "GPIO: failed to make line %d an %s, errno %d", g->line_of_bit[bit], input ? "input" : "output", errno);
+    return -1;
+  }
+  if (!input) __atomic_store_n(&g->inputs, inputs, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+// wait for an edge on one of the input lines. the kernel timestamps the
+// edge when it happens, so the time includes any delay in waking up this
+// thread. edges queued before a line was turned back into an output are
+// dropped
+static int gpiochip_backend_wait(void *handle, int *bit, uint64_t *t_ns) {
+  struct gpiochip_lines *g=handle;
+  struct gpio_v2_line_event event;
+  int b;
+
+  do {
+    if (read(g->fd, &event, sizeof(struct gpio_v2_line_event))!=sizeof(struct gpio_v2_line_event)) return -1;
+    for(b=0;b<GPIOCHIP_BITS;b++) {
+      if (g->line_of_bit[b]!=GPIOCHIP_NO_LINE && g->offset_of_bit[b]==(int)event.offset) break;
+    }
+  } while (b==GPIOCHIP_BITS || !(__atomic_load_n(&g->inputs, __ATOMIC_ACQUIRE) & (1ULL<<g->line_of_bit[b])));
+  *bit=b;
+  *t_ns=event.timestamp_ns;
+  return event.id==GPIO_V2_LINE_EVENT_RISING_EDGE;
+}
+
+
+// host GPIO lines, level shifted to the DB9 ports, in place of the MCP23017
+const struct io_backend io_backend_gpio={
+  "gpio",
+  gpiochip_backend_open,
+  gpiochip_backend_write,
+  gpiochip_backend_read,
+  gpiochip_backend_watch,
+  gpiochip_backend_wait,
+  1
+};
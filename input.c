@@ -31,50 +31,189 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <limits.h>
+#include <pthread.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "defaults.h"
 #include "logging.h"
+#include "metrics.h"
+#include "input.h"
 #include "ports.h"
+#include "profile.h"
+#include "record.h"
+#include "sequencer.h"
+#include "timing.h"
 
 
-// sixaxis and dualshock3 have weird undocumented event codes
-#define BTN_SIXAXIS_UP		292
-#define BTN_SIXAXIS_RIGHT	293
-#define BTN_SIXAXIS_DOWN	294
-#define BTN_SIXAXIS_LEFT	295
-#define BTN_SIXAXIS_TRIANGLE	300
-#define BTN_SIXAXIS_CIRCLE	301
-#define BTN_SIXAXIS_CROSS	302
-#define BTN_SIXAXIS_SQUARE	303
+// epoll cookies for the mouse and the hot-plug watch, joysticks use their
+// port index
+#define INPUT_SLOT_MOUSE	MAX_JOYSTICKS
+#define INPUT_SLOT_HOTPLUG	(MAX_JOYSTICKS+1)
 
+// threads probing the event devices at startup, in addition to the main
+// thread
+#define INPUT_PROBE_THREADS	3
 
-// supported dpad event types
-#define DPAD_TYPE_XBOX		1
-#define DPAD_TYPE_GENERIC	2
-#define DPAD_TYPE_SIXAXIS	3
+// stack size of the probe threads, which is locked in real-time mode
+#define INPUT_PROBE_STACK_SIZE	(64*1024)
 
+// events read from a device at once when reading in bulk
+#define INPUT_READ_EVENTS	64
+
+// devices remembered in the capability cache and the length of their names
+#define INPUT_CACHE_ENTRIES	64
+#define INPUT_NAME_LENGTH	80
+
+// an event device being probed. the probe opens the device and reads its
+// capabilities, which is the slow part, and the result is assigned to a
+// port afterwards
+struct input_probe {
+  const char *path;
+  int devno;
+  int fd;
+  int error;
+  struct libevdev *dev;
+  struct input_id id;
+  char name[INPUT_NAME_LENGTH];
+  int role;
+  const struct profile *profile;
+};
+
+// a device seen before, keyed by its bus, vendor, product, version and
+// name, with the profile it matched if it's of use. a key seen with
+// different roles or profiles, such as the interfaces of a combined
+// keyboard and mouse receiver, is kept as unknown
+struct input_cache_entry {
+  struct input_id id;
+  char name[INPUT_NAME_LENGTH];
+  int role;
+  const struct profile *profile;
+};
 
 // event device numbers set on command line
-int mouse_devno=-1, joy1_devno=-1, joy2_devno=-1;
+int mouse_devno=-1, joy_devno[MAX_JOYSTICKS]={ [0 ... MAX_JOYSTICKS-1]=-1 };
 
 // number of gamepads found, boolean for mouse found
 int gamepads_found=0, mouse_found=0;
 
 // linux evdev structs for assigned devices
-struct libevdev *dev_joysticks[MAX_JOYSTICKS]={NULL, NULL};
+struct libevdev *dev_joysticks[MAX_JOYSTICKS];
 struct libevdev *dev_mouse = NULL;
 
+// event device numbers attached to each slot, -1 for none
+int input_slot_devno[MAX_JOYSTICKS+1];
+
+// port assignment for devices attached after startup and the number of
+// ports joysticks can be attached to
+int input_mouse_port=1, input_first_joystick=0, input_port_count=2;
+
+// inotify descriptor watching /dev/input for new devices
+int input_inotify=-1;
+
+// time of the startup scan, the time each slot was last vacated and
+// whether the first event has been forwarded yet
+uint64_t input_start_time=0, input_detach_time[MAX_JOYSTICKS+1];
+int input_first_event_seen=0;
+
+// next device to probe and the number of devices found by the scan
+int input_probe_next=0, input_probe_total=0;
+
+// capability cache file, its entries and whether it needs to be saved
+const char *input_cache_path=NULL;
+struct input_cache_entry input_cache[INPUT_CACHE_ENTRIES];
+int input_cache_total=0, input_cache_dirty=0;
+
+// replay recorded events as fast as possible instead of at their pace
+int input_replay_fast=0;
+
+// dispatch tables compiled from the profiles of the attached devices
+struct profile_table input_tables[MAX_JOYSTICKS+1];
+
+// changes made by the events of the current frame of each slot and the
+// number of events in it
+struct port_frame input_frames[MAX_JOYSTICKS+1];
+int input_frame_events[MAX_JOYSTICKS+1];
+
+// pad button of each button action other than fire
+const int input_action_button[PROFILE_ACTIONS]={
+  [PROFILE_ACTION_NORTH]=PORT_BUTTON_NORTH, [PROFILE_ACTION_EAST]=PORT_BUTTON_EAST,
+  [PROFILE_ACTION_WEST]=PORT_BUTTON_WEST, [PROFILE_ACTION_TL]=PORT_BUTTON_TL,
+  [PROFILE_ACTION_TR]=PORT_BUTTON_TR, [PROFILE_ACTION_START]=PORT_BUTTON_START,
+  [PROFILE_ACTION_SELECT]=PORT_BUTTON_SELECT
+};
+
+// read the devices in bulk rather than through libevdev, the buffer each
+// device is read into, and whether the rest of a frame is being skipped
+// after dropped events with the SYN_DROPPED which started it
+int input_bulk_read=0;
+struct input_event input_read_buffer[MAX_JOYSTICKS+1][INPUT_READ_EVENTS];
+int input_resync_pending[MAX_JOYSTICKS+1];
+struct input_event input_resync_dropped[MAX_JOYSTICKS+1];
+
+// thread id and cpu time clock of the poll thread, for measuring its cost
+pid_t input_thread_tid=0;
+clockid_t input_thread_clock;
+
+// events, frames and resyncs of each slot, exported as metrics
+int64_t *metric_input_events[MAX_JOYSTICKS+1], *metric_input_frames[MAX_JOYSTICKS+1];
+int64_t *metric_input_frame_events[MAX_JOYSTICKS+1], *metric_input_resyncs[MAX_JOYSTICKS+1];
+
+
+// throw away the changes of the current frame of a slot
+static void input_frame_reset(int slot) {
+  port_frame_begin(&input_frames[slot], slot==INPUT_SLOT_MOUSE ? PORT_FRAME_MOUSE : slot);
+  input_frame_events[slot]=0;
+}
+
 
 // designate a particular event device number for a device
 void input_set_mouse_device(int d) { mouse_devno=d; }
-void input_set_joystick1_device(int d) { joy1_devno=d; }
-void input_set_joystick2_device(int d) { joy2_devno=d; }
+void input_set_joystick_device(int n, int d) { if (n>=0 && n<MAX_JOYSTICKS) joy_devno[n]=d; }
+
+// set the time startup began, for reporting the time to the first event
+void input_set_start_time(uint64_t t) { input_start_time=t; }
+
+// read the devices in bulk instead of one event at a time through libevdev
+void input_set_bulk_read(int enabled) { input_bulk_read=enabled; }
+
+
+// get the cpu time used by the poll thread and the read system calls it
+// has made. returns -1 if the thread isn't running or can't be measured
+int input_thread_usage(uint64_t *cpu_ns, uint64_t *reads) {
+  pid_t tid=__atomic_load_n(&input_thread_tid, __ATOMIC_ACQUIRE);
+  struct timespec ts;
+  char path[64], line[64];
+  unsigned long long syscr;
+  FILE *f;
+  int found=0;
+
+  if (!tid || clock_gettime(input_thread_clock, &ts) < 0) return -1;
+  *cpu_ns=(uint64_t)ts.tv_sec*NSEC_PER_SEC+ts.tv_nsec;
+
+  // the kernel counts the read calls of each thread in its io statistics
+  snprintf(path, sizeof(path), "/proc/self/task/%d/io", (int)tid);
+  f=fopen(path, "r");
+  if (!f) return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "syscr: %llu", &syscr)==1) {
+      *reads=syscr;
+      found=1;
+    }
+  }
+  fclose(f);
+  return found ? 0 : -1;
+}
 
 
 // return the number of joysticks connected
@@ -89,229 +228,852 @@ int input_mouse_connected(void) {
 }
 
 
+// return nonzero if an event device number is already attached to a port
+static int input_device_attached(int devno) {
+  int i;
+  for(i=0;i<=INPUT_SLOT_MOUSE;i++) {
+    if (input_slot_devno[i]==devno) return 1;
+  }
+  return 0;
+}
+
+
+// find the role of a device in the capability cache, and the profile it
+// matched if it's of use
+static int input_cache_lookup(const struct input_id *id, const char *name, const struct profile **profile) {
+  int i;
+
+  *profile=NULL;
+  for(i=0;i<input_cache_total;i++) {
+    if (memcmp(&input_cache[i].id, id, sizeof(struct input_id)) || strcmp(input_cache[i].name, name)) continue;
+    *profile=input_cache[i].profile;
+    return input_cache[i].role;
+  }
+  return INPUT_ROLE_UNKNOWN;
+}
+
+
+// remember the role and profile of a device, or forget them if the same
+// key has been seen with a different role or profile
+static void input_cache_store(const struct input_id *id, const char *name, int role, const struct profile *profile) {
+  struct input_cache_entry *c;
+  int i;
+
+  if (!input_cache_path || !id->bustype) return;
+  for(i=0;i<input_cache_total;i++) {
+    c=&input_cache[i];
+    if (memcmp(&c->id, id, sizeof(struct input_id)) || strcmp(c->name, name)) continue;
+    if ((c->role!=role || c->profile!=profile) && c->role!=INPUT_ROLE_UNKNOWN) {
+      c->role=INPUT_ROLE_UNKNOWN;
+      c->profile=NULL;
+      input_cache_dirty=1;
+    }
+    return;
+  }
+  if (input_cache_total==INPUT_CACHE_ENTRIES) return;
+  c=&input_cache[input_cache_total++];
+  c->id=*id;
+  snprintf(c->name, INPUT_NAME_LENGTH, "%s", name);
+  c->role=role;
+  c->profile=profile;
+  input_cache_dirty=1;
+}
+
+
+// write the capability cache if it has changed. the new cache is written
+// next to the old one and renamed over it, so it's never left half written
+static void input_save_cache(void) {
+  char tmp[PATH_MAX];
+  FILE *f;
+  int i;
+
+  if (!input_cache_path || !input_cache_dirty) return;
+  input_cache_dirty=0;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", input_cache_path);
+  f=fopen(tmp, "w");
+  if (!f) {
+    debug_log(LOGLEVEL_ERROR, "Failed to write device cache %s, errno %d", tmp, errno);
+    return;
+  }
+  fprintf(f, "# joyemu device cache: bus vendor product version role profile name\n");
+  fprintf(f, "profiles %08x\n", profile_signature());
+  for(i=0;i<input_cache_total;i++) {
+    fprintf(f, "%04x %04x %04x %04x %d %s %s\n", input_cache[i].id.bustype, input_cache[i].id.vendor,
+      input_cache[i].id.product, input_cache[i].id.version, input_cache[i].role,
+      input_cache[i].profile ? input_cache[i].profile->name : "-", input_cache[i].name);
+  }
+  if (fclose(f) || rename(tmp, input_cache_path)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to write device cache %s, errno %d", input_cache_path, errno);
+    unlink(tmp);
+  }
+}
+
+
+// load the capability cache from a file. a missing file is an empty cache,
+// and lines which can't be parsed are skipped, as are all lines of a cache
+// written before profiles were remembered. the profiles remembered for
+// devices of use are only valid for the profiles they were matched against,
+// so if those have changed the devices are probed again
+int input_load_cache(const char *path) {
+  struct input_cache_entry *c;
+  const struct profile *profile;
+  char line[256], profile_name[PROFILE_NAME_LENGTH];
+  unsigned int bus, vendor, product, version, signature;
+  int role, n, profiles_seen=0, profiles_valid=0;
+  FILE *f;
+
+  input_cache_path=path;
+  f=fopen(path, "r");
+  if (!f) {
+    if (errno==ENOENT) return 0;
+    debug_log(LOGLEVEL_ERROR, "Failed to read device cache %s, errno %d", path, errno);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) && input_cache_total < INPUT_CACHE_ENTRIES) {
+    line[strcspn(line, "\n")]=0;
+    if (sscanf(line, "profiles %x", &signature)==1) {
+      profiles_seen=1;
+      profiles_valid=(signature==profile_signature());
+      if (!profiles_valid) input_cache_dirty=1;
+      continue;
+    }
+    if (!profiles_seen) continue;
+    if (sscanf(line, "%x %x %x %x %d %31s %n", &bus, &vendor, &product, &version, &role, profile_name, &n)!=6) continue;
+    if (role < INPUT_ROLE_UNKNOWN || role > INPUT_ROLE_MOUSE) continue;
+    profile=NULL;
+    if (role==INPUT_ROLE_JOYSTICK || role==INPUT_ROLE_MOUSE) {
+      if (!profiles_valid || !(profile=profile_find(profile_name)) || profile->role!=role) continue;
+    }
+    c=&input_cache[input_cache_total++];
+    c->id.bustype=bus;
+    c->id.vendor=vendor;
+    c->id.product=product;
+    c->id.version=version;
+    c->role=role;
+    c->profile=profile;
+    snprintf(c->name, INPUT_NAME_LENGTH, "%s", line+n);
+  }
+  fclose(f);
+  debug_log(LOGLEVEL_VERBOSE, "Loaded %d devices from device cache %s", input_cache_total, path);
+  return 0;
+}
+
+
+// open an event device and read its capabilities. devices the cache knows
+// to be of no use are closed without the full capability walk, and those
+// it knows the profile of skip matching the profiles. this runs on the
+// probe threads, so it doesn't log anything
+static void input_probe_device(struct input_probe *p) {
+  int rc;
+
+  p->dev=NULL;
+  p->error=0;
+  p->role=INPUT_ROLE_UNKNOWN;
+  p->profile=NULL;
+  p->fd=open(p->path, O_RDONLY|O_NONBLOCK);
+  if (p->fd < 0) {
+    p->error=errno;
+    return;
+  }
+  memset(&p->id, 0, sizeof(struct input_id));
+  p->name[0]=0;
+  if (ioctl(p->fd, EVIOCGID, &p->id) >= 0 && ioctl(p->fd, EVIOCGNAME(INPUT_NAME_LENGTH-1), p->name) >= 0) {
+    p->role=input_cache_lookup(&p->id, p->name, &p->profile);
+    if (p->role==INPUT_ROLE_NONE && profile_may_match(p->id.vendor, p->id.product)) p->role=INPUT_ROLE_UNKNOWN;
+  }
+  if (p->role==INPUT_ROLE_NONE) {
+    close(p->fd);
+    p->fd=-1;
+    return;
+  }
+  rc=libevdev_new_from_fd(p->fd, &p->dev);
+  if (rc < 0) {
+    p->error=rc;
+    p->dev=NULL;
+    close(p->fd);
+    p->fd=-1;
+    return;
+  }
+  // timestamp events on the same clock as everything else
+  libevdev_set_clock_id(p->dev, CLOCK_MONOTONIC);
+}
+
+
+// note the device attached to a slot in the recording with its ids, the
+// profile it matched and the thresholds of its absolute axes, so that a
+// replay dispatches its events the same way
+static void input_record_device(int slot, const struct input_id *id) {
+  const struct profile_table *t=&input_tables[slot];
+  int rslot=(slot==INPUT_SLOT_MOUSE) ? RECORD_SLOT_MOUSE : slot, code;
+
+  record_device(rslot, RECORD_TYPE_DEVICE, profile_id(t->profile), (int32_t)(((uint32_t)id->vendor << 16) | id->product));
+  for(code=0;code<PROFILE_ABS_CODES;code++) {
+    if (!t->abs_low[code] && !t->abs_high[code]) continue;
+    record_device(rslot, RECORD_TYPE_ABS_LOW, code, t->abs_low[code]);
+    record_device(rslot, RECORD_TYPE_ABS_HIGH, code, t->abs_high[code]);
+  }
+}
+
+
+// attach a probed device to a free port if it's suitable. devices which
+// aren't used are closed again. returns the slot the device was attached
+// to or -1
+static int input_assign_device(struct input_probe *p) {
+  struct libevdev *dev=p->dev;
+  const struct profile *profile;
+  int i, role, slot=-1;
+
+  debug_log(LOGLEVEL_VERBOSE, "Checking device %s, number %d", p->path, p->devno);
+  if (p->fd < 0) {
+    // open errors are positive errnos, libevdev errors negative ones
+    if (p->error > 0) debug_log(LOGLEVEL_DEBUG, "Failed to open %s, errno %d", p->path, p->error);
+    else if (p->error < 0) debug_log(LOGLEVEL_ERROR, "Failed to init libevdev (%s)", strerror(-p->error));
+    else debug_log(LOGLEVEL_DEBUG, "\"%s\" is in the device cache as neither a gamepad nor a mouse", p->name);
+    return -1;
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Input device name: \"%s\"", libevdev_get_name(dev));
+  debug_log(LOGLEVEL_DEBUG, "Input device ID: bus %#x vendor %#x product %#x",
+    libevdev_get_id_bustype(dev),
+    libevdev_get_id_vendor(dev),
+    libevdev_get_id_product(dev));
+
+  // the profile of a device in the cache is taken as it is, otherwise the
+  // device is checked against the profiles
+  if (p->profile) {
+    profile=p->profile;
+    debug_log(LOGLEVEL_DEBUG, "Device is in the device cache with profile %s", profile->name);
+  } else {
+    profile=profile_match(dev);
+    if (profile) debug_log(LOGLEVEL_DEBUG, "Device matches profile %s", profile->name);
+    else debug_log(LOGLEVEL_DEBUG, "Device doesn't match any profile");
+  }
+  role=profile ? profile->role : INPUT_ROLE_NONE;
+  if (p->role==INPUT_ROLE_UNKNOWN) input_cache_store(&p->id, p->name, role, profile);
+  if (role==INPUT_ROLE_JOYSTICK) {
+    if (gamepads_found < input_port_count) {
+      if (joy_devno[gamepads_found]==-1 || joy_devno[gamepads_found]==p->devno) {
+        // take the first free port, starting from the first joystick port
+        for(i=0;i<input_port_count && slot<0;i++) {
+          if (!dev_joysticks[(input_first_joystick+i)%input_port_count]) slot=(input_first_joystick+i)%input_port_count;
+        }
+        dev_joysticks[slot]=dev;
+        gamepads_found++;
+        debug_log(LOGLEVEL_INFO, "Using \"%s\" to emulate a joystick in port %d", libevdev_get_name(dev), slot+1);
+      }
+    }
+  } else if (role==INPUT_ROLE_MOUSE) {
+    if (!mouse_found) {
+      if (mouse_devno==-1 || mouse_devno==p->devno) {
+        mouse_found=1;
+        dev_mouse=dev;
+        slot=INPUT_SLOT_MOUSE;
+        debug_log(LOGLEVEL_INFO, "Using \"%s\" to emulate a mouse in port %d", libevdev_get_name(dev), input_mouse_port);
+      } else {
+        debug_log(LOGLEVEL_DEBUG, "Device %d appears to be a mouse but use designated device number %d", p->devno, mouse_devno);
+      }
+    }
+  }
+
+  if (slot < 0) {
+    libevdev_free(dev);
+    close(p->fd);
+    return -1;
+  }
+  input_slot_devno[slot]=p->devno;
+  profile_compile(profile, dev, &input_tables[slot]);
+  input_frame_reset(slot);
+  input_resync_pending[slot]=0;
+  input_record_device(slot, &p->id);
+
+  // time since the previous device in this slot went away
+  if (input_detach_time[slot]) {
+    debug_log(LOGLEVEL_INFO, "Reconnected %s after %.1f ms", slot==INPUT_SLOT_MOUSE ? "mouse" : "joystick",
+      (double)(timing_now_ns()-input_detach_time[slot])/NSEC_PER_MSEC);
+    input_detach_time[slot]=0;
+  }
+  return slot;
+}
+
+
+// probe an event device and attach it to a free port if it's suitable
+static int input_attach_device(const char *path, int devno) {
+  struct input_probe p;
+
+  p.path=path;
+  p.devno=devno;
+  input_probe_device(&p);
+  return input_assign_device(&p);
+}
+
+
+// probe thread taking devices from the list until all have been probed
+static void *input_probe_worker(void *params) {
+  struct input_probe *probes=params;
+  int i;
+
+  while ((i=__atomic_fetch_add(&input_probe_next, 1, __ATOMIC_RELAXED)) < input_probe_total) {
+    input_probe_device(&probes[i]);
+  }
+  return NULL;
+}
+
+
+// release an attached device which has gone away and return its port to
+// the idle state
+static void input_detach_device(int epfd, int slot) {
+  struct libevdev *dev=(slot==INPUT_SLOT_MOUSE) ? dev_mouse : dev_joysticks[slot];
+  int fd=libevdev_get_fd(dev), i;
+
+  if (slot==INPUT_SLOT_MOUSE) {
+    debug_log(LOGLEVEL_INFO, "Mouse \"%s\" disconnected from port %d", libevdev_get_name(dev), input_mouse_port);
+    dev_mouse=NULL;
+    mouse_found=0;
+    mouse_set_lmb(0);
+    mouse_set_rmb(0);
+  } else {
+    debug_log(LOGLEVEL_INFO, "Joystick \"%s\" disconnected from port %d", libevdev_get_name(dev), slot+1);
+    dev_joysticks[slot]=NULL;
+    gamepads_found--;
+    joystick_release(slot);
+    for(i=0;i<SEQ_BUTTONS;i++) seq_button_event(slot, i, 0);
+  }
+  input_frame_reset(slot);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  libevdev_free(dev);
+  close(fd);
+  input_slot_devno[slot]=-1;
+  input_detach_time[slot]=timing_now_ns();
+}
+
+
 // scan linux event devices under /dev/input and query their capabilities.
-// depending on event types and codes, a device may be accepted either as
-// a gamepad/joystick or a mouse. 
-int input_scan_devices(int mouse_to_port, int first_joystick) {
-  int fd, rc, i, devno;
+// opening a device and reading its capabilities can take milliseconds, so
+// the devices are probed by several threads and then assigned to ports in
+// the order they were found. devices appearing later are picked up by the
+// hot-plug watch, which is set up before the scan so that none can slip in
+// between
+int input_scan_devices(int mouse_to_port, int first_joystick, int ports) {
+  pthread_t probe_threads[INPUT_PROBE_THREADS];
+  pthread_attr_t attr;
+  struct input_probe *probes;
+  int rc, i, threads=0;
   glob_t glob_result;
-  struct libevdev *dev = NULL;
-  int attach_to_port=(first_joystick-1)%MAX_JOYSTICKS;
+  uint64_t t=timing_now_ns();
+
+  if (!input_start_time) input_start_time=t;
+  input_mouse_port=mouse_to_port;
+  input_port_count=ports;
+  input_first_joystick=(first_joystick-1)%ports;
+  for(i=0;i<=INPUT_SLOT_MOUSE;i++) input_slot_devno[i]=-1;
+
+  input_inotify=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (input_inotify < 0 || inotify_add_watch(input_inotify, "/dev/input", IN_CREATE|IN_ATTRIB) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to watch /dev/input for new devices, errno %d", errno);
+  }
   
   rc=glob("/dev/input/event*", GLOB_ERR, NULL, &glob_result);
-  if (!rc) {
-    // ok, what did we find?
-    int i=0;
-    for(i=0;i<glob_result.gl_pathc;i++) {
-      sscanf(glob_result.gl_pathv[i], "/dev/input/event%d", &devno);
-      debug_log(LOGLEVEL_VERBOSE, "Checking device %s, number %d", glob_result.gl_pathv[i], devno);
-
-      fd = open(glob_result.gl_pathv[i], O_RDONLY|O_NONBLOCK);
-      rc = libevdev_new_from_fd(fd, &dev);
-      if (rc < 0) {
-        debug_log(LOGLEVEL_ERROR, "Failed to init libevdev (%s)", strerror(-rc));
+  if (rc) return rc; // GLOB_NOSPACE, GLOB_ABORTED or GLOB_NOMATCH
+  probes=calloc(glob_result.gl_pathc, sizeof(struct input_probe));
+  if (!probes) {
+    globfree(&glob_result);
+    return GLOB_NOSPACE;
+  }
+  for(i=0;i<glob_result.gl_pathc;i++) {
+    if (sscanf(glob_result.gl_pathv[i], "/dev/input/event%d", &probes[input_probe_total].devno)!=1) continue;
+    probes[input_probe_total++].path=glob_result.gl_pathv[i];
+  }
+
+  // the main thread probes too, so a single device needs no threads
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, INPUT_PROBE_STACK_SIZE);
+  while (threads < INPUT_PROBE_THREADS && threads < input_probe_total-1) {
+    if (pthread_create(&probe_threads[threads], &attr, input_probe_worker, probes)) break;
+    threads++;
+  }
+  pthread_attr_destroy(&attr);
+  input_probe_worker(probes);
+  for(i=0;i<threads;i++) pthread_join(probe_threads[i], NULL);
+
+  // ok, what did we find?
+  for(i=0;i<input_probe_total;i++) input_assign_device(&probes[i]);
+  debug_log(LOGLEVEL_VERBOSE, "Probed %d input devices with %d threads in %.1f ms", input_probe_total, threads+1,
+    (double)(timing_now_ns()-t)/NSEC_PER_MSEC);
+  input_save_cache();
+  free(probes);
+  globfree(&glob_result);
+  return 0;
+}
+
+
+// add an assigned device to the epoll set, using the slot as the event cookie
+static int input_watch_device(int epfd, int slot, struct libevdev *dev) {
+  struct epoll_event ee;
+
+  memset(&ee, 0, sizeof(struct epoll_event));
+  ee.events=EPOLLIN;
+  ee.data.u32=slot;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, libevdev_get_fd(dev), &ee) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to watch \"%s\" for events, errno %d", libevdev_get_name(dev), errno);
+    return -1;
+  }
+  return 0;
+}
+
+
+// handle new or changed device nodes under /dev/input. a node may only
+// become readable once udev has set its permissions, so attribute changes
+// are tried as well
+static void input_handle_hotplug(int epfd) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[PATH_MAX];
+  const struct inotify_event *ie;
+  uint64_t t;
+  ssize_t len;
+  char *p;
+  int devno, slot;
+
+  while ((len=read(input_inotify, buf, sizeof(buf))) > 0) {
+    for(p=buf;p<buf+len;p+=sizeof(struct inotify_event)+ie->len) {
+      ie=(const struct inotify_event *)p;
+      if (!ie->len || sscanf(ie->name, "event%d", &devno)!=1) continue;
+      if (input_device_attached(devno)) continue;
+
+      t=timing_now_ns();
+      snprintf(path, sizeof(path), "/dev/input/%s", ie->name);
+      slot=input_attach_device(path, devno);
+      if (slot < 0) continue;
+      input_watch_device(epfd, slot, slot==INPUT_SLOT_MOUSE ? dev_mouse : dev_joysticks[slot]);
+      debug_log(LOGLEVEL_VERBOSE, "Attached %s in %.1f ms", path, (double)(timing_now_ns()-t)/NSEC_PER_MSEC);
+    }
+  }
+  input_save_cache();
+}
+
+
+// state of a joystick axis bound to an event. absolute axes have their
+// thresholds in the dispatch table, other events are taken by their sign
+static int input_axis_state(const struct profile_table *t, const struct input_event *ev) {
+  if (ev->type!=EV_ABS) return (ev->value > 0)-(ev->value < 0);
+  return (ev->value > t->abs_high[ev->code])-(ev->value < t->abs_low[ev->code]);
+}
+
+
+// dispatch an event to the port emulation through the dispatch table of
+// the slot it was read for. returns nonzero if the event was forwarded
+static int input_dispatch_event(int slot, const struct input_event *ev) {
+  const struct profile_table *t=&input_tables[slot];
+  struct port_frame *f=&input_frames[slot];
+  const struct profile_action *a;
+  int i=profile_index(ev->type, ev->code);
+
+  if (slot==INPUT_SLOT_MOUSE) {
+    debug_log(LOGLEVEL_EXTRADEBUG, "Mouse: %s %s %d", libevdev_event_type_get_name(ev->type), libevdev_event_code_get_name(ev->type, ev->code), ev->value);
+  } else {
+    debug_log(LOGLEVEL_EXTRADEBUG, "Joystick %d: %s %s %d", slot+1, libevdev_event_type_get_name(ev->type), libevdev_event_code_get_name(ev->type, ev->code), ev->value);
+  }
+
+  // a report ends the frame, committing all of its changes at once
+  if (ev->type==EV_SYN) {
+    if (ev->code==SYN_DROPPED) input_frame_reset(slot);
+    if (ev->code!=SYN_REPORT) return 0;
+    metrics_add(metric_input_frames[slot], 1);
+    metrics_add(metric_input_frame_events[slot], input_frame_events[slot]);
+    input_frame_events[slot]=0;
+    return port_frame_commit(f);
+  }
+  input_frame_events[slot]++;
+  if (i < 0) return 0;
+  a=&t->action[i];
+
+  // buttons with autofire or a macro are run by the port I/O thread
+  if (a->seq_button >= 0 && slot!=INPUT_SLOT_MOUSE && seq_button_event(slot, a->seq_button, ev->value)) return 1;
+  // a held key repeating changes nothing
+  if (ev->type==EV_KEY && ev->value==2) return 0;
+
+  switch(a->action) {
+    case PROFILE_ACTION_UP:
+    joystick_frame_axis(f, PORT_AXIS_VERTICAL, PORT_AXIS_STATE_UP * ev->value);
+    break;
+
+    case PROFILE_ACTION_DOWN:
+    joystick_frame_axis(f, PORT_AXIS_VERTICAL, PORT_AXIS_STATE_DOWN * ev->value);
+    break;
+
+    case PROFILE_ACTION_LEFT:
+    joystick_frame_axis(f, PORT_AXIS_HORIZONTAL, PORT_AXIS_STATE_LEFT * ev->value);
+    break;
+
+    case PROFILE_ACTION_RIGHT:
+    joystick_frame_axis(f, PORT_AXIS_HORIZONTAL, PORT_AXIS_STATE_RIGHT * ev->value);
+    break;
+
+    case PROFILE_ACTION_AXIS_X:
+    joystick_frame_axis(f, PORT_AXIS_HORIZONTAL, input_axis_state(t, ev));
+    break;
+
+    case PROFILE_ACTION_AXIS_Y:
+    joystick_frame_axis(f, PORT_AXIS_VERTICAL, input_axis_state(t, ev));
+    break;
+
+    case PROFILE_ACTION_FIRE:
+    joystick_frame_fire(f, ev->value);
+    break;
+
+    case PROFILE_ACTION_NORTH:
+    case PROFILE_ACTION_EAST:
+    case PROFILE_ACTION_WEST:
+    case PROFILE_ACTION_TL:
+    case PROFILE_ACTION_TR:
+    case PROFILE_ACTION_START:
+    case PROFILE_ACTION_SELECT:
+    joystick_frame_button(f, input_action_button[a->action], ev->value);
+    break;
+
+    case PROFILE_ACTION_MOUSE_X:
+    mouse_frame_move(f, PORT_AXIS_HORIZONTAL, ev->value);
+    break;
+
+    case PROFILE_ACTION_MOUSE_Y:
+    mouse_frame_move(f, PORT_AXIS_VERTICAL, ev->value);
+    break;
+
+    case PROFILE_ACTION_LMB:
+    mouse_frame_lmb(f, ev->value);
+    break;
+
+    case PROFILE_ACTION_RMB:
+    mouse_frame_rmb(f, ev->value);
+    break;
+  }
+  return 0;
+}
+
+
+// bring a slot back up to date after dropped events from the full state
+// of the device as a libevdev instance knows it. the state is fed through
+// the dispatch as a frame which first releases everything and then sets
+// whatever is held or deflected, stamped with the time of the SYN_DROPPED
+// which triggered it. returns 1 if the port state changed
+static int input_resync_state(int slot, struct libevdev *state, const struct input_event *dropped) {
+  struct port_frame *f=&input_frames[slot];
+  const struct profile_table *t=&input_tables[slot];
+  const struct profile_action *a;
+  struct input_event ev;
+  static const uint16_t types[]={ EV_KEY, EV_ABS };
+  int i, code;
+
+  if (slot==INPUT_SLOT_MOUSE) {
+    mouse_frame_lmb(f, 0);
+    mouse_frame_rmb(f, 0);
+  } else {
+    joystick_frame_release(f);
+    for(i=0;i<SEQ_BUTTONS;i++) seq_button_event(slot, i, 0);
+  }
+
+  ev=*dropped;
+  for(i=0;i<2;i++) {
+    ev.type=types[i];
+    for(code=0;code<profile_type_codes[ev.type];code++) {
+      a=&t->action[profile_type_base[ev.type]+code];
+      if ((a->action==PROFILE_ACTION_NONE && a->seq_button < 0) || !libevdev_has_event_code(state, ev.type, code)) continue;
+      ev.code=code;
+      ev.value=libevdev_get_event_value(state, ev.type, code);
+      if (ev.type==EV_KEY && !ev.value) continue;
+      record_event(slot==INPUT_SLOT_MOUSE ? RECORD_SLOT_MOUSE : slot, &ev);
+      input_dispatch_event(slot, &ev);
+    }
+  }
+  ev.type=EV_SYN;
+  ev.code=SYN_REPORT;
+  ev.value=0;
+  record_event(slot==INPUT_SLOT_MOUSE ? RECORD_SLOT_MOUSE : slot, &ev);
+  return input_dispatch_event(slot, &ev);
+}
+
+
+// read every pending event from a device through libevdev and dispatch
+// them. when the kernel buffer overflows and events are dropped, libevdev
+// reads the device state again, which already includes the changes of the
+// dropped events, so its deltas can't replay them. the partial frame is
+// thrown away and the slot is set from the full state instead, and the
+// deltas are skipped by going on with normal reads. returns -EAGAIN once
+// the device has no more events
+static int input_read_libevdev(int slot, int *events, int *forwarded) {
+  struct libevdev *dev=(slot==INPUT_SLOT_MOUSE) ? dev_mouse : dev_joysticks[slot];
+  struct input_event ev;
+  int rc;
+
+  for(;;) {
+    rc=libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+    if (rc < 0) return rc;
+    (*events)++;
+    record_event(slot==INPUT_SLOT_MOUSE ? RECORD_SLOT_MOUSE : slot, &ev);
+    if (rc==LIBEVDEV_READ_STATUS_SYNC) {
+      debug_log(LOGLEVEL_VERBOSE, "Events dropped by \"%s\", resyncing", libevdev_get_name(dev));
+      metrics_add(metric_input_resyncs[slot], 1);
+      input_dispatch_event(slot, &ev);
+      *forwarded|=input_resync_state(slot, dev, &ev);
+      continue;
+    }
+    *forwarded|=input_dispatch_event(slot, &ev);
+  }
+}
+
+
+// bring a device read in bulk back up to date after dropped events. the
+// events libevdev has seen are stale, so the state is fetched again into a
+// new libevdev instance. returns 1 if the port state changed or the
+// negative errno from libevdev
+static int input_resync_bulk(int slot, const struct input_event *dropped) {
+  struct libevdev **dev=(slot==INPUT_SLOT_MOUSE) ? &dev_mouse : &dev_joysticks[slot];
+  struct libevdev *fresh;
+  int rc;
+
+  rc=libevdev_new_from_fd(libevdev_get_fd(*dev), &fresh);
+  if (rc < 0) return rc;
+  libevdev_free(*dev);
+  *dev=fresh;
+  return input_resync_state(slot, fresh, dropped);
+}
+
+
+// read every pending event from a device with plain read()s into its
+// buffer and dispatch them, which avoids a libevdev call per event. after
+// dropped events the rest of the partial frame is skipped and the device
+// state is fetched again. returns -EAGAIN once the device has no more
+// events
+static int input_read_bulk(int slot, int *events, int *forwarded) {
+  struct libevdev *dev=(slot==INPUT_SLOT_MOUSE) ? dev_mouse : dev_joysticks[slot];
+  struct input_event *buffer=input_read_buffer[slot], *ev;
+  ssize_t n;
+  int rc, count;
+
+  do {
+    n=read(libevdev_get_fd(dev), buffer, INPUT_READ_EVENTS*sizeof(struct input_event));
+    if (n < 0) return (errno==EINTR) ? -EAGAIN : -errno;
+    count=n/sizeof(struct input_event);
+    for(ev=buffer;ev<buffer+count;ev++) {
+      (*events)++;
+      record_event(slot==INPUT_SLOT_MOUSE ? RECORD_SLOT_MOUSE : slot, ev);
+      if (ev->type==EV_SYN && ev->code==SYN_DROPPED) {
+        debug_log(LOGLEVEL_VERBOSE, "Events dropped by \"%s\", resyncing", libevdev_get_name(dev));
+        metrics_add(metric_input_resyncs[slot], 1);
+        input_dispatch_event(slot, ev);
+        input_resync_pending[slot]=1;
+        input_resync_dropped[slot]=*ev;
+      } else if (input_resync_pending[slot]) {
+        if (ev->type!=EV_SYN || ev->code!=SYN_REPORT) continue;
+        input_resync_pending[slot]=0;
+        rc=input_resync_bulk(slot, &input_resync_dropped[slot]);
+        if (rc < 0) return rc;
+        *forwarded|=rc;
+        dev=(slot==INPUT_SLOT_MOUSE) ? dev_mouse : dev_joysticks[slot];
       } else {
-        debug_log(LOGLEVEL_VERBOSE, "Input device name: \"%s\"", libevdev_get_name(dev));
-        debug_log(LOGLEVEL_DEBUG, "Input device ID: bus %#x vendor %#x product %#x",
-          libevdev_get_id_bustype(dev),
-          libevdev_get_id_vendor(dev),
-          libevdev_get_id_product(dev));
-          
-        // is this a gamepad, a mouse or neither?
-        if (!libevdev_has_event_type(dev, EV_REL) ||
-            !libevdev_has_event_code(dev, EV_KEY, BTN_LEFT) ||
-            !libevdev_has_event_code(dev, EV_KEY, BTN_RIGHT)) {
-          // not likely to be a mouse
-          debug_log(LOGLEVEL_DEBUG, "Doesn't look like a mouse");
-          
-          int has_dpad=0, has_fire=0;
-          
-          // xbox controllers send EV_ABS with ABS_HAT0X and ABS_HAT0Y
-          if (libevdev_has_event_type(dev, EV_ABS) &&
-              libevdev_has_event_code(dev, EV_ABS, ABS_HAT0X) &&
-              libevdev_has_event_code(dev, EV_ABS, ABS_HAT0Y)
-             )
-          {
-            has_dpad=DPAD_TYPE_XBOX;
-          } else {
-            // generic dpad events sent as EV_KEY
-            if (libevdev_has_event_type(dev, EV_KEY) &&
-                libevdev_has_event_code(dev, EV_KEY, BTN_DPAD_UP) &&
-                libevdev_has_event_code(dev, EV_KEY, BTN_DPAD_RIGHT) &&
-                libevdev_has_event_code(dev, EV_KEY, BTN_DPAD_DOWN) &&
-                libevdev_has_event_code(dev, EV_KEY, BTN_DPAD_LEFT)
-               )
-            {
-              has_dpad=DPAD_TYPE_GENERIC;
-            } else {
-              // sixaxis and dualshock3 send very unstandard event codes
-              if (libevdev_has_event_type(dev, EV_KEY) &&
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_UP) &&
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_RIGHT) &&
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_DOWN) &&
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_LEFT)
-                 )
-              {
-                has_dpad=DPAD_TYPE_SIXAXIS;
-              }
-            }
-          }
-          
-          if (has_dpad) {
-            debug_log(LOGLEVEL_DEBUG, "Device has a dpad, event type %d", has_dpad);
-            // need to find at least one fire button in addition to dpad
-            if (libevdev_has_event_type(dev, EV_KEY) &&
-                (
-                  libevdev_has_event_code(dev, EV_KEY, BTN_NORTH) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_EAST) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SOUTH) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_WEST) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_TRIANGLE) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_CIRCLE) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_CROSS) ||
-                  libevdev_has_event_code(dev, EV_KEY, BTN_SIXAXIS_SQUARE)
-                )
-               )
-            {
-              has_fire=1;
-            }
-          }
-          
-          if (has_dpad && has_fire) {
-            // device is very likely a gamepad
-            if (gamepads_found < MAX_JOYSTICKS) {
-              if ( (gamepads_found==0) ? (joy1_devno==-1 || joy1_devno==devno) : (joy2_devno==-1 || joy2_devno==devno) ) {
-                dev_joysticks[attach_to_port]=dev;
-                debug_log(LOGLEVEL_VERBOSE, "Device has capabilities to function as a joystick, assigning it to port %d", attach_to_port+1);
-                gamepads_found++;
-                attach_to_port=(attach_to_port+1)%MAX_JOYSTICKS;
-              }
-            }
-          } else {
-              debug_log(LOGLEVEL_DEBUG, "Doesn't look like a gamepad either");            
-          }
-        } else {
-          // device is most probably a mouse
-          if (!mouse_found) {
-            if (mouse_devno==-1 || mouse_devno==devno) {
-              mouse_found=1;
-              dev_mouse=dev;
-              debug_log(LOGLEVEL_VERBOSE, "Device has capabilities to function as a mouse, assigning it to port %d", mouse_to_port);
-            } else {
-              debug_log(LOGLEVEL_DEBUG, "Device %d appears to be a mouse but use designated device number %d", devno, mouse_devno);
-            }
-          }
-        }
+        *forwarded|=input_dispatch_event(slot, ev);
       }
     }
-    globfree(&glob_result);
-  } else return rc; // GLOB_NOSPACE, GLOB_ABORTED or GLOB_NOMATCH
-  
-  if (mouse_found) {
-    debug_log(LOGLEVEL_INFO, "Using \"%s\" to emulate a mouse in port %d", libevdev_get_name(dev_mouse), mouse_to_port);
+    // a short read emptied the kernel buffer, and the epoll wait is level
+    // triggered, so there's no need for another read to see EAGAIN
+  } while (count==INPUT_READ_EVENTS);
+  return -EAGAIN;
+}
+
+
+// read and dispatch every pending event from a device. returns the
+// negative errno if the device can no longer be read
+static int input_drain_device(int slot, uint64_t t_wake) {
+  int rc, forwarded=0, events=0;
+
+  if (input_bulk_read) rc=input_read_bulk(slot, &events, &forwarded);
+  else rc=input_read_libevdev(slot, &events, &forwarded);
+  record_flush();
+  metrics_add(metric_input_events[slot], events);
+
+  // let the port thread measure the time from wakeup to the pin update
+  if (forwarded) {
+    port_mark_input(t_wake);
+    if (!input_first_event_seen) {
+      debug_log(LOGLEVEL_INFO, "First input event forwarded %.1f ms after startup", (double)(t_wake-input_start_time)/NSEC_PER_MSEC);
+      input_first_event_seen=1;
+    }
   }
 
-  for(i=0;i<MAX_JOYSTICKS;i++) {
-    if (!dev_joysticks[i]) continue;
-    debug_log(LOGLEVEL_INFO, "Using \"%s\" to emulate a joystick in port %d", libevdev_get_name(dev_joysticks[i]), i+1);
-  }  
-  
+  if (rc!=-EAGAIN) {
+    if (rc!=-ENODEV) debug_log(LOGLEVEL_ERROR, "Failed to read events from \"%s\" (%s)",
+      libevdev_get_name(slot==INPUT_SLOT_MOUSE ? dev_mouse : dev_joysticks[slot]), strerror(-rc));
+    return rc;
+  }
   return 0;
 }
 
 
+// register the event counters of one slot
+static void input_register_slot_metrics(int slot, const char *labels) {
+  metric_input_events[slot]=metrics_counter("joyemu_input_events_total", "Input events read from the devices", labels);
+  metric_input_frames[slot]=metrics_counter("joyemu_input_frames_total", "Input frames ended by a report from the devices", labels);
+  metric_input_frame_events[slot]=metrics_counter("joyemu_input_frame_events_total", "Input events in the frames reported by the devices", labels);
+  metric_input_resyncs[slot]=metrics_counter("joyemu_input_resyncs_total", "Device state resyncs after dropped events", labels);
+}
+
+
+// register the event counters of the mouse and the joystick ports
+static void input_register_metrics(void) {
+  char labels[METRICS_LABEL_LENGTH];
+  int i;
+
+  for(i=0;i<input_port_count;i++) {
+    snprintf(labels, sizeof(labels), "device=\"joystick%d\"", i+1);
+    input_register_slot_metrics(i, labels);
+  }
+  input_register_slot_metrics(INPUT_SLOT_MOUSE, "device=\"mouse\"");
+}
+
+
 // polling thread for reading pending events from devices assigned to
-// joystick or mouse emulation
+// joystick or mouse emulation. the thread sleeps in epoll_wait() until
+// at least one device becomes readable and then drains all of its events.
+// devices which go away are detached and new ones attached as they appear
 void *input_poll_thread(void *params) {
-  int rc, i;
-  struct input_event ev;
+  struct epoll_event events[MAX_JOYSTICKS+2], ee;
+  uint64_t t_wake;
+  int epfd, n, i, slot;
 
-  debug_log(LOGLEVEL_DEBUG, "Started event poll thread");
+  pthread_getcpuclockid(pthread_self(), &input_thread_clock);
+  __atomic_store_n(&input_thread_tid, (pid_t)syscall(SYS_gettid), __ATOMIC_RELEASE);
+  input_register_metrics();
+  epfd=epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create epoll instance, errno %d", errno);
+    return NULL;
+  }
+  if (mouse_found) input_watch_device(epfd, INPUT_SLOT_MOUSE, dev_mouse);
+  for(i=0;i<MAX_JOYSTICKS;i++) {
+    if (dev_joysticks[i]) input_watch_device(epfd, i, dev_joysticks[i]);
+  }
+  if (input_inotify >= 0) {
+    memset(&ee, 0, sizeof(struct epoll_event));
+    ee.events=EPOLLIN;
+    ee.data.u32=INPUT_SLOT_HOTPLUG;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, input_inotify, &ee);
+    // catch up with anything which appeared since the startup scan
+    input_handle_hotplug(epfd);
+  }
+
+  debug_log(LOGLEVEL_DEBUG, "Started event poll thread, reading devices %s", input_bulk_read ? "in bulk" : "through libevdev");
   do {
-    if (mouse_found) {
-      rc=libevdev_next_event(dev_mouse, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-      if (!rc) {
-        debug_log(LOGLEVEL_EXTRADEBUG, "Mouse: %s %s %d", libevdev_event_type_get_name(ev.type), libevdev_event_code_get_name(ev.type, ev.code), ev.value);
-        
-        if (ev.type==EV_REL) {
-          // mouse movement
-          switch(ev.code) {
-            case REL_X:
-            mouse_move(PORT_AXIS_HORIZONTAL, ev.value);
-            break;
-            
-            case REL_Y:
-            mouse_move(PORT_AXIS_VERTICAL, ev.value);
-            break;
-          }
-        } else if (ev.type==EV_KEY) {
-          switch(ev.code) {
-            case BTN_LEFT:
-            mouse_set_lmb(ev.value);
-            break;
-            
-            case BTN_RIGHT:
-            mouse_set_rmb(ev.value);
-            break;
-          }
-        }
+    n=epoll_wait(epfd, events, MAX_JOYSTICKS+2, -1);
+    if (n < 0) {
+      if (errno==EINTR) continue;
+      debug_log(LOGLEVEL_ERROR, "Waiting for input events failed, errno %d", errno);
+      break;
+    }
+    t_wake=timing_now_ns();
+    for(i=0;i<n;i++) {
+      slot=events[i].data.u32;
+      if (slot==INPUT_SLOT_HOTPLUG) {
+        input_handle_hotplug(epfd);
+        continue;
       }
+      // a device which was detached earlier in this batch has no events
+      if (slot==INPUT_SLOT_MOUSE ? !dev_mouse : !dev_joysticks[slot]) continue;
+      if (input_drain_device(slot, t_wake) < 0) input_detach_device(epfd, slot);
     }
+  } while (1);
 
-    for(i=0;i<MAX_JOYSTICKS;i++) {
-      if (!dev_joysticks[i]) continue;
-      
-      rc=libevdev_next_event(dev_joysticks[i], LIBEVDEV_READ_FLAG_NORMAL, &ev);
-      if (!rc) {
-        debug_log(LOGLEVEL_EXTRADEBUG, "Joystick %d: %s %s %d", i+1, libevdev_event_type_get_name(ev.type), libevdev_event_code_get_name(ev.type, ev.code), ev.value);
-        
-        // direction on dpad?
-        if (ev.type==EV_ABS) {
-          switch(ev.code) {
-            case ABS_HAT0X:
-            joystick_set_axis(i, PORT_AXIS_HORIZONTAL, ev.value);
-            break;
-            
-            case ABS_HAT0Y:
-            joystick_set_axis(i, PORT_AXIS_VERTICAL, ev.value);
-            break;
-          }
-        } else if (ev.type==EV_KEY) {
-          switch(ev.code) {
-            case BTN_DPAD_UP:
-            case BTN_SIXAXIS_UP:
-            joystick_set_axis(i, PORT_AXIS_VERTICAL, PORT_AXIS_STATE_UP * ev.value);
-            break;
-            
-            case BTN_DPAD_RIGHT:
-            case BTN_SIXAXIS_RIGHT:
-            joystick_set_axis(i, PORT_AXIS_HORIZONTAL, PORT_AXIS_STATE_RIGHT * ev.value);
-            break;
-            
-            case BTN_DPAD_DOWN:
-            case BTN_SIXAXIS_DOWN:
-            joystick_set_axis(i, PORT_AXIS_VERTICAL, PORT_AXIS_STATE_DOWN * ev.value);
-            break;
-            
-            case BTN_DPAD_LEFT:
-            case BTN_SIXAXIS_LEFT:
-            joystick_set_axis(i, PORT_AXIS_HORIZONTAL, PORT_AXIS_STATE_LEFT * ev.value);            
-            break;
-            
-            // all face button types map to joystick button 1
-            case BTN_NORTH:
-            case BTN_EAST:
-            case BTN_SOUTH:
-            case BTN_WEST:
-            case BTN_SIXAXIS_TRIANGLE:
-            case BTN_SIXAXIS_CIRCLE:
-            case BTN_SIXAXIS_CROSS:
-            case BTN_SIXAXIS_SQUARE:
-            joystick_set_fire(i, ev.value);
-            break;
-          }
-        }
-      }      
+  close(epfd);
+  return NULL;
+}
+
+
+// set the number of ports and the pacing for replaying a recording in
+// place of reading the devices. the events are dispatched with the default
+// profiles until the device records of the recording set up the profiles
+// the devices were recorded with
+void input_set_replay(int ports, int fast) {
+  int i;
+
+  input_port_count=ports;
+  input_replay_fast=fast;
+  for(i=0;i<ports;i++) {
+    profile_compile(profile_default(INPUT_ROLE_JOYSTICK), NULL, &input_tables[i]);
+    input_frame_reset(i);
+  }
+  profile_compile(profile_default(INPUT_ROLE_MOUSE), NULL, &input_tables[INPUT_SLOT_MOUSE]);
+  input_frame_reset(INPUT_SLOT_MOUSE);
+}
+
+
+// set up the dispatch of a slot from a device record of the recording.
+// the profile is taken by its id if the same profiles are loaded as when
+// recording, or else by the vendor and product ids of the device, and the
+// default profile is used if neither finds one
+static void input_replay_device(int slot, const struct record_event *r) {
+  struct profile_table *t=&input_tables[slot];
+  int role=(slot==INPUT_SLOT_MOUSE) ? INPUT_ROLE_MOUSE : INPUT_ROLE_JOYSTICK;
+  uint16_t vendor=(uint32_t)r->value >> 16, product=r->value & 0xffff;
+  const struct profile *profile;
+
+  switch (r->type) {
+    case RECORD_TYPE_DEVICE:
+    profile=replay_same_profiles() ? profile_by_id(r->code) : profile_match_ids(vendor, product);
+    if (!profile || profile->role!=role) profile=profile_default(role);
+    profile_compile(profile, NULL, t);
+    input_frame_reset(slot);
+    debug_log(LOGLEVEL_VERBOSE, "Replaying %s %04x:%04x with profile %s", slot==INPUT_SLOT_MOUSE ? "mouse" : "joystick",
+      vendor, product, profile->name);
+    break;
+
+    case RECORD_TYPE_ABS_LOW:
+    if (r->code < PROFILE_ABS_CODES) t->abs_low[r->code]=r->value;
+    break;
+
+    case RECORD_TYPE_ABS_HIGH:
+    if (r->code < PROFILE_ABS_CODES) t->abs_high[r->code]=r->value;
+    break;
+  }
+}
+
+
+// replay thread feeding a recording through the same dispatch as events
+// read from the devices, either at the pace they were recorded at or as
+// fast as possible. returns when the end of the recording is reached
+void *input_replay_thread(void *params) {
+  const struct record_event *r;
+  struct input_event ev;
+  uint64_t n, t_start, t_end;
+  int forwarded=0, slot;
+
+  debug_log(LOGLEVEL_DEBUG, "Started event replay thread");
+  input_register_metrics();
+  memset(&ev, 0, sizeof(struct input_event));
+  t_start=timing_now_ns();
+  for(n=0;(r=replay_event(n));n++) {
+    if (!input_replay_fast) timing_sleep_until_ns(t_start+r->t_ns);
+    ev.input_event_sec=(t_start+r->t_ns)/NSEC_PER_SEC;
+    ev.input_event_usec=((t_start+r->t_ns)%NSEC_PER_SEC)/NSEC_PER_USEC;
+    ev.type=r->type;
+    ev.code=r->code;
+    ev.value=r->value;
+    slot=(r->slot==RECORD_SLOT_MOUSE) ? INPUT_SLOT_MOUSE : r->slot;
+    if (r->type >= RECORD_TYPE_DEVICE) {
+      if (slot==INPUT_SLOT_MOUSE || slot < input_port_count) input_replay_device(slot, r);
+      continue;
     }
-  } while (1);
+    if (slot==INPUT_SLOT_MOUSE || slot < input_port_count) {
+      metrics_add(metric_input_events[slot], 1);
+      forwarded|=input_dispatch_event(slot, &ev);
+    }
+
+    // a report ends the frame the events were read from the device in
+    if (ev.type==EV_SYN && forwarded) {
+      port_mark_input(timing_now_ns());
+      forwarded=0;
+    }
+  }
+  if (forwarded) port_mark_input(timing_now_ns());
+
+  t_end=timing_now_ns();
+  debug_log(LOGLEVEL_INFO, "Replayed %llu events in %.1f ms (%.0f events per second)", (unsigned long long)n,
+    (double)(t_end-t_start)/NSEC_PER_MSEC, t_end > t_start ? (double)n*NSEC_PER_SEC/(t_end-t_start) : 0.0);
+  return NULL;
 }
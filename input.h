@@ -28,28 +28,33 @@
 #define _INPUT_H_
 
 // sixaxis and dualshock3 have weird undocumented event codes
+#define BTN_SIXAXIS_SELECT	288
+#define BTN_SIXAXIS_START	291
 #define BTN_SIXAXIS_UP		292
 #define BTN_SIXAXIS_RIGHT	293
 #define BTN_SIXAXIS_DOWN	294
 #define BTN_SIXAXIS_LEFT	295
+#define BTN_SIXAXIS_L1		298
+#define BTN_SIXAXIS_R1		299
 #define BTN_SIXAXIS_TRIANGLE	300
 #define BTN_SIXAXIS_CIRCLE	301
 #define BTN_SIXAXIS_CROSS	302
 #define BTN_SIXAXIS_SQUARE	303
 
-// supported dpad event types
-#define DPAD_TYPE_XBOX		1
-#define DPAD_TYPE_GENERIC	2
-#define DPAD_TYPE_SIXAXIS	3
-
 void input_set_mouse_device(int d);
-void input_set_joystick1_device(int d);
-void input_set_joystick2_device(int d);
+void input_set_joystick_device(int n, int d);
+void input_set_start_time(uint64_t t);
+int input_load_cache(const char *path);
+void input_set_bulk_read(int enabled);
+int input_thread_usage(uint64_t *cpu_ns, uint64_t *reads);
 
 int input_joysticks_connected(void);
 int input_mouse_connected(void);
 
-int input_scan_devices(int mouse_to_port, int first_joystick);
+int input_scan_devices(int mouse_to_port, int first_joystick, int ports);
 void *input_poll_thread(void *params);
 
+void input_set_replay(int ports, int fast);
+void *input_replay_thread(void *params);
+
 #endif
\ No newline at end of file
@@ -1,7 +1,7 @@
 /*
  * joyemu 
  *
- * Functions for interfacing with an MCP23017 I/O extender connected on I2C bus.
+ * Functions for interfacing with MCP23017 I/O extenders connected on I2C buses.
  *
  *
  * Copyright (c) 2017 Noora Halme
@@ -30,18 +30,120 @@
 #include <asm/errno.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "defaults.h"
+#include "io.h"
 #include "logging.h"
+#include "metrics.h"
+#include "pinmap.h"
+#include "ports.h"
+#include "rt.h"
+#include "stats.h"
+#include "timing.h"
 
-// i2c device file descriptor
-int i2c_dev=0;
+// least time between two failed I2C transactions logged by a thread
+#define I2C_ERROR_LOG_NS	NSEC_PER_SEC
 
-// last joystick port pin states written to I/O board
-uint16_t last_port1=0, last_port2=0;
+// a GPIO update waiting for a bus writer thread
+struct io_update {
+  uint64_t t_queued;
+  uint16_t gpio;
+  uint8_t expander;
+  uint8_t dirty;  // bit 0 for GPIOA, bit 1 for GPIOB
+};
+
+// an I2C bus and its writer. when more than one bus is in use each bus gets
+// a writer thread of its own, so a slow bus can't hold up the others. with
+// a single bus the port I/O thread writes to it directly
+struct io_bus {
+  int number;
+  int threaded;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  struct io_update queue[IO_QUEUE_LENGTH];
+  unsigned int queue_head, queue_tail;
+
+  // counters since the last report, owned by the thread writing to the bus
+  unsigned long transactions, port_updates, failures;
+  struct stats_hist write_latency;
+
+  // updates deferred to the next step because the queue was full
+  unsigned long deferred;
+
+  // the same counters exported as metrics, never reset
+  int64_t *metric_transactions, *metric_port_updates, *metric_failures, *metric_deferred;
+  struct metrics_hist *metric_write_latency;
+};
+
+// a GPIO bit watched as an input and the function handling its changes
+struct io_input {
+  io_input_handler handler;
+  void *arg;
+};
+
+// an MCP23017 expander and the bus it's on
+struct mcp_expander {
+  int bus;
+  uint16_t addr;
+  void *handle;
+  struct io_bus *io_bus;
+
+  // watched inputs and the thread waiting for them to change
+  struct io_input inputs[PINMAP_GPIO_BITS];
+  int inputs_watched;
+  pthread_t input_thread;
+
+  // last GPIO bits written or queued to the expander
+  uint16_t last_gpio;
+  int gpio_valid;
+};
+
+// an open I2C device for the I2C backend
+struct i2c_device {
+  int fd;
+  uint16_t addr;
+};
+
+// time a thread last logged a failed I2C transaction and the failures it
+// hasn't logged since, so that a flaky bus can't flood the log from the
+// port I/O and input threads
+__thread uint64_t i2c_error_time=0;
+__thread unsigned long i2c_errors_unlogged=0;
+
+// output backend carrying the MCP23017 register accesses
+const struct io_backend *io_backend=&io_backend_i2c;
+const char *io_backend_arg=NULL;
+
+// all known output backends
+const struct io_backend *io_backends[]={ &io_backend_i2c, &io_backend_sim, &io_backend_gpio, NULL };
+
+// called from the writing thread after each GPIO update has been written
+void (*io_observer)(int expander, uint16_t gpio, uint64_t t_ns)=NULL;
+
+// configured expanders and the buses they are on
+struct mcp_expander mcp_expanders[MAX_EXPANDERS];
+struct io_bus io_buses[MAX_EXPANDERS];
+int mcp_expander_total=0, io_bus_total=0;
+
+// write both GPIO banks in one transaction when both have changed
+int mcp_combined_writes=1;
+
+// last joystick port pin states
+uint32_t last_port[MAX_PORTS];
+
+// held while the port pin states are written, which is normally done by
+// the port I/O thread but may also be done by a thread answering a host
+pthread_mutex_t mcp_update_lock=PTHREAD_MUTEX_INITIALIZER;
 
 
 // get an I2C bus file descriptor and acquire access to board address
@@ -53,6 +155,7 @@ int open_i2c(char *device, uint16_t base_addr) {
   }
   if (ioctl(h, I2C_SLAVE, base_addr) < 0) {
     debug_log(LOGLEVEL_ERROR, "I2C: failed to acquire slave access to 0x%03x, errno %d", base_addr, errno);
+    close(h);
     return 0;
   }
   debug_log(LOGLEVEL_DEBUG, "I2C: opened bus device %s and acquired access to slave at 0x%03x", device, base_addr);
@@ -60,13 +163,33 @@ int open_i2c(char *device, uint16_t base_addr) {
 }
 
 
-// write a byte to a register on the opened I2C device
-int write_i2c(uint8_t regno, uint8_t data)
+// decide whether to log a failed I2C transaction. returns the number of
+// failures left unlogged since the last one logged, or -1 to leave this
+// one unlogged as well
+static long i2c_error_to_log(void) {
+  uint64_t t=timing_now_ns();
+  long unlogged;
+
+  if (i2c_error_time && t-i2c_error_time < I2C_ERROR_LOG_NS) {
+    i2c_errors_unlogged++;
+    return -1;
+  }
+  i2c_error_time=t;
+  unlogged=i2c_errors_unlogged;
+  i2c_errors_unlogged=0;
+  return unlogged;
+}
+
+
+// write a byte to a register on an opened I2C device
+int write_i2c(int i2c_dev, uint8_t regno, uint8_t data)
 {
   if (i2c_dev) {
     int rc=i2c_smbus_write_byte_data(i2c_dev, regno, data);
     if (rc == -1) {
-      debug_log(LOGLEVEL_ERROR, "I2C: writing byte to register 0x%02x failed with errno %d", regno, errno);
+      int err=errno;
+      long unlogged=i2c_error_to_log();
+      if (unlogged >= 0) debug_log(LOGLEVEL_ERROR, "I2C: writing byte to register 0x%02x failed with errno %d, %ld failures not logged since the last", regno, err, unlogged);
       return -1;
     }
     debug_log(LOGLEVEL_EXTRADEBUG, "I2C: wrote 0x%02x to register 0x%02x", data, regno);
@@ -75,95 +198,532 @@ int write_i2c(uint8_t regno, uint8_t data)
 }
 
 
-// read a bute from the opened I2C device
-int read_i2c(uint8_t regno, uint8_t *data)
+// write consecutive registers starting from regno in a single I2C_RDWR
+// transaction, relying on the MCP23017 address pointer auto-increment
+int write_i2c_block(int i2c_dev, uint16_t i2c_addr, uint8_t regno, const uint8_t *data, int len)
+{
+  uint8_t buf[32];
+  struct i2c_msg msg;
+  struct i2c_rdwr_ioctl_data rdwr;
+
+  if (!i2c_dev || len < 1 || len > sizeof(buf)-1) return -1;
+  buf[0]=regno;
+  memcpy(&buf[1], data, len);
+  msg.addr=i2c_addr;
+  msg.flags=0;
+  msg.len=len+1;
+  msg.buf=buf;
+  rdwr.msgs=&msg;
+  rdwr.nmsgs=1;
+  if (ioctl(i2c_dev, I2C_RDWR, &rdwr) < 0) {
+    int err=errno;
+    long unlogged=i2c_error_to_log();
+    if (unlogged >= 0) debug_log(LOGLEVEL_ERROR, "I2C: writing %d bytes to register 0x%02x failed with errno %d, %ld failures not logged since the last", len, regno, err, unlogged);
+    return -1;
+  }
+  debug_log(LOGLEVEL_EXTRADEBUG, "I2C: wrote %d bytes to register 0x%02x", len, regno);
+  return 0;
+}
+
+
+// read a byte from an opened I2C device
+int read_i2c(int i2c_dev, uint8_t regno, uint8_t *data)
 {
   if (i2c_dev) {
     int rc=i2c_smbus_read_byte_data(i2c_dev, regno);
     if (rc == -1) {
-      debug_log(LOGLEVEL_ERROR, "I2C: reading byte from register 0x%02x failed with errno %d", regno, errno);
+      int err=errno;
+      long unlogged=i2c_error_to_log();
+      if (unlogged >= 0) debug_log(LOGLEVEL_ERROR, "I2C: reading byte from register 0x%02x failed with errno %d, %ld failures not logged since the last", regno, err, unlogged);
       return -1;
     }
-    debug_log(LOGLEVEL_EXTRADEBUG, "I2C: read 0x%02x from register 0x%02x", data, regno);
+    *data=rc;
+    debug_log(LOGLEVEL_EXTRADEBUG, "I2C: read 0x%02x from register 0x%02x", *data, regno);
     return 0;
   } else return -1;
 }
 
 
+// open the I2C bus device for an expander for the I2C backend. each
+// expander gets a descriptor of its own, bound to its slave address
+static void *i2c_backend_open(int bus, uint16_t addr, const char *arg) {
+  struct i2c_device *d;
+  char dev[512];
+
+  snprintf((char*)&dev, 511, "/dev/i2c-%d", bus);
+  d=malloc(sizeof(struct i2c_device));
+  if (!d) return NULL;
+  d->fd=open_i2c(dev, addr);
+  d->addr=addr;
+  if (!d->fd) {
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+
+// write one or more consecutive registers over I2C
+static int i2c_backend_write(void *handle, uint8_t regno, const uint8_t *data, int len) {
+  struct i2c_device *d=handle;
+  if (len==1) return write_i2c(d->fd, regno, data[0]);
+  return write_i2c_block(d->fd, d->addr, regno, data, len);
+}
+
+
+// read a register over I2C
+static int i2c_backend_read(void *handle, uint8_t regno, uint8_t *data) {
+  struct i2c_device *d=handle;
+  return read_i2c(d->fd, regno, data);
+}
+
+
+// the MCP23017 on a Linux I2C bus. it could signal a changed input on its
+// INT pin, but that needs a host GPIO line of its own, and polling the
+// inputs over the bus is too slow for a host clocking out a controller,
+// so the backend doesn't read inputs at all
+const struct io_backend io_backend_i2c={
+  "i2c",
+  i2c_backend_open,
+  i2c_backend_write,
+  i2c_backend_read,
+  NULL,
+  NULL,
+  0
+};
+
+
+// select the output backend from a "name[:argument]" string
+int io_set_backend(const char *spec) {
+  const char *colon=strchr(spec, ':');
+  size_t len=colon ? (size_t)(colon-spec) : strlen(spec);
+  int i;
+
+  for(i=0;io_backends[i];i++) {
+    if (strlen(io_backends[i]->name)==len && !strncmp(io_backends[i]->name, spec, len)) {
+      io_backend=io_backends[i];
+      io_backend_arg=colon ? colon+1 : NULL;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+// set a function to call after every GPIO update with the time the write
+// completed, for measuring the output latency of any backend
+void io_set_observer(void (*observer)(int expander, uint16_t gpio, uint64_t t_ns)) {
+  io_observer=observer;
+}
+
+
+// write a byte to an MCP23017 register through the output backend
+int mcp_write_reg(struct mcp_expander *e, uint8_t regno, uint8_t data)
+{
+  if (io_backend->write(e->handle, regno, &data, 1) < 0) {
+    e->io_bus->failures++;
+    metrics_add(e->io_bus->metric_failures, 1);
+    return -1;
+  }
+  e->io_bus->transactions++;
+  metrics_add(e->io_bus->metric_transactions, 1);
+  return 0;
+}
+
+
+// write consecutive MCP23017 registers in one transaction
+int mcp_write_regs(struct mcp_expander *e, uint8_t regno, const uint8_t *data, int len)
+{
+  if (io_backend->write(e->handle, regno, data, len) < 0) {
+    e->io_bus->failures++;
+    metrics_add(e->io_bus->metric_failures, 1);
+    return -1;
+  }
+  e->io_bus->transactions++;
+  metrics_add(e->io_bus->metric_transactions, 1);
+  return 0;
+}
+
+
+// read a byte from an MCP23017 register through the output backend
+int mcp_read_reg(struct mcp_expander *e, uint8_t regno, uint8_t *data)
+{
+  return io_backend->read(e->handle, regno, data);
+}
+
+
 // set IODIRA/IODIRB register on the MCP23017
-int mcp_set_iodir(uint8_t bank, uint8_t iodir) // set io direction register
+int mcp_set_iodir(struct mcp_expander *e, uint8_t bank, uint8_t iodir) // set io direction register
 {
-  return write_i2c(0x00+bank, iodir); // 1=input, 0=output
+  return mcp_write_reg(e, 0x00+bank, iodir); // 1=input, 0=output
 }
 
 
 // set GPPUA/GPPUB register on the MCP23017
-int mcp_set_gppu(uint8_t bank, uint8_t gppu) // set pull-up resistor config
+int mcp_set_gppu(struct mcp_expander *e, uint8_t bank, uint8_t gppu) // set pull-up resistor config
 {
-  return write_i2c(0x0c+bank, gppu); // 1=pull-up enabled
+  return mcp_write_reg(e, 0x0c+bank, gppu); // 1=pull-up enabled
 }
 
 
 // write to GPIOA/GPIOB registers on the MCP23017
-int mcp_write_gpio(uint8_t bank, uint8_t data)
+int mcp_write_gpio(struct mcp_expander *e, uint8_t bank, uint8_t data)
+{
+  return mcp_write_reg(e, 0x12+bank, data);
+}
+
+
+// write to both GPIOA and GPIOB registers on the MCP23017 at once
+int mcp_write_gpio_both(struct mcp_expander *e, uint8_t gpioa, uint8_t gpiob)
 {
-  return write_i2c(0x12+bank, data);
+  uint8_t data[2]={gpioa, gpiob};
+  return mcp_write_regs(e, 0x12, data, 2);
 }
 
 
 // read GPIOA/GPIOB register from the MCP23017
-unsigned char mcp_read_gpio(uint8_t bank) {
-  uint8_t gpio;
-  read_i2c(0x12+bank, &gpio);
+unsigned char mcp_read_gpio(struct mcp_expander *e, uint8_t bank) {
+  uint8_t gpio=0;
+  mcp_read_reg(e, 0x12+bank, &gpio);
   return gpio;
 }
 
 
-// write the joystick port pin states to the GPIO pins
-void mcp_update_port_state(uint16_t port1_pins, uint16_t port2_pins) {
-  uint8_t p=0;
+// add an expander on an I2C bus. returns its index or -1 if there are too
+// many expanders or the same one was given twice
+int mcp_add_expander(int bus, uint16_t addr) {
+  int i;
 
-  if (last_port1 != port1_pins) {
-    debug_log(LOGLEVEL_DEBUG, "Port 1 pins [ %1d %1d %1d %1d %1d %1d %1d %1d %1d ]",
-      port1_pins>>8, (port1_pins>>7)&1, (port1_pins>>6)&1, (port1_pins>>5)&1, (port1_pins>>4)&1,
-      (port1_pins>>3)&1, (port1_pins>>2)&1, (port1_pins>>1)&1, port1_pins&1);
-    p=(port1_pins&0x00f) | ((port1_pins&0x020)>>1) | ((port1_pins&0x100)>>3);
-    mcp_write_gpio(0, p);
-    last_port1=port1_pins;
+  if (mcp_expander_total >= MAX_EXPANDERS) return -1;
+  for(i=0;i<mcp_expander_total;i++) {
+    if (mcp_expanders[i].bus==bus && mcp_expanders[i].addr==addr) return -1;
   }
-  
-  if (last_port2 != port2_pins) {
-    debug_log(LOGLEVEL_DEBUG, "Port 2 pins [ %1d %1d %1d %1d %1d %1d %1d %1d %1d ]",
-      port2_pins>>8, (port2_pins>>7)&1, (port2_pins>>6)&1, (port2_pins>>5)&1, (port2_pins>>4)&1,
-      (port2_pins>>3)&1, (port2_pins>>2)&1, (port2_pins>>1)&1, port2_pins&1);
-    p=(port2_pins&0x00f) | ((port2_pins&0x020)>>1) | ((port2_pins&0x100)>>3);
-    mcp_write_gpio(1, p);
-    last_port2=port2_pins;
+  memset(&mcp_expanders[i], 0, sizeof(struct mcp_expander));
+  mcp_expanders[i].bus=bus;
+  mcp_expanders[i].addr=addr;
+  return mcp_expander_total++;
+}
+
+
+// return the number of expanders configured
+int mcp_expander_count(void) {
+  return mcp_expander_total;
+}
+
+
+// write the changed GPIO banks of an expander and record the time taken
+// since the update was made
+static void mcp_write_update(struct mcp_expander *e, uint16_t gpio, int dirty, uint64_t t_queued) {
+  uint64_t t;
+
+  // both banks changed, so update them in the same transaction
+  if (dirty==3 && mcp_combined_writes) {
+    mcp_write_gpio_both(e, gpio & 0xff, gpio >> 8);
+  } else {
+    if (dirty & 1) mcp_write_gpio(e, 0, gpio & 0xff);
+    if (dirty & 2) mcp_write_gpio(e, 1, gpio >> 8);
   }
+  t=timing_now_ns();
+  e->io_bus->port_updates++;
+  stats_hist_add(&e->io_bus->write_latency, t-t_queued);
+  metrics_add(e->io_bus->metric_port_updates, 1);
+  metrics_hist_add(e->io_bus->metric_write_latency, t-t_queued);
+  if (io_observer) io_observer(e-mcp_expanders, gpio, t);
 }
 
 
-// initialize the MCP23017 to required state
-int mcp_initialize(uint8_t bus, uint16_t addr) // i2c bus number
-{
-  char dev[512];
+// log the throughput and write latency of a bus over the elapsed time
+static void io_bus_log_stats(struct io_bus *b, uint64_t elapsed_ns) {
+  double secs=(double)elapsed_ns/1000000000.0;
+  char what[64];
+  unsigned long deferred=__atomic_exchange_n(&b->deferred, 0, __ATOMIC_RELAXED);
 
-  // open the I2C device  
-  snprintf((char*)&dev, 511, "/dev/i2c-%d", bus);
-  i2c_dev=open_i2c(dev, addr);
-  if (i2c_dev) {
+  if (secs <= 0) return;
+  debug_log(LOGLEVEL_VERBOSE, "%s bus %d: %.1f transactions/s for %.1f port updates/s (%s writes)",
+    io_backend->name, b->number, b->transactions/secs, b->port_updates/secs, mcp_combined_writes ? "combined" : "separate");
+  snprintf(what, sizeof(what), "%s bus %d write latency", io_backend->name, b->number);
+  stats_hist_log(LOGLEVEL_VERBOSE, what, &b->write_latency);
+  if (b->failures) debug_log(LOGLEVEL_VERBOSE, "%s bus %d: %lu failed transactions", io_backend->name, b->number, b->failures);
+  if (deferred) debug_log(LOGLEVEL_VERBOSE, "%s bus %d: %lu updates deferred by a full queue", io_backend->name, b->number, deferred);
+  b->transactions=0;
+  b->port_updates=0;
+  b->failures=0;
+  stats_hist_reset(&b->write_latency);
+}
+
+
+// writer thread for one bus. it sleeps until updates are queued and writes
+// them in order, and reports the bus statistics itself since it owns them
+static void *io_bus_writer(void *params) {
+  struct io_bus *b=params;
+  struct io_update u;
+  struct timespec ts;
+  uint64_t t_report=timing_now_ns()+STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+
+  debug_log(LOGLEVEL_DEBUG, "Started writer thread for bus %d", b->number);
+  pthread_mutex_lock(&b->lock);
+  do {
+    if (b->queue_head==b->queue_tail) {
+      timing_ns_to_timespec(t_report, &ts);
+      pthread_cond_timedwait(&b->wakeup, &b->lock, &ts);
+    }
+    if (b->queue_head!=b->queue_tail) {
+      u=b->queue[b->queue_tail % IO_QUEUE_LENGTH];
+      b->queue_tail++;
+      pthread_mutex_unlock(&b->lock);
+      mcp_write_update(&mcp_expanders[u.expander], u.gpio, u.dirty, u.t_queued);
+      pthread_mutex_lock(&b->lock);
+    }
+    if (timing_now_ns() >= t_report) {
+      io_bus_log_stats(b, STATS_REPORT_INTERVAL*NSEC_PER_SEC);
+      t_report+=STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+    }
+  } while (1);
+  return NULL;
+}
 
-    // reset IOCON to set BANK=0. if already 0, the write goes to GPINTENB and has no effect
-    write_i2c(0x05, 0x00);
-  
-    mcp_set_iodir(0, 0x00); // set all pins on GPIOA and GPIOB
-    mcp_set_iodir(1, 0x00); // to output
-  
-    write_i2c(0x04, 0x00);  // disable interrupt on all pins by setting
-    write_i2c(0x05, 0x00);  // all bits in GPINTENA and GPINTENB low
-    
-    return i2c_dev;
+
+// pass an update to the writer thread of a bus. returns nonzero if it was
+// queued, or zero if the queue is full and the update has to wait
+static int io_bus_queue(struct io_bus *b, struct io_update *u) {
+  int queued=0;
+
+  pthread_mutex_lock(&b->lock);
+  if (b->queue_head-b->queue_tail < IO_QUEUE_LENGTH) {
+    b->queue[b->queue_head % IO_QUEUE_LENGTH]=*u;
+    b->queue_head++;
+    pthread_cond_signal(&b->wakeup);
+    queued=1;
+  }
+  pthread_mutex_unlock(&b->lock);
+  if (!queued) {
+    __atomic_add_fetch(&b->deferred, 1, __ATOMIC_RELAXED);
+    metrics_add(b->metric_deferred, 1);
+  }
+  return queued;
+}
+
+
+// bring the GPIO pins of an expander up to date, either directly or through
+// the writer thread of its bus. returns the number of GPIO banks updated, or
+// MCP_UPDATE_DEFERRED if the writer's queue was full
+static int mcp_update_expander(struct mcp_expander *e, uint16_t gpio, uint64_t t) {
+  struct io_update u;
+  uint16_t changed=e->gpio_valid ? (gpio ^ e->last_gpio) : 0xffff;
+  int dirty=((changed & 0x00ff)!=0) | (((changed & 0xff00)!=0)<<1);
+
+  if (!dirty) return 0;
+  if (e->io_bus->threaded) {
+    // if the writer is too far behind, leave last_gpio as it was so that
+    // the change is picked up again by the next update
+    u.t_queued=t;
+    u.gpio=gpio;
+    u.expander=e-mcp_expanders;
+    u.dirty=dirty;
+    if (!io_bus_queue(e->io_bus, &u)) return MCP_UPDATE_DEFERRED;
   } else {
-    return 0;
+    mcp_write_update(e, gpio, dirty, t);
+  }
+  e->last_gpio=gpio;
+  e->gpio_valid=1;
+  return (dirty & 1)+(dirty >> 1);
+}
+
+
+// write the joystick port pin states to the GPIO pins. returns the number
+// of GPIO banks which were written, or MCP_UPDATE_DEFERRED if the update of
+// any expander was left for later because its writer was behind, in which
+// case the caller has to update again
+int mcp_update_port_state(const uint32_t *port_pins, int ports) {
+  uint16_t gpio[MAX_EXPANDERS];
+  uint32_t pins;
+  uint64_t t=timing_now_ns();
+  int i, rc, written=0, deferred=0;
+
+  memset(gpio, 0, sizeof(gpio));
+  pthread_mutex_lock(&mcp_update_lock);
+  for(i=0;i<ports;i++) {
+    pins=__atomic_load_n(&port_pins[i], __ATOMIC_ACQUIRE) & DB9_PIN_MASK;
+    if (last_port[i] != pins) {
+      debug_log(LOGLEVEL_DEBUG, "Port %d pins [ %1d %1d %1d %1d %1d %1d %1d %1d %1d ]", i+1,
+        pins>>8, (pins>>7)&1, (pins>>6)&1, (pins>>5)&1, (pins>>4)&1,
+        (pins>>3)&1, (pins>>2)&1, (pins>>1)&1, pins&1);
+      last_port[i]=pins;
+    }
+    // one lookup per port gives the GPIO bits it drives
+    gpio[pinmap_expander[i]]|=pinmap_lut[i][pins];
+  }
+
+  for(i=0;i<mcp_expander_total;i++) {
+    rc=mcp_update_expander(&mcp_expanders[i], gpio[i], t);
+    if (rc==MCP_UPDATE_DEFERRED) deferred=1;
+    else written+=rc;
+  }
+  pthread_mutex_unlock(&mcp_update_lock);
+  return deferred ? MCP_UPDATE_DEFERRED : written;
+}
+
+
+// make a GPIO bit of an expander an input and call a handler whenever it
+// changes, once the input threads are started. returns -1 if the output
+// backend can't read inputs
+int mcp_watch_input(int expander, int bit, io_input_handler handler, void *arg) {
+  struct mcp_expander *e=&mcp_expanders[expander];
+
+  if (expander >= mcp_expander_total || !e->handle || !io_backend->watch) return -1;
+  e->inputs[bit].handler=handler;
+  e->inputs[bit].arg=arg;
+  if (io_backend->watch(e->handle, bit, 1) < 0) return -1;
+  e->inputs_watched++;
+  debug_log(LOGLEVEL_DEBUG, "Watching GPIO%c%d on expander %d as an input", bit < 8 ? 'A' : 'B', bit%8, expander+1);
+  return 0;
+}
+
+
+// turn a watched GPIO bit into an output for a while, or back into an
+// input. only to be called from the handlers of the expander's inputs
+int mcp_set_input(int expander, int bit, int input) {
+  return io_backend->watch(mcp_expanders[expander].handle, bit, input);
+}
+
+
+// wait for the watched inputs of an expander to change and pass each change
+// to the handler of the input
+static void *mcp_input_thread(void *params) {
+  struct mcp_expander *e=params;
+  struct io_input *in;
+  uint64_t t;
+  int bit, level;
+
+  debug_log(LOGLEVEL_DEBUG, "Started input thread for expander %d", (int)(e-mcp_expanders)+1);
+  do {
+    level=io_backend->wait(e->handle, &bit, &t);
+    if (level < 0) {
+      debug_log(LOGLEVEL_ERROR, "Failed to read the inputs of expander %d", (int)(e-mcp_expanders)+1);
+      break;
+    }
+    in=&e->inputs[bit];
+    if (in->handler) in->handler(in->arg, level, t);
+  } while (1);
+  return NULL;
+}
+
+
+// start a thread for each expander with watched inputs, scheduled like the
+// port I/O thread since the host is waiting for the answer
+int mcp_start_inputs(void) {
+  int i;
+
+  for(i=0;i<mcp_expander_total;i++) {
+    if (!mcp_expanders[i].inputs_watched) continue;
+    if (rt_create_thread(&mcp_expanders[i].input_thread, RT_THREAD_PORT, mcp_input_thread, &mcp_expanders[i])) {
+      debug_log(LOGLEVEL_ERROR, "Failed to create input thread for expander %d", i+1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// enable or disable combined GPIOA+GPIOB writes
+void mcp_set_combined_writes(int enable) {
+  mcp_combined_writes=enable;
+}
+
+
+// log the statistics of the buses written by the port I/O thread. buses
+// with writer threads of their own are reported by those threads
+void mcp_log_stats(uint64_t elapsed_ns) {
+  int i;
+  for(i=0;i<io_bus_total;i++) {
+    if (!io_buses[i].threaded) io_bus_log_stats(&io_buses[i], elapsed_ns);
+  }
+}
+
+
+// find the bus with the given number, adding it if it's not known yet
+static struct io_bus *io_get_bus(int number) {
+  struct io_bus *b;
+  char labels[METRICS_LABEL_LENGTH];
+  int i;
+
+  for(i=0;i<io_bus_total;i++) {
+    if (io_buses[i].number==number) return &io_buses[i];
+  }
+  b=&io_buses[io_bus_total++];
+  memset(b, 0, sizeof(struct io_bus));
+  b->number=number;
+  stats_hist_reset(&b->write_latency);
+  snprintf(labels, sizeof(labels), "backend=\"%s\",bus=\"%d\"", io_backend->name, number);
+  b->metric_transactions=metrics_counter("joyemu_io_transactions_total", "Register writes to the I/O expanders", labels);
+  b->metric_failures=metrics_counter("joyemu_io_failures_total", "Failed register writes to the I/O expanders", labels);
+  b->metric_deferred=metrics_counter("joyemu_io_deferred_updates_total", "GPIO updates left for later because the bus writer queue was full", labels);
+  b->metric_port_updates=metrics_counter("joyemu_io_port_updates_total", "GPIO updates written to the I/O expanders", labels);
+  b->metric_write_latency=metrics_histogram("joyemu_io_write_latency_seconds", "Time from a GPIO update to the end of its write", labels);
+  return b;
+}
+
+
+// start a writer thread for a bus, scheduled like the port I/O thread. the
+// condition variable runs on the monotonic clock like the rest of the timing
+static int io_bus_start_writer(struct io_bus *b) {
+  pthread_condattr_t attr;
+
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&b->wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+  b->threaded=1;
+  if (rt_create_thread(&b->writer, RT_THREAD_PORT, io_bus_writer, b)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create writer thread for bus %d", b->number);
+    b->threaded=0;
+    return -1;
+  }
+  return 0;
+}
+
+
+// initialize one MCP23017 to required state
+static int mcp_initialize_expander(struct mcp_expander *e) {
+  // open the I2C device or the simulated expander
+  e->handle=io_backend->open(e->bus, e->addr, io_backend_arg);
+  if (!e->handle) return 0;
+  e->io_bus=io_get_bus(e->bus);
+
+  // with BANK=1, IOCON is at 0x05 and clearing it sets BANK=0. if BANK is
+  // already 0, 0x05 is GPINTENB and the write has no effect
+  mcp_write_reg(e, 0x05, 0x00);
+
+  // with BANK=0, IOCON is at 0x0A. clearing it also clears SEQOP, so that
+  // GPIOA and GPIOB can be written sequentially
+  mcp_write_reg(e, 0x0a, 0x00);
+
+  mcp_set_iodir(e, 0, 0x00); // set all pins on GPIOA and GPIOB
+  mcp_set_iodir(e, 1, 0x00); // to output
+
+  mcp_write_reg(e, 0x04, 0x00);  // disable interrupt on all pins by setting
+  mcp_write_reg(e, 0x05, 0x00);  // all bits in GPINTENA and GPINTENB low
+
+  debug_log(LOGLEVEL_DEBUG, "Initialized MCP23017 at 0x%02x on bus %d", e->addr, e->bus);
+  return 1;
+}
+
+
+// initialize all the expanders, and give each bus a writer thread of its
+// own if they are spread over more than one bus
+int mcp_initialize(void)
+{
+  int i;
+
+  debug_log(LOGLEVEL_DEBUG, "Using %s output backend", io_backend->name);
+  for(i=0;i<mcp_expander_total;i++) {
+    if (!mcp_initialize_expander(&mcp_expanders[i])) return 0;
+  }
+  if (io_bus_total > 1) {
+    for(i=0;i<io_bus_total;i++) {
+      if (io_bus_start_writer(&io_buses[i])) return 0;
+    }
   }
+  return 1;
 }
@@ -27,7 +27,55 @@
 #ifndef _IO_H_
 #define _IO_H_
 
-int mcp_update_port_state(uint16_t port1_pins, uint16_t port2_pins);
-int mcp_initialize(uint8_t bus, uint16_t addr);
+// number of GPIO updates which can be queued for a bus writer thread
+#define IO_QUEUE_LENGTH		64
+
+// returned by mcp_update_port_state when an update had to be left for later
+#define MCP_UPDATE_DEFERRED	-1
+
+// interval between reads of a watched input on backends which can't wait
+// for it to change, counted from the end of the previous read
+#define IO_INPUT_POLL_NS	20000
+
+// an output backend carries register accesses to an MCP23017, which may be
+// a real expander on an I2C bus or a simulated one. open returns a handle
+// for the expander which is passed to the other functions, or NULL. watch
+// turns a GPIO bit into an input or back into an output, and wait blocks
+// until one of the inputs changes and returns the bit, its level and the
+// CLOCK_MONOTONIC time of the change, or the earliest it could have been
+// for a backend which polls. both are NULL for a backend which can't read
+// inputs. fast_inputs is set for backends which see an input change within
+// microseconds, fast enough to answer a host which clocks data out of a
+// controller
+struct io_backend {
+  const char *name;
+  void *(*open)(int bus, uint16_t addr, const char *arg);
+  int (*write)(void *handle, uint8_t regno, const uint8_t *data, int len);
+  int (*read)(void *handle, uint8_t regno, uint8_t *data);
+  int (*watch)(void *handle, int bit, int input);
+  int (*wait)(void *handle, int *bit, uint64_t *t_ns);
+  int fast_inputs;
+};
+
+// called from the input thread of an expander when a watched input changes
+typedef void (*io_input_handler)(void *arg, int level, uint64_t t_ns);
+
+extern const struct io_backend io_backend_i2c;
+extern const struct io_backend io_backend_sim;
+extern const struct io_backend io_backend_gpio;
+extern const struct io_backend *io_backend;
+
+int io_set_backend(const char *spec);
+void io_set_observer(void (*observer)(int expander, uint16_t gpio, uint64_t t_ns));
+
+int mcp_add_expander(int bus, uint16_t addr);
+int mcp_expander_count(void);
+int mcp_update_port_state(const uint32_t *port_pins, int ports);
+int mcp_initialize(void);
+void mcp_set_combined_writes(int enable);
+int mcp_watch_input(int expander, int bit, io_input_handler handler, void *arg);
+int mcp_set_input(int expander, int bit, int input);
+int mcp_start_inputs(void);
+void mcp_log_stats(uint64_t elapsed_ns);
 
 #endif
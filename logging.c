@@ -27,15 +27,51 @@
  * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "logging.h"
 
+// milliseconds the writer thread sleeps when all rings are empty
+#define LOG_WRITER_IDLE_MS	20
+
+// size of the output buffer of the writer
+#define LOG_OUTPUT_BYTES	16384
+
+// a single argument of a log record
+union log_arg {
+  long long i;
+  double d;
+  const void *p;
+};
+
+// a log line in binary form. the format string acts as the format id, as
+// every format used with debug_log() is a string literal
+struct log_record {
+  struct timespec t;
+  const char *fmt;
+  uint8_t level;
+  uint8_t nargs;
+  union log_arg args[LOG_MAX_ARGS];
+  char strings[LOG_STRING_BYTES];  // copies of %s arguments
+};
+
+// a single producer, single consumer ring of records owned by one thread
+struct log_ring {
+  unsigned long head;  // written by the owning thread
+  unsigned long tail;  // written by the writer thread
+  unsigned long dropped;
+  unsigned long dropped_reported;
+  struct log_record rec[LOG_RING_RECORDS];
+};
+
 
 // logging verbosity level
 int log_verbosity;
@@ -43,6 +79,25 @@ int log_verbosity;
 // prefix characters for log entries
 const char *errlevel_prefix=".-+*!";
 
+// rings of all threads which have logged something
+struct log_ring *log_rings[LOG_MAX_THREADS];
+int log_ring_count=0;
+pthread_mutex_t log_rings_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// the ring of the calling thread
+__thread struct log_ring *log_thread_ring=NULL;
+
+// serializes formatting and output between the writer thread and flushes
+pthread_mutex_t log_output_lock=PTHREAD_MUTEX_INITIALIZER;
+char log_output[LOG_OUTPUT_BYTES];
+size_t log_output_len=0;
+
+pthread_t log_writer;
+int log_writer_running=0;
+
+// posted to wake the writer thread up early for an error record
+sem_t log_writer_wakeup;
+
 
 // set the logging verbosity
 void debug_set_verbosity(int v) {
@@ -50,18 +105,311 @@ void debug_set_verbosity(int v) {
 }
 
 
-// print a debugging line or discard it if below verbosity level
-void debug_log(int level, const char *fmt, ...) {
-  if (level < log_verbosity) return;
-  char p=errlevel_prefix[level];
-  struct timeval t;
-  char fmtbuf[1024];
+// allocate and register a ring for the calling thread. returns NULL if all
+// ring slots are taken, in which case the thread logs synchronously
+static struct log_ring *debug_thread_ring(void) {
+  struct log_ring *ring;
+
+  if (log_thread_ring) return log_thread_ring;
+  pthread_mutex_lock(&log_rings_lock);
+  if (log_ring_count < LOG_MAX_THREADS) {
+    ring=calloc(1, sizeof(struct log_ring));
+    if (ring) {
+      if (!log_ring_count) atexit(debug_flush);
+      log_rings[log_ring_count]=ring;
+      __atomic_store_n(&log_ring_count, log_ring_count+1, __ATOMIC_RELEASE);
+      log_thread_ring=ring;
+    }
+  }
+  pthread_mutex_unlock(&log_rings_lock);
+  return log_thread_ring;
+}
+
+
+// find the next conversion in a format string. returns a pointer to the
+// conversion character, or NULL at the end of the string. the number of
+// '*' width and precision arguments is stored in stars
+static const char *debug_next_conversion(const char *f, const char **start, int *stars) {
+  while (*f) {
+    if (*f++ != '%') continue;
+    if (*f=='%') { f++; continue; }
+    *start=f-1;
+    *stars=0;
+    while (*f && strchr("-+ #0123456789.*hlLqjzt", *f)) {
+      if (*f=='*') (*stars)++;
+      f++;
+    }
+    return *f ? f : NULL;
+  }
+  return NULL;
+}
+
+
+// copy the arguments of a log line into a record. strings are copied since
+// they may not outlive the call
+static void debug_store_args(struct log_record *r, const char *fmt, va_list ap) {
+  const char *f=fmt, *start, *conv;
+  int stars, longs, n=0, so=0, len;
+  const char *str;
+
+  while ((conv=debug_next_conversion(f, &start, &stars)) && n < LOG_MAX_ARGS) {
+    while (stars-- > 0 && n < LOG_MAX_ARGS) r->args[n++].i=va_arg(ap, int);
+    if (n >= LOG_MAX_ARGS) break;
+    for(longs=0;start<conv;start++) if (*start=='l' || *start=='j' || *start=='z' || *start=='t' || *start=='q') longs++;
+
+    switch (*conv) {
+      case 'd': case 'i': case 'c':
+      r->args[n++].i=longs>1 ? va_arg(ap, long long) : longs ? va_arg(ap, long) : va_arg(ap, int);
+      break;
+
+      case 'u': case 'x': case 'X': case 'o':
+      r->args[n++].i=longs>1 ? (long long)va_arg(ap, unsigned long long) : longs ? (long long)va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+      break;
+
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      r->args[n++].d=va_arg(ap, double);
+      break;
+
+      case 's':
+      str=va_arg(ap, const char *);
+      if (!str) str="(null)";
+      len=strlen(str);
+      if (len > LOG_STRING_BYTES-1-so) len=LOG_STRING_BYTES-1-so;
+      if (len < 0) len=0;
+      memcpy(&r->strings[so], str, len);
+      r->strings[so+len]=0;
+      r->args[n++].i=so;
+      so+=len+1;
+      if (so > LOG_STRING_BYTES-1) so=LOG_STRING_BYTES-1;
+      break;
+
+      default:
+      r->args[n++].p=va_arg(ap, const void *);
+      break;
+    }
+    f=conv+1;
+  }
+  r->nargs=n;
+}
+
+
+// format a record into a line of text
+static int debug_format_record(const struct log_record *r, char *buf, int size) {
+  char msg[1024], spec[64];
+  const char *f=r->fmt, *start, *conv;
+  int stars, n=0, len=0, sl;
+  char p=errlevel_prefix[r->level];
+
+  while (len < sizeof(msg)-1 && (conv=debug_next_conversion(f, &start, &stars))) {
+    // literal text before the conversion, with %% collapsed
+    for(;f<start && len<sizeof(msg)-1;f++) {
+      msg[len++]=*f;
+      if (*f=='%') f++;
+    }
+    // the '*' arguments are written into the conversion spec as numbers
+    for(sl=0;start<=conv && sl<sizeof(spec)-16;start++) {
+      if (*start=='*') sl+=snprintf(&spec[sl], 16, "%d", n < r->nargs ? (int)r->args[n++].i : 0);
+      else spec[sl++]=*start;
+    }
+    spec[sl]=0;
+    if (n >= r->nargs) break;
+
+    switch (*conv) {
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      len+=snprintf(&msg[len], sizeof(msg)-len, spec, r->args[n++].d);
+      break;
+
+      case 's':
+      len+=snprintf(&msg[len], sizeof(msg)-len, spec, &r->strings[r->args[n++].i]);
+      break;
+
+      case 'd': case 'i': case 'c': case 'u': case 'x': case 'X': case 'o':
+      // re-read the value with the length modifier of the original spec
+      if (strstr(spec, "ll") || strchr(spec, 'j') || strchr(spec, 'q')) len+=snprintf(&msg[len], sizeof(msg)-len, spec, r->args[n++].i);
+      else if (strchr(spec, 'l') || strchr(spec, 'z') || strchr(spec, 't')) len+=snprintf(&msg[len], sizeof(msg)-len, spec, (long)r->args[n++].i);
+      else len+=snprintf(&msg[len], sizeof(msg)-len, spec, (int)r->args[n++].i);
+      break;
 
-  gettimeofday(&t, NULL);
+      default:
+      len+=snprintf(&msg[len], sizeof(msg)-len, spec, r->args[n++].p);
+      break;
+    }
+    if (len > sizeof(msg)-1) len=sizeof(msg)-1;
+    f=conv+1;
+  }
+  // trailing literal text
+  for(;*f && len<sizeof(msg)-1;f++) {
+    msg[len++]=*f;
+    if (*f=='%' && f[1]=='%') f++;
+  }
+  msg[len]=0;
+
+  return snprintf(buf, size, "[%10ld.%010ld] %c%c %s\n", (long)r->t.tv_sec, (long)(r->t.tv_nsec/1000), p, p, msg);
+}
+
+
+// write out the buffered output text
+static void debug_output_flush(void) {
+  size_t done=0;
+  ssize_t rc;
+
+  while (done < log_output_len) {
+    rc=write(STDERR_FILENO, &log_output[done], log_output_len-done);
+    if (rc <= 0) break;
+    done+=rc;
+  }
+  log_output_len=0;
+}
+
+
+// add a formatted record to the output buffer
+static void debug_output_record(const struct log_record *r) {
+  char line[1280];
+  int len=debug_format_record(r, line, sizeof(line));
+
+  if (len > sizeof(line)-1) len=sizeof(line)-1;
+  if (log_output_len+len > LOG_OUTPUT_BYTES) debug_output_flush();
+  memcpy(&log_output[log_output_len], line, len);
+  log_output_len+=len;
+}
+
+
+// print all queued records in timestamp order. returns the number of
+// records printed
+static int debug_drain(void) {
+  struct log_ring *ring, *oldest;
+  struct log_record *r, *oldest_r, dropped;
+  unsigned long head, tail, lost;
+  int i, count, printed=0;
+
+  pthread_mutex_lock(&log_output_lock);
+  count=__atomic_load_n(&log_ring_count, __ATOMIC_ACQUIRE);
+  do {
+    oldest=NULL;
+    oldest_r=NULL;
+    for(i=0;i<count;i++) {
+      ring=log_rings[i];
+      head=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      tail=ring->tail;
+      if (tail==head) continue;
+      r=&ring->rec[tail%LOG_RING_RECORDS];
+      if (!oldest_r || r->t.tv_sec < oldest_r->t.tv_sec ||
+          (r->t.tv_sec==oldest_r->t.tv_sec && r->t.tv_nsec < oldest_r->t.tv_nsec)) {
+        oldest=ring;
+        oldest_r=r;
+      }
+    }
+    if (oldest) {
+      debug_output_record(oldest_r);
+      __atomic_store_n(&oldest->tail, oldest->tail+1, __ATOMIC_RELEASE);
+      printed++;
+    }
+  } while (oldest);
+
+  // report records which were dropped because a ring was full
+  for(i=0;i<count;i++) {
+    ring=log_rings[i];
+    lost=__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (lost != ring->dropped_reported) {
+      memset(&dropped, 0, sizeof(struct log_record));
+      clock_gettime(CLOCK_REALTIME, &dropped.t);
+      dropped.fmt="Log: dropped %lu records, ring of thread %d was full";
+      dropped.level=LOGLEVEL_ERROR;
+      dropped.nargs=2;
+      dropped.args[0].i=lost-ring->dropped_reported;
+      dropped.args[1].i=i;
+      debug_output_record(&dropped);
+      ring->dropped_reported=lost;
+    }
+  }
+  debug_output_flush();
+  pthread_mutex_unlock(&log_output_lock);
+  return printed;
+}
+
+
+// print everything queued so far, called at exit and before exiting on errors
+void debug_flush(void) {
+  debug_drain();
+}
+
+
+// the background thread formatting and printing the log records. it
+// sleeps while the rings are empty unless an error record wakes it up
+static void *debug_writer_thread(void *params) {
+  struct timespec deadline;
+
+  do {
+    if (debug_drain()) continue;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec+=LOG_WRITER_IDLE_MS*1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec-=1000000000L;
+    }
+    sem_timedwait(&log_writer_wakeup, &deadline);
+  } while (1);
+  return NULL;
+}
+
+
+// start the background thread which prints the log. until it's started,
+// records are kept in the rings
+void debug_start_writer(void) {
+  if (log_writer_running) return;
+  sem_init(&log_writer_wakeup, 0, 0);
+  if (pthread_create(&log_writer, NULL, debug_writer_thread, NULL)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create log writer thread, logging only at exit");
+    return;
+  }
+  log_writer_running=1;
+}
+
+
+// queue a log line into the ring of the calling thread. this is the only
+// part of logging which runs on the calling thread, so it avoids formatting
+// and blocking output. errors wake the writer thread up to print them
+// right away, and are only printed on the calling thread before the writer
+// has been started
+void debug_log_record(int level, const char *fmt, ...) {
+  struct log_ring *ring=debug_thread_ring();
+  struct log_record *r, sync_r;
+  unsigned long head;
   va_list argptr;
+
+  if (ring) {
+    head=ring->head;
+    // before the writer runs errors are never dropped, make room for them
+    // by printing the ring. afterwards a full ring is left to the writer
+    if (level >= LOGLEVEL_ERROR && !log_writer_running && head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS) debug_drain();
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS) {
+      __atomic_store_n(&ring->dropped, ring->dropped+1, __ATOMIC_RELAXED);
+      if (level >= LOGLEVEL_ERROR && log_writer_running) sem_post(&log_writer_wakeup);
+      return;
+    }
+    r=&ring->rec[head%LOG_RING_RECORDS];
+  } else {
+    r=&sync_r;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &r->t);
+  r->fmt=fmt;
+  r->level=level;
   va_start(argptr, fmt);
-  vsnprintf((char*)&fmtbuf, 1024, fmt, argptr);
+  debug_store_args(r, fmt, argptr);
   va_end(argptr);
 
-  fprintf(stderr, "[%10d.%010d] %c%c %s\n", (long)(t.tv_sec), (long)(t.tv_usec), p, p, fmtbuf);
+  if (ring) {
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+    if (level >= LOGLEVEL_ERROR) {
+      if (log_writer_running) sem_post(&log_writer_wakeup);
+      else debug_drain();
+    }
+  } else {
+    // no ring available for this thread, print the line directly
+    pthread_mutex_lock(&log_output_lock);
+    debug_output_record(r);
+    debug_output_flush();
+    pthread_mutex_unlock(&log_output_lock);
+  }
 }
@@ -34,7 +34,30 @@
 #define LOGLEVEL_INFO		3
 #define	LOGLEVEL_ERROR		4
 
+// levels below this are compiled out completely, set with -DLOG_MIN_LEVEL
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL		LOGLEVEL_EXTRADEBUG
+#endif
+
+// log records kept per thread until the writer thread prints them
+#define LOG_RING_RECORDS	256
+#define LOG_MAX_THREADS		16
+
+// arguments and bytes of string arguments stored in a single record
+#define LOG_MAX_ARGS		12
+#define LOG_STRING_BYTES	96
+
+extern int log_verbosity;
+
+// log a line if the level is compiled in and not below the verbosity level.
+// the arguments are only evaluated if the line is going to be logged
+#define debug_log(level, ...) do { \
+    if ((level) >= LOG_MIN_LEVEL && (level) >= log_verbosity) debug_log_record((level), __VA_ARGS__); \
+  } while (0)
+
 void debug_set_verbosity(int v);
-void debug_log(int level, const char *fmt, ...);
+void debug_log_record(int level, const char *fmt, ...);
+void debug_start_writer(void);
+void debug_flush(void);
 
 #endif
\ No newline at end of file
@@ -29,22 +29,37 @@
 
 #include <getopt.h>
 #include <glob.h>
+#include <linux/input.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "bench.h"
 #include "defaults.h"
 #include "input.h"
 #include "io.h"
 #include "logging.h"
+#include "metrics.h"
+#include "cd32.h"
+#include "msx.h"
+#include "sega.h"
+#include "pinmap.h"
+#include "profile.h"
 #include "ports.h"
+#include "quad.h"
+#include "record.h"
+#include "rt.h"
+#include "sequencer.h"
+#include "timing.h"
 
 
-// bus and address for MCP23017
+// bus and address for the first MCP23017, and for any additional ones
 int config_i2c_bus=MCP_I2C_BUS_NUMBER;
 int config_i2c_base=MCP_I2C_BASE_ADDR;
+int config_expander_bus[MAX_EXPANDERS], config_expander_addr[MAX_EXPANDERS];
+int config_expanders=1;
 
 // thread handles
 pthread_t port_io, event_poll;
@@ -55,12 +70,33 @@ int config_joystick_port=2;
 int config_mouse_port=1;
 float config_mouse_speed=1.3;
 int config_mouse_device=-1;
-int config_joystick1_device=-1, config_joystick2_device=-1;
+int config_joystick_device=-1, config_joystick_number=0;
 int config_mouse_emulation=MOUSE_TYPE_AMIGA;
+int config_port_pad[MAX_PORTS]={ [0 ... MAX_PORTS-1]=PORT_PAD_JOYSTICK };
+int config_encoder_step_rate=ENCODER_STEP_RATE;
+int config_encoder_max_step_rate=ENCODER_MAX_STEP_RATE;
+int config_encoder_drain_ms=ENCODER_DRAIN_MS;
+int config_lag_policy=MOUSE_LAG_OFF, config_lag_limit=0, config_lag_limit_ms=0;
+int config_combined_writes=1;
+int config_bulk_read=0;
+int config_tickless=0;
+int config_bench_samples=0;
+int config_quad_units=0;
+int config_rt_port_priority=0, config_rt_input_priority=0;
+int config_rt_port_cpu=-1, config_rt_input_cpu=-1;
+char *config_pinmap=NULL;
+char *config_output=NULL;
+char *config_record=NULL, *config_replay=NULL;
+int config_replay_fast=0;
+char *config_metrics=NULL;
+char *config_device_cache=NULL;
+char *config_profiles=NULL;
 
 int main(int argc, char **argv) {
-  int rc, opt;
-  static const char *options="i:a:d:m:j:e:vqh";
+  int rc, opt, i, ports, port;
+  char pad[16];
+  uint64_t t_start=timing_now_ns();
+  static const char *options="i:a:x:d:m:j:e:r:D:l:o:B:Q:p:R:c:A:k:w:P:M:C:g:t:bsTvqh";
 
   // read command line arguments and set configuration variables accordingly
   while (1) {
@@ -96,62 +132,234 @@ int main(int argc, char **argv) {
       }        
       break;
       
+      case 'x':
+      if (config_expanders>=MAX_EXPANDERS) {
+        debug_log(LOGLEVEL_ERROR, "Too many I/O expanders - at most %d are supported", MAX_EXPANDERS);
+        exit(EXIT_FAILURE);
+      }
+      if (sscanf(optarg, "%d:0x%x", &config_expander_bus[config_expanders], &config_expander_addr[config_expanders])!=2 ||
+          config_expander_bus[config_expanders]<0 || config_expander_addr[config_expanders]<0 || config_expander_addr[config_expanders]>0xff) {
+        debug_log(LOGLEVEL_ERROR, "Invalid I/O expander - please enter the I2C bus number and a hexadecimal address separated by ':', eg. '1:0x21'");
+        exit(EXIT_FAILURE);
+      }
+      config_expanders++;
+      break;
+      
       case 'd':
       if (strlen(optarg)==0 || strlen(optarg)<3 || (optarg[0]!='j' && optarg[0]!='m')) {
-        debug_log(LOGLEVEL_ERROR, "Invalid port assignment - please enter 'j1:', 'j2:' or 'm:' followed by the event device number, eg. 'j1:0'");
+        debug_log(LOGLEVEL_ERROR, "Invalid port assignment - please enter 'j1:', 'j2:' etc. or 'm:' followed by the event device number, eg. 'j1:0'");
         exit(EXIT_FAILURE);
       }
       if (optarg[0]=='m') {
         sscanf(optarg, "m:%d", &config_mouse_device);
         input_set_mouse_device(config_mouse_device);
       } else {
-        if (optarg[1]=='1') {
-          sscanf(optarg, "j1:%d", &config_joystick1_device);
-          input_set_joystick1_device(config_joystick1_device);
-        } else {
-          sscanf(optarg, "j2:%d", &config_joystick2_device);
-          input_set_joystick2_device(config_joystick2_device);
+        if (sscanf(optarg, "j%d:%d", &config_joystick_number, &config_joystick_device)!=2 ||
+            config_joystick_number<1 || config_joystick_number>MAX_JOYSTICKS) {
+          debug_log(LOGLEVEL_ERROR, "Invalid port assignment - please enter a joystick number between 1 and %d, eg. 'j1:0'", MAX_JOYSTICKS);
+          exit(EXIT_FAILURE);
         }
+        input_set_joystick_device(config_joystick_number-1, config_joystick_device);
       }
       break;
       
       case 'm':
       sscanf(optarg, "%d", &config_mouse_port);
-      if (config_mouse_port!=1 && config_mouse_port!=2) {
-        debug_log(LOGLEVEL_ERROR, "Invalid mouse port - please enter either 1 or 2");
+      if (config_mouse_port<1 || config_mouse_port>MAX_PORTS) {
+        debug_log(LOGLEVEL_ERROR, "Invalid mouse port - please enter a port number between 1 and %d", MAX_PORTS);
         exit(EXIT_FAILURE);
       }        
       break;
       
       case 'j':
       sscanf(optarg, "%d", &config_joystick_port);
-      if (config_joystick_port!=1 && config_joystick_port!=2) {
-        debug_log(LOGLEVEL_ERROR, "Invalid joystick port - please enter either 1 or 2");
+      if (config_joystick_port<1 || config_joystick_port>MAX_PORTS) {
+        debug_log(LOGLEVEL_ERROR, "Invalid joystick port - please enter a port number between 1 and %d", MAX_PORTS);
         exit(EXIT_FAILURE);
       }        
       break;
 
       case 'e':
       sscanf(optarg, "%d", &config_mouse_emulation);
-      if (config_mouse_emulation!=0 && config_mouse_emulation!=1) {
-        debug_log(LOGLEVEL_ERROR, "Invalid mouse emulation type - please enter either 0 for Amiga or 1 for Atari ST");
+      if (config_mouse_emulation<MOUSE_TYPE_AMIGA || config_mouse_emulation>MOUSE_TYPE_MSX) {
+        debug_log(LOGLEVEL_ERROR, "Invalid mouse emulation type - please enter 0 for Amiga, 1 for Atari ST or 2 for MSX");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 't':
+      port=0;
+      pad[0]=0;
+      sscanf(optarg, "%d:%15s", &port, pad);
+      if (port<1 || port>MAX_PORTS || port_parse_pad(pad)<0) {
+        debug_log(LOGLEVEL_ERROR, "Invalid pad type - please enter a port number between 1 and %d followed by ':' and 'joystick', 'cd32', 'sega3' or 'sega6', eg. '2:cd32'", MAX_PORTS);
+        exit(EXIT_FAILURE);
+      }
+      config_port_pad[port-1]=port_parse_pad(pad);
+      break;
+
+      case 'r':
+      config_encoder_max_step_rate=0;
+      sscanf(optarg, "%d:%d", &config_encoder_step_rate, &config_encoder_max_step_rate);
+      if (!config_encoder_max_step_rate) config_encoder_max_step_rate=2*config_encoder_step_rate;
+      if (config_encoder_step_rate<1 || config_encoder_step_rate>1000000 ||
+          config_encoder_max_step_rate<config_encoder_step_rate || config_encoder_max_step_rate>1000000) {
+        debug_log(LOGLEVEL_ERROR, "Invalid encoder step rate - please enter a number of steps per second between 1 and 1000000, optionally followed by ':' and a higher maximum rate");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'D':
+      sscanf(optarg, "%d", &config_encoder_drain_ms);
+      if (config_encoder_drain_ms<1) {
+        debug_log(LOGLEVEL_ERROR, "Invalid drain time - please enter a positive number of milliseconds, eg. %d", ENCODER_DRAIN_MS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 's':
+      config_combined_writes=0;
+      break;
+
+      case 'b':
+      config_bulk_read=1;
+      break;
+
+      case 'T':
+      config_tickless=1;
+      break;
+
+      case 'l':
+      config_lag_policy=mouse_parse_lag_policy(optarg, &config_lag_limit, &config_lag_limit_ms);
+      if (config_lag_policy<0) {
+        debug_log(LOGLEVEL_ERROR, "Invalid lag policy - please enter 'clamp', 'compress' or 'rescale' followed by ':' and a limit in units or in ms, eg. 'clamp:100ms'");
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'o':
+      if (io_set_backend(optarg)) {
+        debug_log(LOGLEVEL_ERROR, "Invalid output backend - please enter 'i2c', 'sim' optionally followed by ':' and a shared memory file, or 'gpio:' followed by the GPIO chip and lines");
+        exit(EXIT_FAILURE);
+      }
+      config_output=optarg;
+      break;
+
+      case 'B':
+      sscanf(optarg, "%d", &config_bench_samples);
+      if (config_bench_samples<1) {
+        debug_log(LOGLEVEL_ERROR, "Invalid number of benchmark samples - please enter a positive integer number, eg. %d", BENCH_DEFAULT_SAMPLES);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'Q':
+      sscanf(optarg, "%d", &config_quad_units);
+      if (config_quad_units<1) {
+        debug_log(LOGLEVEL_ERROR, "Invalid number of mouse units - please enter a positive integer number, eg. %d", QUAD_DEFAULT_UNITS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'p':
+      config_pinmap=optarg;
+      break;
+
+      case 'R':
+      config_rt_input_priority=0;
+      sscanf(optarg, "%d:%d", &config_rt_port_priority, &config_rt_input_priority);
+      if (!config_rt_input_priority) config_rt_input_priority=config_rt_port_priority-(RT_PORT_PRIORITY-RT_INPUT_PRIORITY);
+      if (config_rt_port_priority<1 || config_rt_port_priority>99 ||
+          config_rt_input_priority<1 || config_rt_input_priority>99) {
+        debug_log(LOGLEVEL_ERROR, "Invalid real-time priority - please enter a SCHED_FIFO priority between 1 and 99 for the port I/O thread, optionally followed by ':' and one for the input thread, eg. '%d:%d'",
+          RT_PORT_PRIORITY, RT_INPUT_PRIORITY);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'A':
+      if (seq_parse_autofire(optarg)) {
+        debug_log(LOGLEVEL_ERROR, "Invalid autofire - please enter a button (north, east, south, west, tl or tr) followed by ':' and a rate between 1 and %d Hz, eg. 'west:10'", SEQ_MAX_AUTOFIRE_HZ);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'k':
+      if (seq_parse_macro(optarg)) {
+        debug_log(LOGLEVEL_ERROR, "Invalid macro - please enter a button followed by ':' and up to %d steps of pins held for some ms, eg. 'tr:down@50,down+right@50,right+fire@80'", SEQ_MAX_STEPS);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+      case 'w':
+      config_record=optarg;
+      break;
+
+      case 'P':
+      config_replay=optarg;
+      if (strlen(optarg)>5 && !strcmp(optarg+strlen(optarg)-5, ":fast")) {
+        optarg[strlen(optarg)-5]=0;
+        config_replay_fast=1;
+      }
+      break;
+
+      case 'M':
+      config_metrics=optarg;
+      break;
+
+      case 'C':
+      config_device_cache=optarg;
+      break;
+
+      case 'g':
+      config_profiles=optarg;
+      break;
+
+      case 'c':
+      config_rt_input_cpu=-1;
+      sscanf(optarg, "%d:%d", &config_rt_port_cpu, &config_rt_input_cpu);
+      if (config_rt_port_cpu<0 || config_rt_port_cpu>=sysconf(_SC_NPROCESSORS_CONF) || config_rt_input_cpu>=sysconf(_SC_NPROCESSORS_CONF)) {
+        debug_log(LOGLEVEL_ERROR, "Invalid CPU - please enter the CPU number for the port I/O thread, optionally followed by ':' and one for the input thread, eg. '1:0'");
         exit(EXIT_FAILURE);
       }
       break;
 
       case 'h':
       default:
-      fprintf(stderr, "Usage: %s [-vqh] [-i bus] [-a addr] [-d (j1|j2|m):evdev] [-m port] [-j port] [-e type]\n\n", argv[0]);
+      fprintf(stderr, "Usage: %s [-vqbsTh] [-i bus] [-a addr] [-x bus:addr] [-d (j1|j2|...|m):evdev] [-m port] [-j port] [-e type] [-t port:pad] [-r rate[:max]] [-D ms] [-l policy] [-o output] [-p pinmap] [-g profiles] [-R prio[:prio]] [-c cpu[:cpu]] [-A button:hz] [-k button:macro] [-w file] [-P file[:fast]] [-M socket] [-C cache] [-B samples] [-Q units]\n\n", argv[0]);
       fprintf(stderr, "  -v\t\tadd verbosity\n\
   -q\t\tadd quietness\n\
   -i n\t\tset I2C bus number for I/O expander (default: 1)\n\
   -a 0xnn\tset I2C address for I/O expander as a hexadecimal byte (default: 0x20)\n\
+  -x n:0xnn\tadd another I/O expander on I2C bus n at the given address, driving the next two ports\n\
   -d j1:n\tset event device number for joystick 1\n\
-  -d j2:n\tset event device number for joystick 2\n\
+  -d j2:n\tset event device number for joystick 2, and so on\n\
   -d m:n\tset event device number for mouse\n\
-  -m n\t\tset mouse port: 1 (default) or 2\n\
-  -j n\t\tset first joystick port: 1 or 2 (default)\n\
-  -e n\t\tset mouse emulation type: 0=Amiga (default), 1=Atari ST\n\
+  -m n\t\tset mouse port: 1 (default) or any other port in use\n\
+  -j n\t\tset first joystick port: 2 (default) or any other port in use\n\
+  -e n\t\tset mouse emulation type: 0=Amiga (default), 1=Atari ST, 2=MSX (needs -o gpio)\n\
+  -t n:pad\tset the pad emulated on port n: joystick (default), cd32, sega3 or sega6 (cd32 and sega need -o gpio)\n\
+  -r n[:m]\tset mouse encoder step rate and maximum rate in steps per second (default: 4000:8000)\n\
+  -l p:n[ms]\tbound queued mouse movement to n units or ms with policy p: off (default), clamp, compress or rescale\n\
+  -D n\t\tspeed up the encoders to send queued mouse movement within n ms (default: 50)\n\
+  -o i2c\tsend output to the MCP23017 on the I2C bus (default)\n\
+  -o sim[:file]\tsimulate the MCP23017 in memory or in a shared memory file\n\
+  -o gpio:chip:n,n,...\tdrive GPIO lines n,n,... of a GPIO chip in place of GPIOA0-7 and GPIOB0-7, '-' for none\n\
+  -p file\tload the DB9 to GPIO pin map from a file\n\
+  -g file\tload controller profiles from a file\n\
+  -R n[:m]\trun the port I/O thread with SCHED_FIFO priority n and the input thread with m (default: n-10), with memory locked\n\
+  -c n[:m]\tpin the port I/O thread to CPU n and the input thread to CPU m\n\
+  -A b:n\tautofire at n Hz while button b is held: north, east, south, west, tl or tr\n\
+  -k b:m\trun macro m when button b is pressed, eg. 'tr:down@50,down+right@50,right+fire@80'\n\
+  -w file\trecord the input events read from the devices to a file\n\
+  -P file[:fast]\treplay recorded input events in place of the devices, at their pace or as fast as possible\n\
+  -M path\tserve metrics in Prometheus text format on a Unix socket\n\
+  -C file\tremember which input devices are gamepads or mice in a file, to skip probing known devices\n\
+  -B n\t\tbenchmark input to pin latency with n virtual uinput events per type\n\
+  -Q n\t\tverify the mouse quadrature output, sweeping step rates with n units of movement each way\n\
+  -b\t\tread input events in bulk instead of one at a time through libevdev\n\
+  -T\t\tlet the port I/O thread sleep while the mouse is still and no pins change, to save power\n\
+  -s\t\twrite GPIOA and GPIOB in separate I2C transactions\n\
   -h\t\tdisplay this help\n\n");
       exit(EXIT_FAILURE);
       break;
@@ -162,42 +370,182 @@ int main(int argc, char **argv) {
     if (opt==-1) break;
   }
 
-  // set logging verbosity level
+  // set logging verbosity level and start printing the log in the background
   debug_set_verbosity(config_log_verbosity);
+  debug_start_writer();
 
-  // scan the input devices for suitable gamepads and/or mice
-  rc=input_scan_devices(config_mouse_port, config_joystick_port);
-  if (rc==GLOB_NOMATCH) {
-    debug_log(LOGLEVEL_ERROR, "Could not find any input devices - make sure your devices are powered on and paired - exiting");
+  // lock the process memory for real-time mode
+  rt_set_priorities(config_rt_port_priority, config_rt_input_priority);
+  rt_set_cpus(config_rt_port_cpu, config_rt_input_cpu);
+  if (rt_setup()) {
+    debug_log(LOGLEVEL_ERROR, "Failed to set up real-time mode - make sure you are running as root or have CAP_IPC_LOCK - exiting");
     exit(-1);
   }
-  else if (rc) {
-    debug_log(LOGLEVEL_ERROR, "Error while scanning for input devices - make sure you have permission to access /dev/input - exiting");
+
+  // export the metrics before anything registers them, so that a scrape
+  // sees every metric as soon as it exists
+  if (config_metrics && metrics_start(config_metrics)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to start serving metrics - exiting");
     exit(-1);
   }
-  if (!input_mouse_connected() && !input_joysticks_connected()) {
-    debug_log(LOGLEVEL_ERROR, "No suitable input devices found for emulating either mouse or joysticks - exiting");
+
+  // a replay stands in for the input devices
+  if (config_replay && (config_bench_samples || config_record)) {
+    debug_log(LOGLEVEL_ERROR, "A recording can't be replayed while benchmarking or recording - exiting");
     exit(-1);
-  } 
+  }
+  if (config_quad_units && (config_bench_samples || config_replay)) {
+    debug_log(LOGLEVEL_ERROR, "The quadrature verifier can't run while benchmarking or replaying - exiting");
+    exit(-1);
+  }
 
-  // initialize the I/O expander and start the port I/O thread
-  mcp_initialize(config_i2c_bus, config_i2c_base);
+  // the quadrature verifier moves the mouse by itself and decodes the pin
+  // changes as they are written, by default to the simulated expander
+  if (config_quad_units && !config_output) io_set_backend("sim");
+
+  // the benchmark injects events from virtual devices and captures the
+  // pin changes as they are written, by default to the simulated expander
+  if (config_bench_samples) {
+    if (!config_output) io_set_backend("sim");
+    if (bench_create_devices()) {
+      debug_log(LOGLEVEL_ERROR, "Failed to create virtual input devices for the benchmark - make sure you have permission to access /dev/uinput - exiting");
+      exit(-1);
+    }
+  }
+
+  // add the expanders and build the lookup tables for the DB9 to GPIO
+  // wiring, which also tells how many ports there are
+  config_expander_bus[0]=config_i2c_bus;
+  config_expander_addr[0]=config_i2c_base;
+  for(i=0;i<config_expanders;i++) {
+    if (mcp_add_expander(config_expander_bus[i], config_expander_addr[i]) < 0) {
+      debug_log(LOGLEVEL_ERROR, "I/O expander 0x%02x on bus %d was given twice - exiting", config_expander_addr[i], config_expander_bus[i]);
+      exit(-1);
+    }
+  }
+  if (config_pinmap && pinmap_load(config_pinmap)) {
+    debug_log(LOGLEVEL_ERROR, "Invalid pin map - exiting");
+    exit(-1);
+  }
+  ports=pinmap_compile(config_expanders);
+  if (config_mouse_port>ports || config_joystick_port>ports) {
+    debug_log(LOGLEVEL_ERROR, "Mouse or joystick port is not wired to any of the %d I/O expanders - exiting", config_expanders);
+    exit(-1);
+  }
+  port_set_count(ports);
+  for(i=0;i<ports;i++) {
+    if (config_port_pad[i]==PORT_PAD_JOYSTICK) continue;
+    if (i+1==config_mouse_port) {
+      debug_log(LOGLEVEL_ERROR, "Port %d is the mouse port and can't emulate a pad - exiting", i+1);
+      exit(-1);
+    }
+    port_set_pad(i, config_port_pad[i]);
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Emulating %d ports on %d I/O expanders", ports, config_expanders);
+
+  // scan the input devices for suitable gamepads and/or mice, unless the
+  // input comes from a recording. the profiles are needed for both
+  input_set_start_time(t_start);
+  if (!config_quad_units && config_profiles && profile_load(config_profiles)) {
+    debug_log(LOGLEVEL_ERROR, "Invalid controller profiles - exiting");
+    exit(-1);
+  }
+  if (config_replay) {
+    if (replay_open(config_replay)) {
+      debug_log(LOGLEVEL_ERROR, "Invalid recording - exiting");
+      exit(-1);
+    }
+    input_set_replay(ports, config_replay_fast);
+  } else if (!config_quad_units) {
+    if (config_device_cache && input_load_cache(config_device_cache)) {
+      debug_log(LOGLEVEL_ERROR, "Invalid device cache - exiting");
+      exit(-1);
+    }
+    if (config_record && record_open(config_record)) {
+      debug_log(LOGLEVEL_ERROR, "Failed to create the recording - exiting");
+      exit(-1);
+    }
+    input_set_bulk_read(config_bulk_read);
+    rc=input_scan_devices(config_mouse_port, config_joystick_port, ports);
+    if (rc && rc!=GLOB_NOMATCH) {
+      debug_log(LOGLEVEL_ERROR, "Error while scanning for input devices - make sure you have permission to access /dev/input - exiting");
+      exit(-1);
+    }
+    if (!input_mouse_connected() && !input_joysticks_connected()) {
+      debug_log(LOGLEVEL_INFO, "No suitable input devices found for emulating either mouse or joysticks yet - waiting for devices to be connected");
+    }
+  }
+
+  // initialize the I/O expanders and start the port I/O thread
+  if (!mcp_initialize()) {
+    debug_log(LOGLEVEL_ERROR, "Failed to initialize the I/O expanders - exiting");
+    exit(-1);
+  }
+  mcp_set_combined_writes(config_combined_writes);
   mouse_set_port(config_mouse_port);
   mouse_set_emulation(config_mouse_emulation);
-  rc=pthread_create(&port_io, NULL, port_io_thread, (void *)NULL);
+  mouse_set_step_rate(config_encoder_step_rate, config_encoder_max_step_rate);
+  mouse_set_drain_time(config_encoder_drain_ms);
+  mouse_set_lag_policy(config_lag_policy, config_lag_limit, config_lag_limit_ms);
+
+  // pins driven by the host are made inputs before the port I/O thread
+  // first writes the ports, and answered once it's running
+  if (config_mouse_emulation==MOUSE_TYPE_MSX && msx_start(config_mouse_port)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to start the MSX mouse - exiting");
+    exit(-1);
+  }
+  for(i=0;i<ports;i++) {
+    if (port_get_pad(i)==PORT_PAD_CD32 && cd32_start(i+1)) {
+      debug_log(LOGLEVEL_ERROR, "Failed to start the CD32 pad on port %d - exiting", i+1);
+      exit(-1);
+    }
+    if ((port_get_pad(i)==PORT_PAD_SEGA3 || port_get_pad(i)==PORT_PAD_SEGA6) && sega_start(i+1)) {
+      debug_log(LOGLEVEL_ERROR, "Failed to start the Sega pad on port %d - exiting", i+1);
+      exit(-1);
+    }
+  }
+  if (port_set_tickless(config_tickless)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create the wakeup eventfd for the port I/O thread - exiting");
+    exit(-1);
+  }
+  if (rt_enabled()) rt_measure_jitter();
+  rc=rt_create_thread(&port_io, RT_THREAD_PORT, port_io_thread, (void *)NULL);
   if (rc) {
     debug_log(LOGLEVEL_ERROR, "Failed to create port I/O thread - exiting\n");
     exit(-1);
   }
 
-  // wait a second and then start event polling thread
-  sleep(1);
-  rc=pthread_create(&event_poll, NULL, input_poll_thread, (void *)NULL);
+  // start the event polling thread once the port I/O thread is running
+  port_wait_ready();
+  if (mcp_start_inputs()) {
+    debug_log(LOGLEVEL_ERROR, "Failed to start reading the port inputs - exiting");
+    exit(-1);
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Ready to forward input %.1f ms after startup", (double)(timing_now_ns()-t_start)/NSEC_PER_MSEC);
+
+  // run the quadrature verifier in place of reading input and exit with
+  // its result
+  if (config_quad_units) {
+    exit(quad_run(config_mouse_port, config_mouse_emulation, config_quad_units) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  rc=rt_create_thread(&event_poll, RT_THREAD_INPUT, config_replay ? input_replay_thread : input_poll_thread, (void *)NULL);
   if (rc) {
     debug_log(LOGLEVEL_ERROR, "Failed to create event poll thread - exiting\n");
     exit(-1);
   }
 
+  // let the encoders send the last of the replayed movement and exit
+  if (config_replay) {
+    pthread_join(event_poll, NULL);
+    usleep(2*config_encoder_drain_ms*1000);
+    exit(EXIT_SUCCESS);
+  }
+
+  // run the benchmark and exit with its result
+  if (config_bench_samples) {
+    exit(bench_run(config_bench_samples, config_mouse_port, config_joystick_port) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
   // main thread sleeps
   do {
     sleep(1);
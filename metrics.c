@@ -0,0 +1,239 @@
+/*
+ * joyemu 
+ *
+ * Counters and histograms exported on a Unix socket in Prometheus text format.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "logging.h"
+#include "metrics.h"
+#include "timing.h"
+
+// names of the metric types in the exposition format
+const char *metric_type_name[]={ "counter", "gauge", "histogram" };
+
+// upper bounds of the histogram buckets in ns
+const uint64_t metrics_hist_bound[METRICS_HIST_BOUNDS]={
+  10*NSEC_PER_USEC, 25*NSEC_PER_USEC, 50*NSEC_PER_USEC, 100*NSEC_PER_USEC, 250*NSEC_PER_USEC, 500*NSEC_PER_USEC,
+  NSEC_PER_MSEC, 2500*NSEC_PER_USEC, 5*NSEC_PER_MSEC, 10*NSEC_PER_MSEC, 25*NSEC_PER_MSEC, 50*NSEC_PER_MSEC, 100*NSEC_PER_MSEC
+};
+
+// registered metrics. registering takes the lock, while the metrics thread
+// only reads the entries below the published count
+struct metric metrics[METRICS_MAX];
+int metrics_total=0;
+pthread_mutex_t metrics_lock=PTHREAD_MUTEX_INITIALIZER;
+
+// taken by metrics registered after the table is full, so their updates
+// are harmless
+struct metric metrics_overflow;
+
+// listening socket and the thread serving it
+int metrics_fd=-1;
+pthread_t metrics_thread;
+
+
+// add a metric to the table. the entry is filled in before it's published
+static struct metric *metrics_register(const char *name, const char *help, int type, const char *labels) {
+  struct metric *m;
+
+  pthread_mutex_lock(&metrics_lock);
+  if (metrics_total==METRICS_MAX) {
+    pthread_mutex_unlock(&metrics_lock);
+    debug_log(LOGLEVEL_DEBUG, "Too many metrics, %s{%s} is not exported", name, labels);
+    return &metrics_overflow;
+  }
+  m=&metrics[metrics_total];
+  memset(m, 0, sizeof(struct metric));
+  m->name=name;
+  m->help=help;
+  m->type=type;
+  snprintf(m->labels, METRICS_LABEL_LENGTH, "%s", labels ? labels : "");
+  __atomic_store_n(&metrics_total, metrics_total+1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&metrics_lock);
+  return m;
+}
+
+
+// register a counter and return the value to add to
+int64_t *metrics_counter(const char *name, const char *help, const char *labels) {
+  return &metrics_register(name, help, METRIC_COUNTER, labels)->value;
+}
+
+
+// register a gauge and return the value to set
+int64_t *metrics_gauge(const char *name, const char *help, const char *labels) {
+  return &metrics_register(name, help, METRIC_GAUGE, labels)->value;
+}
+
+
+// register a histogram of nanosecond values
+struct metrics_hist *metrics_histogram(const char *name, const char *help, const char *labels) {
+  return &metrics_register(name, help, METRIC_HISTOGRAM, labels)->hist;
+}
+
+
+// add a sample to a histogram
+void metrics_hist_add(struct metrics_hist *h, uint64_t ns) {
+  int i;
+  for(i=0;i<METRICS_HIST_BOUNDS && ns > metrics_hist_bound[i];i++);
+  __atomic_add_fetch(&h->bucket[i], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+}
+
+
+// write the samples of a histogram with cumulative buckets. the count is
+// taken from the buckets so that it always matches the +Inf bucket
+static void metrics_write_hist(FILE *f, const struct metric *m, const char *labels) {
+  const char *sep=m->labels[0] ? "," : "";
+  uint64_t count=0;
+  int i;
+
+  for(i=0;i<=METRICS_HIST_BOUNDS;i++) {
+    count+=__atomic_load_n(&m->hist.bucket[i], __ATOMIC_RELAXED);
+    if (i < METRICS_HIST_BOUNDS) {
+      fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", m->name, m->labels, sep,
+        (double)metrics_hist_bound[i]/NSEC_PER_SEC, (unsigned long long)count);
+    } else {
+      fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", m->name, m->labels, sep, (unsigned long long)count);
+    }
+  }
+  fprintf(f, "%s_sum%s %.9f\n", m->name, labels, (double)__atomic_load_n(&m->hist.sum, __ATOMIC_RELAXED)/NSEC_PER_SEC);
+  fprintf(f, "%s_count%s %llu\n", m->name, labels, (unsigned long long)count);
+}
+
+
+// write all metrics in the Prometheus text format, grouping the metrics
+// with the same name under one header
+static void metrics_write(FILE *f) {
+  int total=__atomic_load_n(&metrics_total, __ATOMIC_ACQUIRE), i, j;
+  const struct metric *m;
+  char labels[METRICS_LABEL_LENGTH+2];
+
+  for(i=0;i<total;i++) {
+    for(j=0;j<i && strcmp(metrics[j].name, metrics[i].name);j++);
+    if (j < i) continue;
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", metrics[i].name, metrics[i].help, metrics[i].name, metric_type_name[metrics[i].type]);
+    for(j=i;j<total;j++) {
+      m=&metrics[j];
+      if (strcmp(m->name, metrics[i].name)) continue;
+      // metrics without labels are written without the braces
+      if (m->labels[0]) snprintf(labels, sizeof(labels), "{%s}", m->labels);
+      else labels[0]=0;
+      if (m->type==METRIC_HISTOGRAM) metrics_write_hist(f, m, labels);
+      else fprintf(f, "%s%s %lld\n", m->name, labels, (long long)__atomic_load_n(&m->value, __ATOMIC_RELAXED));
+    }
+  }
+}
+
+
+// serve one connection. a client which sends an HTTP request within a
+// moment gets an HTTP response, anything else just the metrics
+static void metrics_serve(int fd) {
+  struct pollfd pfd={ .fd=fd, .events=POLLIN };
+  char request[256];
+  ssize_t len=0;
+  FILE *f;
+
+  if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0) len=read(fd, request, sizeof(request)-1);
+  f=fdopen(fd, "w");
+  if (!f) {
+    close(fd);
+    return;
+  }
+  if (len >= 4 && !memcmp(request, "GET ", 4)) {
+    fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+  }
+  metrics_write(f);
+  fclose(f);
+}
+
+
+// thread accepting connections to the metrics socket. it runs with normal
+// scheduling, so scraping can't delay the port or input threads
+static void *metrics_server(void *params) {
+  int fd;
+
+  debug_log(LOGLEVEL_DEBUG, "Started metrics thread");
+  do {
+    fd=accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno==EINTR || errno==ECONNABORTED) continue;
+      debug_log(LOGLEVEL_ERROR, "Failed to accept a metrics connection, errno %d", errno);
+      break;
+    }
+    metrics_serve(fd);
+  } while (1);
+  return NULL;
+}
+
+
+// listen for metrics requests on a Unix socket at the given path, replacing
+// any socket left over from an earlier run. returns -1 on failure
+int metrics_start(const char *path) {
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    debug_log(LOGLEVEL_ERROR, "Metrics socket path %s is too long", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, path);
+  metrics_fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (metrics_fd < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create metrics socket, errno %d", errno);
+    return -1;
+  }
+  // a client hanging up early must not kill the whole process
+  signal(SIGPIPE, SIG_IGN);
+  unlink(path);
+  if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) < 0 ||
+      listen(metrics_fd, METRICS_LISTEN_BACKLOG) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to listen on metrics socket %s, errno %d", path, errno);
+    close(metrics_fd);
+    metrics_fd=-1;
+    return -1;
+  }
+  if (pthread_create(&metrics_thread, NULL, metrics_server, NULL)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create metrics thread");
+    close(metrics_fd);
+    metrics_fd=-1;
+    return -1;
+  }
+  debug_log(LOGLEVEL_INFO, "Serving metrics on %s", path);
+  return 0;
+}
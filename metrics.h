@@ -0,0 +1,76 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+// metric types as exported
+#define METRIC_COUNTER		0
+#define METRIC_GAUGE		1
+#define METRIC_HISTOGRAM	2
+
+// number of metrics which can be registered and the length of their labels
+#define METRICS_MAX		64
+#define METRICS_LABEL_LENGTH	48
+
+// histogram bucket bounds in ns, from 10us to 100ms
+#define METRICS_HIST_BOUNDS	13
+
+// connections waiting to be served and the time a client gets to send a
+// request before it's sent the plain metrics
+#define METRICS_LISTEN_BACKLOG	4
+#define METRICS_REQUEST_MS	100
+
+// a histogram of nanosecond values exported in seconds. the buckets aren't
+// cumulative, the last one counts the values above the highest bound
+struct metrics_hist {
+  uint64_t bucket[METRICS_HIST_BOUNDS+1];
+  uint64_t sum;
+};
+
+// a registered metric. values are written by one thread with relaxed atomic
+// updates, so they can be read at any time without locking
+struct metric {
+  const char *name;
+  const char *help;
+  int type;
+  char labels[METRICS_LABEL_LENGTH];
+  int64_t value;
+  struct metrics_hist hist;
+};
+
+int64_t *metrics_counter(const char *name, const char *help, const char *labels);
+int64_t *metrics_gauge(const char *name, const char *help, const char *labels);
+struct metrics_hist *metrics_histogram(const char *name, const char *help, const char *labels);
+
+// add to a counter or set a gauge
+static inline void metrics_add(int64_t *m, int64_t n) { __atomic_add_fetch(m, n, __ATOMIC_RELAXED); }
+static inline void metrics_set(int64_t *m, int64_t v) { __atomic_store_n(m, v, __ATOMIC_RELAXED); }
+void metrics_hist_add(struct metrics_hist *h, uint64_t ns);
+
+int metrics_start(const char *path);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * joyemu 
+ *
+ * MSX mouse responder
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "defaults.h"
+#include "io.h"
+#include "logging.h"
+#include "metrics.h"
+#include "msx.h"
+#include "pinmap.h"
+#include "ports.h"
+#include "stats.h"
+#include "timing.h"
+
+// port the mouse is on
+int msx_port;
+
+// state of the read in progress, owned by the input thread of the expander
+uint64_t msx_last_strobe=0, msx_report_time;
+uint8_t msx_nibbles[4];
+int msx_nibble=0;
+
+// strobe edge to pin update latency, owned by the input thread, and the
+// same exported as a metric with the number of reads
+struct stats_hist msx_latency;
+struct metrics_hist *metric_msx_latency;
+int64_t *metric_msx_reads;
+
+
+// answer a strobe edge of the host. the movement is taken from the
+// accumulators on the first strobe of a read, and each strobe puts the next
+// nibble of it on pins 1-4 and writes the pins out right away rather than
+// waiting for the port I/O thread
+static void msx_strobe(void *arg, int level, uint64_t t_edge) {
+  uint64_t t;
+  int x, y;
+
+  // the MSX mouse counts movement to the left and up as positive
+  if (t_edge-msx_last_strobe > MSX_STROBE_TIMEOUT_US*NSEC_PER_USEC) {
+    mouse_take_movement(&x, &y, MSX_MAX_DELTA);
+    msx_nibbles[0]=((uint8_t)-x) >> 4;
+    msx_nibbles[1]=((uint8_t)-x) & 0x0f;
+    msx_nibbles[2]=((uint8_t)-y) >> 4;
+    msx_nibbles[3]=((uint8_t)-y) & 0x0f;
+    msx_nibble=0;
+    metrics_add(metric_msx_reads, 1);
+  }
+  msx_last_strobe=t_edge;
+  port_set_pins(msx_port, DB9_PIN(1)|DB9_PIN(2)|DB9_PIN(3)|DB9_PIN(4), msx_nibbles[msx_nibble]);
+  port_update_now();
+  msx_nibble=(msx_nibble+1)&3;
+
+  t=timing_now_ns();
+  stats_hist_add(&msx_latency, t > t_edge ? t-t_edge : 0);
+  metrics_hist_add(metric_msx_latency, t > t_edge ? t-t_edge : 0);
+  if (t >= msx_report_time) {
+    stats_hist_log(LOGLEVEL_VERBOSE, "MSX mouse strobe to response latency", &msx_latency);
+    stats_hist_reset(&msx_latency);
+    msx_report_time+=STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  }
+}
+
+
+// answer the MSX mouse strobe on pin 8 of a port once the expander input
+// threads are started. the pin has to be wired to a GPIO pin in the pin
+// map, and it's made an input. returns nonzero if the strobe can't be read
+int msx_start(int port) {
+  int bit=pinmap_gpio_bit(port-1, MSX_STROBE_PIN);
+
+  if (bit==PINMAP_UNCONNECTED) {
+    debug_log(LOGLEVEL_ERROR, "The MSX mouse needs pin %d of port %d wired in the pin map", MSX_STROBE_PIN, port);
+    return -1;
+  }
+  if (!io_backend->fast_inputs) {
+    debug_log(LOGLEVEL_ERROR, "The MSX mouse can't answer the host in time through the %s backend - use '-o gpio'", io_backend->name);
+    return -1;
+  }
+  msx_port=port-1;
+  stats_hist_reset(&msx_latency);
+  msx_report_time=timing_now_ns()+STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  metric_msx_latency=metrics_histogram("joyemu_msx_response_seconds", "Time from an MSX mouse strobe edge to the pin update", NULL);
+  metric_msx_reads=metrics_counter("joyemu_msx_reads_total", "Reads of the MSX mouse by the host", NULL);
+  if (mcp_watch_input(pinmap_expander[port-1], bit, msx_strobe, NULL) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to read pin %d of port %d as an input", MSX_STROBE_PIN, port);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * joyemu 
+ *
+ * Mapping of the DB9 joystick port pins to the GPIO pins of the I/O board.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defaults.h"
+#include "logging.h"
+#include "pinmap.h"
+#include "ports.h"
+
+
+// GPIO bit wired to each DB9 pin of each port on the port's expander. the
+// default is the wiring documented in the README: pins 1-4 on bits 0-3, pin
+// 6 on bit 4 and pin 9 on bit 5 of GPIOA for the odd ports and GPIOB for
+// the even ports, two ports on each expander
+#define PINMAP_GPIOA	{ 0,  1,  2,  3, -1,  4, -1, -1,  5}
+#define PINMAP_GPIOB	{ 8,  9, 10, 11, -1, 12, -1, -1, 13}
+int8_t pinmap[MAX_PORTS][DB9_PINS]={
+  PINMAP_GPIOA, PINMAP_GPIOB, PINMAP_GPIOA, PINMAP_GPIOB,
+  PINMAP_GPIOA, PINMAP_GPIOB, PINMAP_GPIOA, PINMAP_GPIOB
+};
+uint8_t pinmap_expander[MAX_PORTS]={ 0, 0, 1, 1, 2, 2, 3, 3 };
+
+// port pin state to GPIO bits
+uint16_t pinmap_lut[MAX_PORTS][PINMAP_LUT_SIZE];
+
+
+// parse a GPIO pin name, A0-A7 or B0-B7, or "none"
+static int pinmap_parse_gpio(const char *name) {
+  if (!strcmp(name, "none")) return PINMAP_UNCONNECTED;
+  if ((name[0]=='A' || name[0]=='a' || name[0]=='B' || name[0]=='b') &&
+      name[1]>='0' && name[1]<='7' && !name[2]) {
+    return ((name[0]=='B' || name[0]=='b') ? 8 : 0) + (name[1]-'0');
+  }
+  return -2;
+}
+
+
+// load a pin map file. each line has either the form "port <n> pin <n>
+// <gpio>", where gpio is A0-A7, B0-B7 or none, or "port <n> expander <n>"
+// to move a port to another expander. pins and ports not listed in the
+// file keep their default wiring
+int pinmap_load(const char *path) {
+  char line[256], gpio_name[16];
+  int lineno=0, port, pin, gpio, expander, i, j;
+  FILE *f=fopen(path, "r");
+
+  if (!f) {
+    debug_log(LOGLEVEL_ERROR, "Failed to open pin map %s, errno %d", path, errno);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    line[strcspn(line, "#\r\n")]=0;
+    if (strspn(line, " \t")==strlen(line)) continue;
+    if (sscanf(line, " port %d expander %d", &port, &expander)==2 &&
+        port>=1 && port<=MAX_PORTS && expander>=1 && expander<=MAX_EXPANDERS) {
+      pinmap_expander[port-1]=expander-1;
+      continue;
+    }
+    if (sscanf(line, " port %d pin %d %15s", &port, &pin, gpio_name)!=3 ||
+        port<1 || port>MAX_PORTS || pin<1 || pin>DB9_PINS ||
+        (gpio=pinmap_parse_gpio(gpio_name)) < PINMAP_UNCONNECTED) {
+      debug_log(LOGLEVEL_ERROR, "%s:%d: expected \"port <1-%d> pin <1-%d> <A0-A7|B0-B7|none>\" or \"port <1-%d> expander <1-%d>\"",
+        path, lineno, MAX_PORTS, DB9_PINS, MAX_PORTS, MAX_EXPANDERS);
+      fclose(f);
+      return -1;
+    }
+    pinmap[port-1][pin-1]=gpio;
+  }
+  fclose(f);
+
+  // every GPIO bit can be driven by one pin only
+  for(i=0;i<MAX_PORTS*DB9_PINS;i++) {
+    if (pinmap[i/DB9_PINS][i%DB9_PINS]==PINMAP_UNCONNECTED) continue;
+    for(j=i+1;j<MAX_PORTS*DB9_PINS;j++) {
+      if (pinmap_expander[i/DB9_PINS]==pinmap_expander[j/DB9_PINS] &&
+          pinmap[i/DB9_PINS][i%DB9_PINS]==pinmap[j/DB9_PINS][j%DB9_PINS]) {
+        debug_log(LOGLEVEL_ERROR, "%s: port %d pin %d and port %d pin %d are both mapped to the same GPIO pin", path,
+          i/DB9_PINS+1, i%DB9_PINS+1, j/DB9_PINS+1, j%DB9_PINS+1);
+        return -1;
+      }
+    }
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Loaded pin map from %s", path);
+  return 0;
+}
+
+
+// return the GPIO bit a DB9 pin of a port is wired to, or
+// PINMAP_UNCONNECTED
+int pinmap_gpio_bit(int port, int pin) {
+  if (port < 0 || port >= MAX_PORTS || pin < 1 || pin > DB9_PINS) return PINMAP_UNCONNECTED;
+  return pinmap[port][pin-1];
+}
+
+
+// build the lookup tables from the pin map, so that turning a port pin
+// state into GPIO bits takes a single lookup. the ports in use are those
+// up to the first one wired to an expander which isn't present. returns
+// the number of ports in use
+int pinmap_compile(int expanders) {
+  int port, pin, state, ports=0;
+  uint16_t gpio;
+
+  while (ports<MAX_PORTS && pinmap_expander[ports]<expanders) ports++;
+  for(port=0;port<ports;port++) {
+    for(state=0;state<PINMAP_LUT_SIZE;state++) {
+      gpio=0;
+      for(pin=0;pin<DB9_PINS;pin++) {
+        if (pinmap[port][pin]!=PINMAP_UNCONNECTED && (state & (1<<pin))) gpio|=1<<pinmap[port][pin];
+      }
+      pinmap_lut[port][state]=gpio;
+    }
+    for(pin=0;pin<DB9_PINS;pin++) {
+      if (pinmap[port][pin]!=PINMAP_UNCONNECTED) {
+        debug_log(LOGLEVEL_DEBUG, "Port %d pin %d is wired to GPIO%c%d on expander %d", port+1, pin+1,
+          pinmap[port][pin] < 8 ? 'A' : 'B', pinmap[port][pin]%8, pinmap_expander[port]+1);
+      }
+    }
+  }
+  return ports;
+}
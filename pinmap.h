@@ -0,0 +1,48 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PINMAP_H_
+#define _PINMAP_H_
+
+// number of GPIO bits on each expander, GPIOA in the low byte
+#define PINMAP_GPIO_BITS	16
+
+// marks a DB9 pin which isn't wired to the I/O board
+#define PINMAP_UNCONNECTED	-1
+
+// lookup table size, one entry for each state of the 9 port pins
+#define PINMAP_LUT_SIZE		512
+
+// port pin state to GPIO bits of the port's expander, compiled from the
+// pin map, and the expander each port is wired to
+extern uint16_t pinmap_lut[MAX_PORTS][PINMAP_LUT_SIZE];
+extern uint8_t pinmap_expander[MAX_PORTS];
+
+int pinmap_load(const char *path);
+int pinmap_compile(int expanders);
+int pinmap_gpio_bit(int port, int pin);
+
+#endif
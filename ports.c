@@ -27,14 +27,26 @@
  * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "defaults.h"
 #include "io.h"
 #include "logging.h"
+#include "metrics.h"
 #include "ports.h"
+#include "rt.h"
+#include "sequencer.h"
+#include "stats.h"
+#include "timing.h"
 
 
 uint8_t mouse_on_port=1;
@@ -48,11 +60,71 @@ uint32_t mouse_x_quadrature=0xf0f0f0f0;
 uint32_t mouse_y_encoder   =0x3c3c3c3c;
 uint32_t mouse_y_quadrature=0xf0f0f0f0;
 
-// accumulator for queued mouse movement
-int mouse_x_accumulator=0, mouse_y_accumulator=0;
+// rate at which the encoders are stepped, in steps per second, the rate
+// they may speed up to and the time a backlog of movement should drain in
+int encoder_step_rate=ENCODER_STEP_RATE;
+int encoder_max_step_rate=ENCODER_MAX_STEP_RATE;
+int encoder_drain_ms=ENCODER_DRAIN_MS;
 
-// current state of the pins in both ports
-uint16_t port1_pins=0x016f, port2_pins=0x016f;
+// queued mouse movement in 1/MOUSE_UNIT units. both axes are kept in one
+// word holding y*2^32+x, so the movement of a frame is queued on both axes
+// in a single atomic add and signed deltas carry between the halves just
+// like they would in a single number
+int64_t mouse_accumulator=0;
+#define MOUSE_PACK(x, y)	((int64_t)(y)*4294967296LL+(x))
+
+// current state of the pins and pad buttons in all ports, the number of
+// ports in use and the pad each of them emulates
+uint32_t port_pins[MAX_PORTS]={ [0 ... MAX_PORTS-1]=DB9_PINS_IDLE };
+int port_count=2;
+int port_pad[MAX_PORTS]={ [0 ... MAX_PORTS-1]=PORT_PAD_JOYSTICK };
+
+// time of the input wakeup which caused the pending pin change, 0 if none
+uint64_t port_input_time=0;
+
+// in tickless mode the port I/O thread sleeps while there's nothing to
+// send, with port_sleeping set, until the input side signals the eventfd.
+// the time of that signal gives the wakeup latency
+int port_tickless=0;
+int port_wakeup_fd=-1;
+int port_sleeping=0;
+uint64_t port_wake_time=0;
+
+// input wakeup to pin update latency, the lateness of encoder step
+// wakeups and the time taken to drain queued movement, owned by the port
+// I/O thread
+struct stats_hist input_latency, step_jitter, drain_time, wakeup_latency;
+
+// worst lateness of an encoder step wakeup since the thread started
+uint64_t step_jitter_worst=0;
+
+// largest queued movement seen since the last report, in whole units
+int mouse_peak_backlog=0;
+
+// policy for bounding the queued movement, the limit and whether the
+// limit is in milliseconds at the maximum step rate instead of units
+int mouse_lag_policy=MOUSE_LAG_OFF;
+int mouse_lag_limit=0, mouse_lag_limit_ms=0;
+
+// queued movement shed by the lag policy, in 1/MOUSE_UNIT units
+unsigned long mouse_shed_x=0, mouse_shed_y=0;
+
+// set by the port I/O thread once it has written the idle state of the
+// ports, so the input thread is only started once it can be served
+int port_ready=0;
+pthread_mutex_t port_ready_lock=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t port_ready_cond=PTHREAD_COND_INITIALIZER;
+
+// metrics exported while running: encoder steps per axis, the queued
+// movement, the time between encoder steps and the input to pin latency,
+// and the wakeups, cpu time and wakeup latency of the port I/O thread
+int64_t *metric_encoder_steps[2], *metric_mouse_backlog;
+struct metrics_hist *metric_loop_period, *metric_input_latency;
+int64_t *metric_port_wakeups, *metric_port_cpu;
+struct metrics_hist *metric_wakeup_latency;
+
+const char *mouse_lag_policy_name[]={"off", "clamp", "compress", "rescale"};
+const char *port_pad_name[]={"joystick", "cd32", "sega3", "sega6"};
 
 // axis direction names for debugging/logging
 const char *axis_direction[2][3]={
@@ -61,55 +133,227 @@ const char *axis_direction[2][3]={
 };
 
 
-// set the state of a joystick axis on one port
-void joystick_set_axis(int port, int axis, int state) {
-  uint16_t *port_pins=port ? &port2_pins : &port1_pins;
-  if (state < -1 || state > 1) return;
-  if (axis) {
-    debug_log(LOGLEVEL_VERBOSE, "Joystick %d Y axis state %s", port+1, axis_direction[1][state+1]);
-    switch (state) {
-      case -1: // state -1: joystick port 1/2 disable pin 1, enable pin 2
-      *port_pins&=0x01fe;
-      *port_pins|=2;
-      break;
-      
-      case  0: // state  0: joystick port 1/2 enable pin 1, enable pin 2
-      *port_pins|=1;
-      *port_pins|=2;
-      break;
-      
-      case  1: // state  1: joystick port 1/2 enable pin 1, disable pin 2
-      *port_pins|=1;
-      *port_pins&=0x01fd;
-      break;
-    }
+// turn a write to an active-low pin into one to a bit set while it's held,
+// for pads which don't put what's written to the pin on it directly
+static void port_pin_as_bit(uint32_t *mask, uint32_t *value, int pin, uint32_t bit) {
+  if (!(*mask & DB9_PIN(pin))) return;
+  *mask=(*mask & ~DB9_PIN(pin)) | bit;
+  *value=(*value & DB9_PIN(pin)) ? (*value & ~bit) : (*value | bit);
+}
+
+
+// apply a write to the state of a CD32 pad. pin 6 is written as the red
+// button, so that timed fire pin events work as they do on a joystick.
+// outside of a read the red and blue buttons are on pins 6 and 9, while
+// during one pin 9 is the shift register output and pin 6 is left alone
+static uint32_t port_merge_cd32(uint32_t old, uint32_t mask, uint32_t value) {
+  uint32_t new;
+
+  port_pin_as_bit(&mask, &value, 6, PORT_BUTTON(PORT_BUTTON_SOUTH));
+  new=(old & ~mask) | (value & mask);
+  if (new & PORT_CD32_SHIFTING) return (new & ~DB9_PIN(6)) | (old & DB9_PIN(6));
+  return (new & ~(DB9_PIN(6)|DB9_PIN(9))) |
+         DB9_PIN_LEVEL(6, !(new & PORT_BUTTON(PORT_BUTTON_SOUTH))) |
+         DB9_PIN_LEVEL(9, !(new & PORT_BUTTON(PORT_BUTTON_EAST)));
+}
+
+
+// apply a write to the state of a Sega pad. pins 1-4 are written as the
+// directions and pin 6 as B, and the pins are then put together for the
+// step of the select cycle the pad is in. with select high the pad shows
+// the directions, B and C, and with it low up, down, A and Start with
+// pins 3 and 4 low. a 6-button pad instead pulls pins 1-4 low on its
+// third low step, shows Z, Y, X and Mode on the next high step and
+// leaves them high on the last low one
+static uint32_t port_merge_sega(uint32_t old, uint32_t mask, uint32_t value, int six) {
+  uint32_t new, held, pins;
+  int phase, n;
+
+  for(n=1;n<=4;n++) port_pin_as_bit(&mask, &value, n, PORT_DIRECTION(n));
+  port_pin_as_bit(&mask, &value, 6, PORT_BUTTON(PORT_BUTTON_SOUTH));
+  new=(old & ~mask) | (value & mask);
+  phase=(new & PORT_SEGA_PHASE_MASK) >> 28;
+
+  held=new >> 24;
+  if (six && phase==5) held=0x0f;
+  if (six && phase==6) {
+    held=((new & PORT_BUTTON(PORT_BUTTON_TR)) ? 1 : 0) | ((new & PORT_BUTTON(PORT_BUTTON_NORTH)) ? 2 : 0) |
+         ((new & PORT_BUTTON(PORT_BUTTON_TL)) ? 4 : 0) | ((new & PORT_BUTTON(PORT_BUTTON_SELECT)) ? 8 : 0);
+  }
+  if (six && phase==7) held=0;
+  if (!six || phase < 5) held|=(phase & 1) ? 0x0c : 0;
+  pins=~held & 0x0f;
+  if (phase & 1) {
+    pins|=DB9_PIN_LEVEL(6, !(new & PORT_BUTTON(PORT_BUTTON_WEST))) | DB9_PIN_LEVEL(9, !(new & PORT_BUTTON(PORT_BUTTON_START)));
   } else {
-    debug_log(LOGLEVEL_VERBOSE, "Joystick %d X axis state %s", port+1, axis_direction[0][state+1]);
-    switch (state) {
-      case -1: // state -1: joystick port 1/2 disable pin 3, enable pin 4
-      *port_pins&=0x01fb;
-      *port_pins|=8;
+    pins|=DB9_PIN_LEVEL(6, !(new & PORT_BUTTON(PORT_BUTTON_SOUTH))) | DB9_PIN_LEVEL(9, !(new & PORT_BUTTON(PORT_BUTTON_EAST)));
+  }
+  return (new & ~(DB9_PIN(1)|DB9_PIN(2)|DB9_PIN(3)|DB9_PIN(4)|DB9_PIN(6)|DB9_PIN(9))) | pins;
+}
+
+
+// replace the masked pins and buttons of a port in one atomic update,
+// since both the input and the port I/O threads modify the pins of the
+// same port
+static void port_write_pins(int port, uint32_t mask, uint32_t value) {
+  uint32_t *pins=&port_pins[port], old=__atomic_load_n(pins, __ATOMIC_RELAXED), new;
+  do {
+    switch (port_pad[port]) {
+      case PORT_PAD_CD32:
+      new=port_merge_cd32(old, mask, value);
       break;
-      
-      case  0: // state  0: joystick port 1/2 enable pin 3, enable pin 4
-      *port_pins|=4;
-      *port_pins|=8;
+
+      case PORT_PAD_SEGA3:
+      case PORT_PAD_SEGA6:
+      new=port_merge_sega(old, mask, value, port_pad[port]==PORT_PAD_SEGA6);
       break;
-      
-      case  1: // state  1: joystick port 1/2 enable pin 3, disable pin 4
-      *port_pins|=4;
-      *port_pins&=0x01f7;
+
+      default:
+      new=(old & ~mask) | (value & mask);
       break;
     }
+  } while (!__atomic_compare_exchange_n(pins, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (new!=old) port_wake();
+}
+
+
+// set pins of a port directly, for timed pin events
+void port_set_pins(int port, uint32_t mask, uint32_t value) {
+  if (port < 0 || port >= port_count) return;
+  port_write_pins(port, mask, value);
+}
+
+
+// return the current pins and buttons of a port
+uint32_t port_get_state(int port) {
+  return __atomic_load_n(&port_pins[port], __ATOMIC_ACQUIRE);
+}
+
+
+// parse a pad name, returns -1 if it's not known
+int port_parse_pad(const char *name) {
+  int i;
+
+  for(i=0;i<(int)(sizeof(port_pad_name)/sizeof(port_pad_name[0]));i++) {
+    if (!strcmp(name, port_pad_name[i])) return i;
+  }
+  return -1;
+}
+
+
+// set the pad a port emulates, before the port I/O thread is started. the
+// latch of a CD32 pad is driven by the host, so until it's turned into an
+// input it's driven at the level the host idles it at
+void port_set_pad(int port, int pad) {
+  port_pad[port]=pad;
+  if (pad==PORT_PAD_CD32) port_pins[port]|=DB9_PIN(5);
+  debug_log(LOGLEVEL_VERBOSE, "Port %d emulates a %s pad", port+1, port_pad_name[pad]);
+}
+
+
+// return the pad a port emulates
+int port_get_pad(int port) {
+  return port_pad[port];
+}
+
+
+// extract the axes of queued mouse movement
+static inline int mouse_queued_x(int64_t v) { return (int32_t)(uint32_t)v; }
+static inline int mouse_queued_y(int64_t v) { return (int)((v-mouse_queued_x(v))/4294967296LL); }
+
+
+// start collecting the changes of an input frame for a port, or for the
+// mouse port with PORT_FRAME_MOUSE
+void port_frame_begin(struct port_frame *f, int port) {
+  f->port=port;
+  f->mask=0;
+  f->value=0;
+  f->dx=0;
+  f->dy=0;
+}
+
+
+// replace the masked pins of a frame
+static void port_frame_pins(struct port_frame *f, uint32_t mask, uint32_t value) {
+  f->mask|=mask;
+  f->value=(f->value & ~mask) | (value & mask);
+}
+
+
+// set the state of a joystick axis in a frame
+void joystick_frame_axis(struct port_frame *f, int axis, int state) {
+  if (state < -1 || state > 1) return;
+  if (axis) {
+    debug_log(LOGLEVEL_VERBOSE, "Joystick %d Y axis state %s", f->port+1, axis_direction[1][state+1]);
+    // state -1 disables pin 1, state 1 disables pin 2, center enables both
+    port_frame_pins(f, DB9_PIN(1)|DB9_PIN(2), DB9_PIN_LEVEL(1, state!=-1)|DB9_PIN_LEVEL(2, state!=1));
+  } else {
+    debug_log(LOGLEVEL_VERBOSE, "Joystick %d X axis state %s", f->port+1, axis_direction[0][state+1]);
+    // state -1 disables pin 3, state 1 disables pin 4, center enables both
+    port_frame_pins(f, DB9_PIN(3)|DB9_PIN(4), DB9_PIN_LEVEL(3, state!=-1)|DB9_PIN_LEVEL(4, state!=1));
   }  
 }
 
 
+// set joystick fire button 1 state in a frame
+void joystick_frame_fire(struct port_frame *f, int state) {
+  joystick_frame_button(f, PORT_BUTTON_SOUTH, state);
+}
+
+
+// set the state of a pad button in a frame. on a plain joystick all the
+// face buttons are the fire button and the others do nothing
+void joystick_frame_button(struct port_frame *f, int button, int state) {
+  debug_log(LOGLEVEL_VERBOSE, "Joystick %d button %d %s", f->port+1, button, state ? "down" : "up");
+  port_frame_pins(f, PORT_BUTTON(button), state ? PORT_BUTTON(button) : 0);
+  if (port_pad[f->port]==PORT_PAD_JOYSTICK && (PORT_BUTTON(button) & PORT_BUTTONS_FACE)) {
+    port_frame_pins(f, DB9_PIN(6), DB9_PIN_LEVEL(6, !state));  // write !state to joystick port pin 6
+  }
+}
+
+
+// center the axes and release all buttons in a frame
+void joystick_frame_release(struct port_frame *f) {
+  joystick_frame_axis(f, PORT_AXIS_HORIZONTAL, PORT_AXIS_STATE_CENTER);
+  joystick_frame_axis(f, PORT_AXIS_VERTICAL, PORT_AXIS_STATE_CENTER);
+  port_frame_pins(f, PORT_BUTTON_MASK, 0);
+  if (port_pad[f->port]==PORT_PAD_JOYSTICK) port_frame_pins(f, DB9_PIN(6), DB9_PIN(6));
+}
+
+
+// set the state of a joystick axis on one port
+void joystick_set_axis(int port, int axis, int state) {
+  struct port_frame f;
+
+  port_frame_begin(&f, port);
+  joystick_frame_axis(&f, axis, state);
+  port_frame_commit(&f);
+}
+
+
 // set joystick fire button 1 state on port
 void joystick_set_fire(int port, int state) {
-  uint16_t *port_pins=port ? &port2_pins : &port1_pins;
-  debug_log(LOGLEVEL_VERBOSE, "Joystick %d fire button %s", port+1, state ? "down" : "up");
-  *port_pins=(*port_pins&0x01df)|(((!state)&1)<<5);  // write state&1 to joystick port 1/2 pin 6
+  struct port_frame f;
+
+  port_frame_begin(&f, port);
+  joystick_frame_fire(&f, state);
+  port_frame_commit(&f);
+}
+
+
+// center the axes and release all buttons on one port
+void joystick_release(int port) {
+  struct port_frame f;
+
+  port_frame_begin(&f, port);
+  joystick_frame_release(&f);
+  port_frame_commit(&f);
+}
+
+
+// set the number of joystick ports in use
+void port_set_count(int ports) {
+  port_count=ports;
 }
 
 
@@ -123,10 +367,52 @@ void mouse_set_emulation(int type) {
   mouse_emulation=type;
 }
 
+
+// set the rate in steps per second at which queued movement is sent, and
+// the rate it may rise to when a lot of movement is queued
+void mouse_set_step_rate(int rate, int max_rate) {
+  encoder_step_rate=rate;
+  encoder_max_step_rate=(max_rate > rate) ? max_rate : rate;
+}
+
+
+// set the policy for bounding queued movement. the limit is either in
+// movement units or in milliseconds it takes to send at the maximum rate
+void mouse_set_lag_policy(int policy, int limit, int limit_in_ms) {
+  mouse_lag_policy=policy;
+  mouse_lag_limit=limit;
+  mouse_lag_limit_ms=limit_in_ms;
+}
+
+
+// parse a lag policy given as "policy:limit" with the limit in units or
+// followed by "ms". returns the policy or -1 if the string is invalid
+int mouse_parse_lag_policy(const char *spec, int *limit, int *limit_in_ms) {
+  size_t len=strcspn(spec, ":");
+  char unit[8]="";
+  int i, policy=-1;
+
+  for(i=MOUSE_LAG_OFF;i<=MOUSE_LAG_RESCALE;i++) {
+    if (strlen(mouse_lag_policy_name[i])==len && !strncmp(mouse_lag_policy_name[i], spec, len)) policy=i;
+  }
+  *limit=0;
+  if (spec[len]==':' && sscanf(&spec[len+1], "%d%7s", limit, unit) < 1) return -1;
+  *limit_in_ms=!strcmp(unit, "ms");
+  if (unit[0] && !*limit_in_ms) return -1;
+  if (policy!=MOUSE_LAG_OFF && *limit < 1) return -1;
+  return policy;
+}
+
+
+// set the time in milliseconds queued movement should be sent in
+void mouse_set_drain_time(int ms) {
+  encoder_drain_ms=ms;
+}
+
 // rotate the horizintal encoder in the mouse for a number of bits (positive or negative)
 void mouse_rotate_x_encoder(int8_t bits) {
   uint32_t e, q;
-  uint16_t *port_pins=(mouse_on_port==2) ? &port2_pins : &port1_pins;
+  int port=mouse_on_port-1;
   
   if (bits < 0) {
     e=(mouse_x_encoder >> (-bits)) | (mouse_x_encoder << (32+bits));
@@ -138,11 +424,11 @@ void mouse_rotate_x_encoder(int8_t bits) {
   mouse_x_encoder=e;
   mouse_x_quadrature=q;
   if (mouse_emulation==MOUSE_TYPE_AMIGA) {
-    *port_pins=(*port_pins&0x01fd)|((e&1)<<1); // write e&1 to joystick port 1 pin 2
-    *port_pins=(*port_pins&0x01f7)|((q&1)<<3); // write q&1 to joystick port 1 pin 4
+    // write e&1 to pin 2 and q&1 to pin 4
+    port_write_pins(port, DB9_PIN(2)|DB9_PIN(4), DB9_PIN_LEVEL(2, e)|DB9_PIN_LEVEL(4, q));
   } else {
-    *port_pins=(*port_pins&0x01fd)|((e&1)<<1); // write e&1 to joystick port 1 pin 2  
-    *port_pins=(*port_pins&0x01fe)|(q&1);      // write q&1 to joystick port 1 pin 1
+    // write e&1 to pin 2 and q&1 to pin 1
+    port_write_pins(port, DB9_PIN(2)|DB9_PIN(1), DB9_PIN_LEVEL(2, e)|DB9_PIN_LEVEL(1, q));
   }
 }
 
@@ -150,7 +436,7 @@ void mouse_rotate_x_encoder(int8_t bits) {
 // rotate the vertical encoder in the mouse for a number of bits (positive or negative)
 void mouse_rotate_y_encoder(int8_t bits) {
   uint32_t e=mouse_y_encoder, q=mouse_y_quadrature;
-  uint16_t *port_pins=(mouse_on_port==2) ? &port2_pins : &port1_pins;
+  int port=mouse_on_port-1;
 
   if (bits < 0) {
     e=(mouse_y_encoder >> (-bits)) | (mouse_y_encoder << (32+bits));
@@ -162,76 +448,464 @@ void mouse_rotate_y_encoder(int8_t bits) {
   mouse_y_encoder=e;
   mouse_y_quadrature=q;  
   if (mouse_emulation==MOUSE_TYPE_AMIGA) {
-    *port_pins=(*port_pins&0x01fe)|(e&1); // write e&1 to joystick port 1 pin 1
-    *port_pins=(*port_pins&0x01fb)|((q&1)<<2); // write q&1 to joystick port 1 pin 3
+    // write e&1 to pin 1 and q&1 to pin 3
+    port_write_pins(port, DB9_PIN(1)|DB9_PIN(3), DB9_PIN_LEVEL(1, e)|DB9_PIN_LEVEL(3, q));
   } else {
-    *port_pins=(*port_pins&0x01fb)|((e&1)<<2); // write e&1 to joystick port 1 pin 3  
-    *port_pins=(*port_pins&0x01f7)|((q&1)<<3); // write q&1 to joystick port 1 pin 4
+    // write e&1 to pin 3 and q&1 to pin 4
+    port_write_pins(port, DB9_PIN(3)|DB9_PIN(4), DB9_PIN_LEVEL(3, e)|DB9_PIN_LEVEL(4, q));
   }
 }
 
 
-// move the mouse on an axis for the specified amount of distance units
-void mouse_move(int axis, int distance) {
-  float scaled_distance=mouse_speed*distance;
-  int delta=round(scaled_distance);
-  
+// apply the lag policy to one axis, returning the new queued movement for
+// a value over the limit
+static int mouse_bound_axis(int queued, int limit) {
+  int sign=queued < 0 ? -1 : 1;
+  long long excess=(long long)abs(queued)-limit;
+
+  if (excess <= 0) return queued;
+  if (mouse_lag_policy==MOUSE_LAG_CLAMP) return sign*limit;
+
+  // compress the excess with a soft knee, so the backlog grows ever more
+  // slowly past the limit and never reaches twice the limit
+  return sign*(int)(limit + (long long)limit*excess/(excess+limit));
+}
+
+
+// keep the queued movement within the lag limit so that the pointer stops
+// soon after the hand does, and count the movement which was shed
+static void mouse_limit_lag(void) {
+  int64_t queued, limit64;
+  int x, y, bx, by, limit, largest;
+
+  // a limit beyond what an axis can hold never bounds anything
+  limit64=mouse_lag_limit_ms ? (int64_t)mouse_lag_limit*encoder_max_step_rate/1000 : mouse_lag_limit;
+  limit64*=MOUSE_UNIT;
+  limit=limit64 > INT32_MAX ? INT32_MAX : limit64;
+  queued=__atomic_load_n(&mouse_accumulator, __ATOMIC_RELAXED);
+  x=mouse_queued_x(queued);
+  y=mouse_queued_y(queued);
+  largest=abs(x) > abs(y) ? abs(x) : abs(y);
+  if (largest <= limit) return;
+
+  if (mouse_lag_policy==MOUSE_LAG_RESCALE) {
+    // scale both axes by the same factor to keep the direction of motion
+    bx=(long long)x*limit/largest;
+    by=(long long)y*limit/largest;
+  } else {
+    bx=mouse_bound_axis(x, limit);
+    by=mouse_bound_axis(y, limit);
+  }
+
+  // subtract rather than store, as the port thread may have stepped the
+  // encoders in the meantime
+  __atomic_sub_fetch(&mouse_accumulator, MOUSE_PACK(x-bx, y-by), __ATOMIC_RELAXED);
+  if (bx != x) __atomic_add_fetch(&mouse_shed_x, abs(x-bx), __ATOMIC_RELAXED);
+  if (by != y) __atomic_add_fetch(&mouse_shed_y, abs(y-by), __ATOMIC_RELAXED);
+}
+
+
+// move the mouse on an axis in a frame for the specified amount of
+// distance units
+void mouse_frame_move(struct port_frame *f, int axis, int distance) {
   if (axis) {
-    mouse_y_accumulator+=delta;
+    f->dy+=distance;
     debug_log(LOGLEVEL_DEBUG, "Mouse moved vertically %d units", distance);
   } else {
-    mouse_x_accumulator+=delta;
+    f->dx+=distance;
     debug_log(LOGLEVEL_DEBUG, "Mouse moved horizontally %d units", distance);
   }
 }
 
 
+// set mouse left button state in a frame (1=up, 0=down)
+void mouse_frame_lmb(struct port_frame *f, int state) {
+  debug_log(LOGLEVEL_VERBOSE, "Mouse left button %s", state ? "down" : "up");
+  port_frame_pins(f, DB9_PIN(6), DB9_PIN_LEVEL(6, !state)); // write !state to pin 6
+}
+
+
+// set mouse right button state in a frame (1=up, 0=down)
+void mouse_frame_rmb(struct port_frame *f, int state) {
+  debug_log(LOGLEVEL_VERBOSE, "Mouse right button %s", state ? "down" : "up");
+  if (mouse_emulation==MOUSE_TYPE_MSX) {
+    port_frame_pins(f, DB9_PIN(7), DB9_PIN_LEVEL(7, !state)); // write !state to pin 7
+  } else {
+    port_frame_pins(f, DB9_PIN(9), DB9_PIN_LEVEL(9, !state)); // write !state to pin 9
+  }
+}
+
+
+// commit the changes of a frame to the port state, all pins in one atomic
+// update and the movement on both axes in another, and start a new frame
+// for the same port. the scaled movement is queued in fixed point, so the
+// fraction of a unit left over from slow movements is carried to the next
+// frame. returns nonzero if the frame changed anything
+int port_frame_commit(struct port_frame *f) {
+  int port=(f->port==PORT_FRAME_MOUSE) ? mouse_on_port-1 : f->port;
+  int changed=f->mask || f->dx || f->dy;
+
+  if (f->mask && port >= 0 && port < port_count) port_write_pins(port, f->mask, f->value);
+  if (f->dx || f->dy) {
+    __atomic_add_fetch(&mouse_accumulator, MOUSE_PACK(lroundf(mouse_speed*MOUSE_UNIT*f->dx), lroundf(mouse_speed*MOUSE_UNIT*f->dy)), __ATOMIC_RELAXED);
+    if (mouse_lag_policy!=MOUSE_LAG_OFF) mouse_limit_lag();
+    port_wake();
+  }
+  port_frame_begin(f, f->port);
+  return changed;
+}
+
+
+// take the whole units of queued movement on both axes, at most limit
+// units on each, for mice which report movement when asked rather than
+// stepping encoders. returns nonzero if there was any movement
+int mouse_take_movement(int *x, int *y, int limit) {
+  int64_t v=__atomic_load_n(&mouse_accumulator, __ATOMIC_RELAXED);
+
+  *x=mouse_queued_x(v)/MOUSE_UNIT;
+  *y=mouse_queued_y(v)/MOUSE_UNIT;
+  if (*x > limit) *x=limit;
+  if (*x < -limit) *x=-limit;
+  if (*y > limit) *y=limit;
+  if (*y < -limit) *y=-limit;
+  __atomic_sub_fetch(&mouse_accumulator, MOUSE_PACK(*x*MOUSE_UNIT, *y*MOUSE_UNIT), __ATOMIC_RELAXED);
+  return *x || *y;
+}
+
+
+// queue movement in whole encoder units, without the mouse speed applied
+void mouse_queue_units(int x, int y) {
+  __atomic_add_fetch(&mouse_accumulator, MOUSE_PACK(x*MOUSE_UNIT, y*MOUSE_UNIT), __ATOMIC_RELAXED);
+  port_wake();
+}
+
+
+// return the whole units of movement queued on the busier axis
+int mouse_backlog(void) {
+  int64_t v=__atomic_load_n(&mouse_accumulator, __ATOMIC_RELAXED);
+  int x=abs(mouse_queued_x(v))/MOUSE_UNIT, y=abs(mouse_queued_y(v))/MOUSE_UNIT;
+
+  return x > y ? x : y;
+}
+
+
+// write the current pin states to the expanders right away instead of on
+// the next wakeup of the port I/O thread. returns the number of GPIO banks
+// written, or MCP_UPDATE_DEFERRED if a bus writer was behind and the port
+// I/O thread has to finish the update
+int port_update_now(void) {
+  return mcp_update_port_state(port_pins, port_count);
+}
+
+
+// move the mouse on an axis for the specified amount of distance units
+void mouse_move(int axis, int distance) {
+  struct port_frame f;
+
+  port_frame_begin(&f, PORT_FRAME_MOUSE);
+  mouse_frame_move(&f, axis, distance);
+  port_frame_commit(&f);
+}
+
+
 // set mouse left button state (1=up, 0=down)
 void mouse_set_lmb(int state) {
-  uint16_t *port_pins=(mouse_on_port==2) ? &port2_pins : &port1_pins;
-  debug_log(LOGLEVEL_VERBOSE, "Mouse left button %s", state ? "down" : "up");
-  *port_pins=(*port_pins&0x01df)|(((!state)&1)<<5); // write state&1 to joystick port 1 pin 6
+  struct port_frame f;
+
+  port_frame_begin(&f, PORT_FRAME_MOUSE);
+  mouse_frame_lmb(&f, state);
+  port_frame_commit(&f);
 }
 
 
 // set mouse right button state (1=up, 0=down)
 void mouse_set_rmb(int state) {
-  uint16_t *port_pins=(mouse_on_port==2) ? &port2_pins : &port1_pins;
-  debug_log(LOGLEVEL_VERBOSE, "Mouse right button %s", state ? "down" : "up");
-  *port_pins=(*port_pins&0x00ff)|(((!state)&1)<<8); // write state&1 to joystick port 1 pin 9
+  struct port_frame f;
+
+  port_frame_begin(&f, PORT_FRAME_MOUSE);
+  mouse_frame_rmb(&f, state);
+  port_frame_commit(&f);
 }
 
 
-// the thread function which performs port I/O and steps the mouse encoders
+// note that an input event woken up at time t has changed port state. only
+// the earliest pending wakeup is kept so that batched events are measured
+// from the first one
+void port_mark_input(uint64_t t) {
+  uint64_t none=0;
+  __atomic_compare_exchange_n(&port_input_time, &none, t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+
+// let the port I/O thread sleep while no movement is queued and no pin
+// changes are pending, to be woken up through an eventfd when the port
+// state changes. returns -1 if the eventfd can't be created
+int port_set_tickless(int enabled) {
+  if (enabled && port_wakeup_fd < 0) {
+    port_wakeup_fd=eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (port_wakeup_fd < 0) return -1;
+  }
+  port_tickless=enabled;
+  return 0;
+}
+
+
+// wake up the port I/O thread after changing the port state, if it's
+// sleeping. only the first caller to find it asleep signals the eventfd
+void port_wake(void) {
+  uint64_t one=1;
+
+  // the change has to be seen before the flag, or the thread could miss
+  // it after setting the flag
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&port_sleeping, __ATOMIC_RELAXED)) return;
+  if (!__atomic_exchange_n(&port_sleeping, 0, __ATOMIC_SEQ_CST)) return;
+  __atomic_store_n(&port_wake_time, timing_now_ns(), __ATOMIC_RELAXED);
+  if (write(port_wakeup_fd, &one, sizeof(one)) < 0) debug_log(LOGLEVEL_DEBUG, "Failed to wake up the port I/O thread");
+}
+
+
+// wait until the port I/O thread is running and has written the ports
+void port_wait_ready(void) {
+  pthread_mutex_lock(&port_ready_lock);
+  while (!port_ready) pthread_cond_wait(&port_ready_cond, &port_ready_lock);
+  pthread_mutex_unlock(&port_ready_lock);
+}
+
+
+// tell the threads waiting for the port I/O thread that it's running
+static void port_set_ready(void) {
+  pthread_mutex_lock(&port_ready_lock);
+  port_ready=1;
+  pthread_cond_broadcast(&port_ready_cond);
+  pthread_mutex_unlock(&port_ready_lock);
+}
+
+
+// step the encoder of an axis by one unit if at least a whole unit of
+// movement is queued, leaving any fraction of a unit in the accumulator.
+// an MSX mouse has no encoders, the host takes the movement when it reads
+// the mouse. returns the number of whole units still queued
+static int mouse_step_axis(int axis) {
+  int64_t unit=axis ? MOUSE_PACK(0, MOUSE_UNIT) : MOUSE_PACK(MOUSE_UNIT, 0), v=__atomic_load_n(&mouse_accumulator, __ATOMIC_RELAXED);
+  int queued=axis ? mouse_queued_y(v) : mouse_queued_x(v);
+
+  if (mouse_emulation==MOUSE_TYPE_MSX) return abs(queued)/MOUSE_UNIT;
+  if (queued >= MOUSE_UNIT) {
+    if (axis) mouse_rotate_y_encoder(ENCODER_BITS_PER_UNIT);
+    else mouse_rotate_x_encoder(ENCODER_BITS_PER_UNIT);
+    v=__atomic_sub_fetch(&mouse_accumulator, unit, __ATOMIC_RELAXED);
+    metrics_add(metric_encoder_steps[axis], 1);
+  } else if (queued <= -MOUSE_UNIT) {
+    if (axis) mouse_rotate_y_encoder(-ENCODER_BITS_PER_UNIT);
+    else mouse_rotate_x_encoder(-ENCODER_BITS_PER_UNIT);
+    v=__atomic_add_fetch(&mouse_accumulator, unit, __ATOMIC_RELAXED);
+    metrics_add(metric_encoder_steps[axis], 1);
+  }
+  queued=axis ? mouse_queued_y(v) : mouse_queued_x(v);
+  return abs(queued)/MOUSE_UNIT;
+}
+
+
+// step interval for the queued movement. the step rate rises above the
+// base rate when needed to send the backlog within the drain time, so big
+// flicks finish quickly while slow movements stay at the base rate
+static uint64_t mouse_step_interval(int backlog) {
+  uint64_t rate=(uint64_t)backlog*1000/encoder_drain_ms;
+
+  if (rate < (uint64_t)encoder_step_rate) rate=encoder_step_rate;
+  if (rate > (uint64_t)encoder_max_step_rate) rate=encoder_max_step_rate;
+  return NSEC_PER_SEC/rate;
+}
+
+
+// sleep until the input side changes the port state or the deadline for
+// the next timer or report, unless something has changed since the ports
+// were written with the given pins. returns nonzero if woken up by the
+// input side
+static int port_idle_wait(const uint32_t *written, uint64_t deadline) {
+  struct pollfd pfd={ .fd=port_wakeup_fd, .events=POLLIN };
+  struct timespec ts;
+  uint64_t t=0, value, t_wake;
+  int i, idle=1, woken=0;
+
+  __atomic_store_n(&port_sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  // look again for changes made before the flag was set
+  for(i=0;i<port_count;i++) {
+    if (__atomic_load_n(&port_pins[i], __ATOMIC_RELAXED)!=written[i]) idle=0;
+  }
+  if ((mouse_emulation!=MOUSE_TYPE_MSX && mouse_backlog()) || seq_pending()) idle=0;
+  if (idle) {
+    t=timing_now_ns();
+    timing_ns_to_timespec(deadline > t ? deadline-t : 0, &ts);
+    if (ppoll(&pfd, 1, &ts, NULL) > 0) woken=1;
+  }
+
+  // if a caller took the flag it has signalled or is about to signal the
+  // eventfd. a signal still on its way ends the next sleep early, so it's
+  // only measured if it was sent while sleeping
+  if (!__atomic_exchange_n(&port_sleeping, 0, __ATOMIC_SEQ_CST) || woken) {
+    if (read(port_wakeup_fd, &value, sizeof(value)) < 0) value=0;
+  }
+  t_wake=__atomic_load_n(&port_wake_time, __ATOMIC_RELAXED);
+  if (woken && t_wake >= t) {
+    t_wake=timing_now_ns()-t_wake;
+    stats_hist_add(&wakeup_latency, t_wake);
+    metrics_hist_add(metric_wakeup_latency, t_wake);
+  }
+  return woken;
+}
+
+
+// cpu time used by the calling thread in nanoseconds
+static uint64_t port_thread_cpu_ns(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+  return (uint64_t)ts.tv_sec*NSEC_PER_SEC+ts.tv_nsec;
+}
+
+
+// the thread function which performs port I/O and steps the mouse encoders.
+// the thread wakes up at absolute deadlines on the monotonic clock, one
+// encoder step interval apart, so wall-clock adjustments can't disturb it.
+// in tickless mode it sleeps in between while the mouse is still and the
+// pins don't change
 void *port_io_thread(void *params) {
-  struct timeval t, last_t;
-  long int dt=0;
+  uint64_t t, t_next, t_input, t_report, t_backlog=0, t_step=0, interval, cpu, cpu_report;
+  unsigned long overruns=0, wakeups=0, input_wakeups=0;
+  uint32_t written[MAX_PORTS];
+  int backlog=0, backlog_y, stepping, i, updated, deferred=0;
   
   debug_log(LOGLEVEL_DEBUG, "Started port I/O thread");
-  gettimeofday(&last_t, NULL);
+  metric_encoder_steps[PORT_AXIS_HORIZONTAL]=metrics_counter("joyemu_encoder_steps_total", "Mouse encoder steps emitted", "axis=\"x\"");
+  metric_encoder_steps[PORT_AXIS_VERTICAL]=metrics_counter("joyemu_encoder_steps_total", "Mouse encoder steps emitted", "axis=\"y\"");
+  metric_mouse_backlog=metrics_gauge("joyemu_mouse_backlog_units", "Whole units of mouse movement waiting to be sent", NULL);
+  metric_loop_period=metrics_histogram("joyemu_port_loop_period_seconds", "Time between encoder steps of the port I/O thread", NULL);
+  metric_input_latency=metrics_histogram("joyemu_input_latency_seconds", "Time from input wakeup to pin update", NULL);
+  metric_port_wakeups=metrics_counter("joyemu_port_wakeups_total", "Wakeups of the port I/O thread", NULL);
+  metric_port_cpu=metrics_counter("joyemu_port_cpu_microseconds_total", "CPU time used by the port I/O thread", NULL);
+  metric_wakeup_latency=metrics_histogram("joyemu_port_wakeup_latency_seconds", "Time from a port state change to the port I/O thread waking up from idle", NULL);
+  stats_hist_reset(&input_latency);
+  stats_hist_reset(&step_jitter);
+  stats_hist_reset(&drain_time);
+  stats_hist_reset(&wakeup_latency);
+  interval=NSEC_PER_SEC/encoder_step_rate;
+  t_next=timing_now_ns()+interval;
+  t_report=t_next+STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  seq_init(t_next);
+  mcp_update_port_state(port_pins, port_count);
+  cpu_report=port_thread_cpu_ns();
+  if (port_tickless) debug_log(LOGLEVEL_VERBOSE, "Port I/O thread sleeps while idle");
+  port_set_ready();
   do {
-    gettimeofday(&t, NULL);
-    dt=t.tv_usec - last_t.tv_usec;
-    if (dt<0) dt=1000000L-dt;
-    if (dt > ENCODER_MIN_US_PER_BIT) {
-
-      if (mouse_x_accumulator > 0) {
-        mouse_rotate_x_encoder(ENCODER_BITS_PER_UNIT);
-        mouse_x_accumulator--;
-      } else if (mouse_x_accumulator < 0) {
-        mouse_rotate_x_encoder(-ENCODER_BITS_PER_UNIT);
-        mouse_x_accumulator++;
+    // wake up for the next encoder step, or earlier for a timed pin event
+    timing_sleep_until_ns(seq_next_deadline(t_next));
+    t=timing_now_ns();
+    wakeups++;
+    metrics_add(metric_port_wakeups, 1);
+    seq_run(t);
+
+    stepping=(t >= t_next);
+    if (stepping) {
+      stats_hist_add(&step_jitter, t-t_next);
+      if (t-t_next > step_jitter_worst) step_jitter_worst=t-t_next;
+      if (t_step) metrics_hist_add(metric_loop_period, t-t_step);
+      t_step=t;
+
+      backlog=mouse_step_axis(PORT_AXIS_HORIZONTAL);
+      backlog_y=mouse_step_axis(PORT_AXIS_VERTICAL);
+      if (backlog_y > backlog) backlog=backlog_y;
+      metrics_set(metric_mouse_backlog, backlog);
+    }
+
+    for(i=0;i<port_count;i++) written[i]=__atomic_load_n(&port_pins[i], __ATOMIC_RELAXED);
+    updated=mcp_update_port_state(port_pins, port_count);
+    deferred=(updated==MCP_UPDATE_DEFERRED);
+    if (updated > 0) {
+      t_input=__atomic_exchange_n(&port_input_time, 0, __ATOMIC_ACQUIRE);
+      if (t_input) {
+        t_input=timing_now_ns()-t_input;
+        stats_hist_add(&input_latency, t_input);
+        metrics_hist_add(metric_input_latency, t_input);
       }
-      if (mouse_y_accumulator > 0) {
-        mouse_rotate_y_encoder(ENCODER_BITS_PER_UNIT);
-        mouse_y_accumulator--;
-      } else if (mouse_y_accumulator < 0) {
-        mouse_rotate_y_encoder(-ENCODER_BITS_PER_UNIT);
-        mouse_y_accumulator++;
+    }
+    if (!stepping) continue;
+
+    // track how large the backlog gets and how long it takes to send
+    if (backlog) {
+      if (!t_backlog) t_backlog=t;
+      if (backlog > mouse_peak_backlog) mouse_peak_backlog=backlog;
+    } else if (t_backlog) {
+      stats_hist_add(&drain_time, t-t_backlog);
+      t_backlog=0;
+    }
+
+    // if the whole step interval was missed, continue from now rather than
+    // emitting a burst of steps to catch up
+    interval=mouse_step_interval(backlog);
+    t_next+=interval;
+    t=timing_now_ns();
+    if (t >= t_next) {
+      overruns++;
+      t_next=t+interval;
+    }
+
+    // periodically report the input latency and step timing
+    if (t >= t_report) {
+      stats_hist_log(LOGLEVEL_VERBOSE, "Input wakeup to pin update latency", &input_latency);
+      // in real-time mode the step timing is what the mode is for, so it's
+      // reported by default
+      stats_hist_log(rt_enabled() ? LOGLEVEL_INFO : LOGLEVEL_VERBOSE, "Encoder step jitter", &step_jitter);
+      debug_log(rt_enabled() ? LOGLEVEL_INFO : LOGLEVEL_VERBOSE, "Encoder step jitter worst case since start %.1f us",
+        (double)step_jitter_worst/NSEC_PER_USEC);
+      if (overruns) debug_log(LOGLEVEL_VERBOSE, "Encoder step interval overran %lu times", overruns);
+      stats_hist_log(LOGLEVEL_VERBOSE, "Mouse backlog drain time", &drain_time);
+      debug_log(LOGLEVEL_VERBOSE, "Mouse backlog peaked at %d units", mouse_peak_backlog);
+      if (mouse_lag_policy!=MOUSE_LAG_OFF) {
+        debug_log(LOGLEVEL_VERBOSE, "Mouse lag policy %s shed %lu horizontal and %lu vertical units",
+          mouse_lag_policy_name[mouse_lag_policy],
+          __atomic_exchange_n(&mouse_shed_x, 0, __ATOMIC_RELAXED)/MOUSE_UNIT,
+          __atomic_exchange_n(&mouse_shed_y, 0, __ATOMIC_RELAXED)/MOUSE_UNIT);
+      }
+      seq_log_stats();
+      mcp_log_stats(t-t_report+STATS_REPORT_INTERVAL*NSEC_PER_SEC);
+
+      // the cost of the thread, to weigh power use against latency
+      cpu=port_thread_cpu_ns();
+      metrics_add(metric_port_cpu, (cpu-cpu_report)/NSEC_PER_USEC);
+      debug_log(LOGLEVEL_VERBOSE, "Port I/O thread used %.2f%% CPU with %.0f wakeups per second",
+        100.0*(cpu-cpu_report)/(t-t_report+STATS_REPORT_INTERVAL*NSEC_PER_SEC),
+        (double)wakeups/STATS_REPORT_INTERVAL);
+      if (port_tickless) {
+        debug_log(LOGLEVEL_VERBOSE, "Port I/O thread was woken up from idle %lu times", input_wakeups);
+        stats_hist_log(LOGLEVEL_VERBOSE, "Idle wakeup latency", &wakeup_latency);
       }
+      cpu_report=cpu;
+      stats_hist_reset(&input_latency);
+      stats_hist_reset(&step_jitter);
+      stats_hist_reset(&drain_time);
+      stats_hist_reset(&wakeup_latency);
+      mouse_peak_backlog=0;
+      overruns=0;
+      wakeups=0;
+      input_wakeups=0;
+      t_report+=STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+    }
 
-      memcpy(&last_t, &t, sizeof(struct timeval));
+    // with nothing left to send, sleep until the port state changes or a
+    // timer or the report is due, and continue stepping from then on. an
+    // update deferred by a bus writer which was behind is retried on the
+    // next step instead
+    if (port_tickless && !deferred && (!backlog || mouse_emulation==MOUSE_TYPE_MSX)) {
+      if (port_idle_wait(written, seq_next_deadline(t_report))) input_wakeups++;
+      t=timing_now_ns();
+      if (t > t_next) {
+        t_next=t;
+        t_step=0;
+      }
     }
-    mcp_update_port_state(port1_pins, port2_pins);
   } while (1);
 }
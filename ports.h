@@ -27,6 +27,56 @@
 #ifndef _PORTS_H_
 #define _PORTS_H_
 
+// port pin states hold the level of DB9 pin n in bit n-1
+#define DB9_PINS		9
+#define DB9_PIN(n)		(1<<((n)-1))
+#define DB9_PIN_LEVEL(n, level)	(((level)&1)<<((n)-1))
+#define DB9_PIN_MASK		0x01ff
+
+// idle levels: pins 1-4, 6, 7 and 9 high
+#define DB9_PINS_IDLE		0x016f
+
+// above the pins the port state holds the buttons of the pad which are
+// held down, for pads with more buttons than the port has pins, and the
+// state of the protocol the pad talks to the host
+#define PORT_BUTTON(n)		(1u<<(16+(n)))
+#define PORT_BUTTON_MASK	0x00ff0000u
+#define PORT_PAD_STATE_MASK	0xf0000000u
+
+// pad buttons by their place on a modern gamepad, in the order of the
+// sequencer buttons
+#define PORT_BUTTON_NORTH	0
+#define PORT_BUTTON_EAST	1
+#define PORT_BUTTON_SOUTH	2
+#define PORT_BUTTON_WEST	3
+#define PORT_BUTTON_TL		4
+#define PORT_BUTTON_TR		5
+#define PORT_BUTTON_START	6
+#define PORT_BUTTON_SELECT	7
+#define PORT_BUTTONS		8
+
+// the face buttons, all of which press fire on a plain joystick
+#define PORT_BUTTONS_FACE	(PORT_BUTTON(PORT_BUTTON_NORTH)|PORT_BUTTON(PORT_BUTTON_EAST)|PORT_BUTTON(PORT_BUTTON_SOUTH)|PORT_BUTTON(PORT_BUTTON_WEST))
+
+// directions held, by the pin 1-4 they are on, for pads which put other
+// things on those pins at times
+#define PORT_DIRECTION(n)	(1u<<(23+(n)))
+
+// pads a port can emulate
+#define PORT_PAD_JOYSTICK	0
+#define PORT_PAD_CD32		1
+#define PORT_PAD_SEGA3		2
+#define PORT_PAD_SEGA6		3
+
+// set while a CD32 pad is shifting out its buttons, with pin 6 driven by
+// the host as the clock
+#define PORT_CD32_SHIFTING	(1u<<28)
+
+// the step of a Sega pad in its select cycle. even steps are select high
+// and odd ones low, and a 6-button pad goes through eight of them
+#define PORT_SEGA_PHASE(n)	((uint32_t)(n)<<28)
+#define PORT_SEGA_PHASE_MASK	0x70000000u
+
 // constans for joystick axes
 #define PORT_AXIS_HORIZONTAL	0
 #define PORT_AXIS_VERTICAL	1
@@ -38,19 +88,72 @@
 #define PORT_AXIS_STATE_LEFT	-1
 #define PORT_AXIS_STATE_RIGHT	1
 
-// bits to rotate per move unit and minimum microseconds to hold a bit
+// bits to rotate per move unit, default encoder steps per second, the
+// default rate the encoders may speed up to and the default time in ms
+// in which queued movement should be sent
 #define ENCODER_BITS_PER_UNIT   7
-#define ENCODER_MIN_US_PER_BIT  2
+#define ENCODER_STEP_RATE	4000
+#define ENCODER_MAX_STEP_RATE	8000
+#define ENCODER_DRAIN_MS	50
+
+// queued mouse movement is kept in fixed point with 8 fractional bits
+#define MOUSE_UNIT		256
+
+// policies for bounding the queued mouse movement: discard the movement
+// over the limit, compress it, or scale both axes down to the limit
+#define MOUSE_LAG_OFF		0
+#define MOUSE_LAG_CLAMP		1
+#define MOUSE_LAG_COMPRESS	2
+#define MOUSE_LAG_RESCALE	3
 
 // mouse emulation type
 #define MOUSE_TYPE_AMIGA	0
 #define MOUSE_TYPE_ATARI_ST	1
+#define MOUSE_TYPE_MSX		2
+
+// marks a frame of changes made by the mouse, whichever port it's on
+#define PORT_FRAME_MOUSE	-1
+
+// the changes made by one input frame, the events a device sends up to a
+// SYN_REPORT. they are committed to the port state together, so the port
+// I/O thread never sees half of a frame
+struct port_frame {
+  int port;
+  uint32_t mask, value;
+  int dx, dy;
+};
+
+void port_frame_begin(struct port_frame *f, int port);
+int port_frame_commit(struct port_frame *f);
+void joystick_frame_axis(struct port_frame *f, int axis, int state);
+void joystick_frame_fire(struct port_frame *f, int state);
+void joystick_frame_button(struct port_frame *f, int button, int state);
+void joystick_frame_release(struct port_frame *f);
+void mouse_frame_move(struct port_frame *f, int axis, int distance);
+void mouse_frame_lmb(struct port_frame *f, int state);
+void mouse_frame_rmb(struct port_frame *f, int state);
 
 void joystick_set_axis(int port, int axis, int state);
 void joystick_set_fire(int port, int state);
+void joystick_release(int port);
 
+void port_set_count(int ports);
+int port_parse_pad(const char *name);
+void port_set_pad(int port, int pad);
+int port_get_pad(int port);
+void port_set_pins(int port, uint32_t mask, uint32_t value);
+uint32_t port_get_state(int port);
 void mouse_set_port(int port);
 void mouse_set_emulation(int type);
+void mouse_set_step_rate(int rate, int max_rate);
+void mouse_set_drain_time(int ms);
+int mouse_parse_lag_policy(const char *spec, int *limit, int *limit_in_ms);
+void mouse_set_lag_policy(int policy, int limit, int limit_in_ms);
+
+int mouse_take_movement(int *x, int *y, int limit);
+void mouse_queue_units(int x, int y);
+int mouse_backlog(void);
+int port_update_now(void);
 
 void mouse_rotate_x_encoder(int8_t bits);
 void mouse_rotate_y_encoder(int8_t bits);
@@ -59,6 +162,11 @@ void mouse_move(int axis, int distance);
 void mouse_set_lmb(int state);
 void mouse_set_rmb(int state);
 
+int port_set_tickless(int enabled);
+void port_wake(void);
+void port_mark_input(uint64_t t);
+void port_wait_ready(void);
+
 void *port_io_thread(void *params);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,357 @@
+/*
+ * joyemu 
+ *
+ * Controller profiles and the event dispatch tables compiled from them.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <libevdev/libevdev.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "logging.h"
+#include "profile.h"
+#include "sequencer.h"
+
+// bindings shared by the built-in gamepad profiles. every dpad and button
+// code known to be sent by gamepads is bound, so the profiles only differ
+// in what they are matched by. the south button is fire, and the others
+// are bound to their place on the pad for pads with more buttons
+#define PROFILE_GAMEPAD_BINDINGS \
+  { EV_ABS, ABS_HAT0X, PROFILE_ACTION_AXIS_X, -1 }, \
+  { EV_ABS, ABS_HAT0Y, PROFILE_ACTION_AXIS_Y, -1 }, \
+  { EV_KEY, BTN_DPAD_UP, PROFILE_ACTION_UP, -1 }, \
+  { EV_KEY, BTN_DPAD_DOWN, PROFILE_ACTION_DOWN, -1 }, \
+  { EV_KEY, BTN_DPAD_LEFT, PROFILE_ACTION_LEFT, -1 }, \
+  { EV_KEY, BTN_DPAD_RIGHT, PROFILE_ACTION_RIGHT, -1 }, \
+  { EV_KEY, BTN_SIXAXIS_UP, PROFILE_ACTION_UP, -1 }, \
+  { EV_KEY, BTN_SIXAXIS_DOWN, PROFILE_ACTION_DOWN, -1 }, \
+  { EV_KEY, BTN_SIXAXIS_LEFT, PROFILE_ACTION_LEFT, -1 }, \
+  { EV_KEY, BTN_SIXAXIS_RIGHT, PROFILE_ACTION_RIGHT, -1 }, \
+  { EV_KEY, BTN_NORTH, PROFILE_ACTION_NORTH, SEQ_BUTTON_NORTH }, \
+  { EV_KEY, BTN_EAST, PROFILE_ACTION_EAST, SEQ_BUTTON_EAST }, \
+  { EV_KEY, BTN_SOUTH, PROFILE_ACTION_FIRE, SEQ_BUTTON_SOUTH }, \
+  { EV_KEY, BTN_WEST, PROFILE_ACTION_WEST, SEQ_BUTTON_WEST }, \
+  { EV_KEY, BTN_SIXAXIS_TRIANGLE, PROFILE_ACTION_NORTH, SEQ_BUTTON_NORTH }, \
+  { EV_KEY, BTN_SIXAXIS_CIRCLE, PROFILE_ACTION_EAST, SEQ_BUTTON_EAST }, \
+  { EV_KEY, BTN_SIXAXIS_CROSS, PROFILE_ACTION_FIRE, SEQ_BUTTON_SOUTH }, \
+  { EV_KEY, BTN_SIXAXIS_SQUARE, PROFILE_ACTION_WEST, SEQ_BUTTON_WEST }, \
+  { EV_KEY, BTN_TL, PROFILE_ACTION_TL, SEQ_BUTTON_TL }, \
+  { EV_KEY, BTN_TR, PROFILE_ACTION_TR, SEQ_BUTTON_TR }, \
+  { EV_KEY, BTN_SIXAXIS_L1, PROFILE_ACTION_TL, SEQ_BUTTON_TL }, \
+  { EV_KEY, BTN_SIXAXIS_R1, PROFILE_ACTION_TR, SEQ_BUTTON_TR }, \
+  { EV_KEY, BTN_START, PROFILE_ACTION_START, -1 }, \
+  { EV_KEY, BTN_SELECT, PROFILE_ACTION_SELECT, -1 }, \
+  { EV_KEY, BTN_SIXAXIS_START, PROFILE_ACTION_START, -1 }, \
+  { EV_KEY, BTN_SIXAXIS_SELECT, PROFILE_ACTION_SELECT, -1 }
+#define PROFILE_GAMEPAD_BINDING_TOTAL	26
+
+// built-in profiles matched by capabilities, in the order they are tried.
+// anything with relative axes and two buttons is a mouse, and a gamepad
+// has a hat, dpad buttons or the sixaxis dpad codes
+const struct profile profile_builtin[]={
+  { "mouse", INPUT_ROLE_MOUSE, 0, 0,
+    3, { { EV_REL, REL_X }, { EV_KEY, BTN_LEFT }, { EV_KEY, BTN_RIGHT } },
+    4, { { EV_REL, REL_X, PROFILE_ACTION_MOUSE_X, -1 }, { EV_REL, REL_Y, PROFILE_ACTION_MOUSE_Y, -1 },
+         { EV_KEY, BTN_LEFT, PROFILE_ACTION_LMB, -1 }, { EV_KEY, BTN_RIGHT, PROFILE_ACTION_RMB, -1 } } },
+  { "xbox", INPUT_ROLE_JOYSTICK, 0, 0,
+    2, { { EV_ABS, ABS_HAT0X }, { EV_ABS, ABS_HAT0Y } },
+    PROFILE_GAMEPAD_BINDING_TOTAL, { PROFILE_GAMEPAD_BINDINGS } },
+  { "dpad", INPUT_ROLE_JOYSTICK, 0, 0,
+    4, { { EV_KEY, BTN_DPAD_UP }, { EV_KEY, BTN_DPAD_RIGHT }, { EV_KEY, BTN_DPAD_DOWN }, { EV_KEY, BTN_DPAD_LEFT } },
+    PROFILE_GAMEPAD_BINDING_TOTAL, { PROFILE_GAMEPAD_BINDINGS } },
+  { "sixaxis", INPUT_ROLE_JOYSTICK, 0, 0,
+    4, { { EV_KEY, BTN_SIXAXIS_UP }, { EV_KEY, BTN_SIXAXIS_RIGHT }, { EV_KEY, BTN_SIXAXIS_DOWN }, { EV_KEY, BTN_SIXAXIS_LEFT } },
+    PROFILE_GAMEPAD_BINDING_TOTAL, { PROFILE_GAMEPAD_BINDINGS } }
+};
+#define PROFILE_BUILTIN_TOTAL	(sizeof(profile_builtin)/sizeof(struct profile))
+
+// names of the actions in profile files
+const char *profile_action_name[PROFILE_ACTIONS]={
+  "none", "up", "down", "left", "right", "axis-x", "axis-y", "fire", "mouse-x", "mouse-y", "lmb", "rmb",
+  "north", "east", "west", "tl", "tr", "start", "select"
+};
+
+// dispatch table layout: keys, absolute axes and relative axes
+const uint16_t profile_type_base[EV_CNT]={
+  [EV_KEY]=0, [EV_ABS]=PROFILE_KEY_CODES, [EV_REL]=PROFILE_KEY_CODES+PROFILE_ABS_CODES
+};
+const uint16_t profile_type_codes[EV_CNT]={
+  [EV_KEY]=PROFILE_KEY_CODES, [EV_ABS]=PROFILE_ABS_CODES, [EV_REL]=PROFILE_REL_CODES
+};
+
+// profiles loaded from a file, tried before the built-in ones
+struct profile profiles[PROFILE_MAX_PROFILES];
+int profile_total=0;
+
+
+// parse an event code, either by its name such as BTN_SOUTH or ABS_HAT0X,
+// or as key:n, abs:n or rel:n. returns -1 if it isn't a known code
+static int profile_parse_code(const char *name, struct profile_code *c) {
+  char type[8];
+  int code;
+
+  if (sscanf(name, "%7[a-z]:%d", type, &code)==2) {
+    if (!strcmp(type, "key")) c->type=EV_KEY;
+    else if (!strcmp(type, "abs")) c->type=EV_ABS;
+    else if (!strcmp(type, "rel")) c->type=EV_REL;
+    else return -1;
+  } else {
+    if (!strncmp(name, "KEY_", 4) || !strncmp(name, "BTN_", 4)) c->type=EV_KEY;
+    else if (!strncmp(name, "ABS_", 4)) c->type=EV_ABS;
+    else if (!strncmp(name, "REL_", 4)) c->type=EV_REL;
+    else return -1;
+    code=libevdev_event_code_from_name(c->type, name);
+  }
+  if (code < 0 || code >= profile_type_codes[c->type]) return -1;
+  c->code=code;
+  return 0;
+}
+
+
+// return the index of an action name or -1
+static int profile_parse_action(const char *name) {
+  int i;
+  for(i=0;i<PROFILE_ACTIONS;i++) {
+    if (!strcmp(profile_action_name[i], name)) return i;
+  }
+  return -1;
+}
+
+
+// load profiles from a file. a profile starts with a line "profile <name>
+// <joystick|mouse> [<vendor>:<product>]" with the ids in hexadecimal, and
+// is followed by lines "require <code>" for the codes a device needs to
+// match without ids and "bind <code> <action> [<button>]" for each event
+// handled, where the button can be given autofire or a macro
+int profile_load(const char *path) {
+  char line[256], name[PROFILE_NAME_LENGTH], role[16], code_name[64], action_name[16], button_name[16];
+  struct profile *p=NULL;
+  struct profile_code c;
+  unsigned int vendor, product;
+  int lineno=0, n, action, button;
+  FILE *f=fopen(path, "r");
+
+  if (!f) {
+    debug_log(LOGLEVEL_ERROR, "Failed to open profiles %s, errno %d", path, errno);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    line[strcspn(line, "#\r\n")]=0;
+    if (strspn(line, " \t")==strlen(line)) continue;
+
+    if ((n=sscanf(line, " profile %31s %15s %x:%x", name, role, &vendor, &product)) >= 2) {
+      if ((strcmp(role, "joystick") && strcmp(role, "mouse")) || n==3 || profile_total==PROFILE_MAX_PROFILES) break;
+      p=&profiles[profile_total++];
+      memset(p, 0, sizeof(struct profile));
+      snprintf(p->name, PROFILE_NAME_LENGTH, "%s", name);
+      p->role=strcmp(role, "mouse") ? INPUT_ROLE_JOYSTICK : INPUT_ROLE_MOUSE;
+      if (n==4) {
+        p->vendor=vendor;
+        p->product=product;
+      }
+      continue;
+    }
+
+    if (p && sscanf(line, " require %63s", code_name)==1) {
+      if (profile_parse_code(code_name, &c) || p->required_total==PROFILE_MAX_REQUIRED) break;
+      p->required[p->required_total++]=c;
+      continue;
+    }
+
+    button_name[0]=0;
+    if (p && sscanf(line, " bind %63s %15s %15s", code_name, action_name, button_name) >= 2) {
+      button=button_name[0] ? seq_parse_button(button_name, strlen(button_name)) : -1;
+      if (profile_parse_code(code_name, &c) || (action=profile_parse_action(action_name)) < 0 ||
+          (button_name[0] && button < 0) || p->binding_total==PROFILE_MAX_BINDINGS) break;
+      p->binding[p->binding_total].type=c.type;
+      p->binding[p->binding_total].code=c.code;
+      p->binding[p->binding_total].action=action;
+      p->binding[p->binding_total].seq_button=button;
+      p->binding_total++;
+      continue;
+    }
+    break;
+  }
+  if (!feof(f)) {
+    debug_log(LOGLEVEL_ERROR, "%s:%d: expected \"profile <name> <joystick|mouse> [<vendor>:<product>]\", \"require <code>\" or \"bind <code> <action> [<button>]\"",
+      path, lineno);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  debug_log(LOGLEVEL_VERBOSE, "Loaded %d profiles from %s", profile_total, path);
+  return 0;
+}
+
+
+// return nonzero if a loaded profile could be used for a device with the
+// given ids, either because it's keyed by them or because it's matched by
+// capabilities, so a device once found to be of no use has to be checked
+// again
+int profile_may_match(uint16_t vendor, uint16_t product) {
+  int i;
+  for(i=0;i<profile_total;i++) {
+    if (!profiles[i].vendor && !profiles[i].product) return 1;
+    if (profiles[i].vendor==vendor && profiles[i].product==product) return 1;
+  }
+  return 0;
+}
+
+
+// return nonzero if a device has the codes a profile needs: all of the
+// required ones and at least one fire or other face button if the profile
+// has any
+static int profile_matches_capabilities(const struct profile *p, struct libevdev *dev) {
+  int i, fire=0, has_fire=0;
+
+  if (p->vendor || p->product) return 0;
+  for(i=0;i<p->required_total;i++) {
+    if (!libevdev_has_event_code(dev, p->required[i].type, p->required[i].code)) return 0;
+  }
+  for(i=0;i<p->binding_total;i++) {
+    if (p->binding[i].action!=PROFILE_ACTION_FIRE && p->binding[i].action!=PROFILE_ACTION_NORTH &&
+        p->binding[i].action!=PROFILE_ACTION_EAST && p->binding[i].action!=PROFILE_ACTION_WEST) continue;
+    fire=1;
+    if (libevdev_has_event_code(dev, p->binding[i].type, p->binding[i].code)) has_fire=1;
+  }
+  return !fire || has_fire;
+}
+
+
+// find the loaded profile for the vendor and product ids of a device, or
+// NULL if there's none
+const struct profile *profile_match_ids(uint16_t vendor, uint16_t product) {
+  int i;
+  for(i=0;i<profile_total;i++) {
+    if ((profiles[i].vendor || profiles[i].product) && profiles[i].vendor==vendor && profiles[i].product==product) return &profiles[i];
+  }
+  return NULL;
+}
+
+
+// find the profile for a device: a loaded profile for its ids, or else the
+// first loaded or built-in profile it has the capabilities for. returns
+// NULL if the device is of no use
+const struct profile *profile_match(struct libevdev *dev) {
+  const struct profile *p=profile_match_ids(libevdev_get_id_vendor(dev), libevdev_get_id_product(dev));
+  int i;
+
+  if (p) return p;
+  for(i=0;i<profile_total;i++) {
+    if (profile_matches_capabilities(&profiles[i], dev)) return &profiles[i];
+  }
+  for(i=0;i<PROFILE_BUILTIN_TOTAL;i++) {
+    if (profile_matches_capabilities(&profile_builtin[i], dev)) return &profile_builtin[i];
+  }
+  return NULL;
+}
+
+
+// return the first built-in profile for a role, for input without a device
+const struct profile *profile_default(int role) {
+  int i;
+  for(i=0;i<PROFILE_BUILTIN_TOTAL;i++) {
+    if (profile_builtin[i].role==role) return &profile_builtin[i];
+  }
+  return NULL;
+}
+
+
+// find a profile by its name, searching the loaded profiles before the
+// built-in ones as matching does. returns NULL if there's none
+const struct profile *profile_find(const char *name) {
+  int i;
+  for(i=0;i<profile_total;i++) {
+    if (!strcmp(profiles[i].name, name)) return &profiles[i];
+  }
+  for(i=0;i<PROFILE_BUILTIN_TOTAL;i++) {
+    if (!strcmp(profile_builtin[i].name, name)) return &profile_builtin[i];
+  }
+  return NULL;
+}
+
+
+// number a profile by its place among the loaded and built-in profiles,
+// which stays the same as long as the same profiles are loaded
+int profile_id(const struct profile *p) {
+  if (p >= profiles && p < profiles+profile_total) return p-profiles;
+  return profile_total+(p-profile_builtin);
+}
+
+
+// return the profile numbered by profile_id(), or NULL if there's none
+const struct profile *profile_by_id(int id) {
+  if (id < 0) return NULL;
+  if (id < profile_total) return &profiles[id];
+  if (id-profile_total < PROFILE_BUILTIN_TOTAL) return &profile_builtin[id-profile_total];
+  return NULL;
+}
+
+
+// FNV-1a hash of the loaded and built-in profiles, which tells whether a
+// profile remembered for a device would still be the one matched
+uint32_t profile_signature(void) {
+  const uint8_t *b;
+  uint32_t h=2166136261u;
+  size_t i;
+
+  for(b=(const uint8_t *)profiles, i=0;i<profile_total*sizeof(struct profile);i++) h=(h^b[i])*16777619u;
+  for(b=(const uint8_t *)profile_builtin, i=0;i<sizeof(profile_builtin);i++) h=(h^b[i])*16777619u;
+  return h;
+}
+
+
+// compile a profile into the dispatch table of a device, so that handling
+// an event takes a single lookup. the thresholds of absolute axes are set
+// a quarter of the range either side of the center, which for a hat means
+// any non-zero value. without a device all axes are taken to be hats
+void profile_compile(const struct profile *p, struct libevdev *dev, struct profile_table *t) {
+  const struct profile_binding *b;
+  const struct input_absinfo *abs;
+  int i, span;
+
+  t->profile=p;
+  for(i=0;i<PROFILE_TABLE_SIZE;i++) {
+    t->action[i].action=PROFILE_ACTION_NONE;
+    t->action[i].seq_button=-1;
+  }
+  memset(t->abs_low, 0, sizeof(t->abs_low));
+  memset(t->abs_high, 0, sizeof(t->abs_high));
+  for(i=0;i<p->binding_total;i++) {
+    b=&p->binding[i];
+    t->action[profile_index(b->type, b->code)].action=b->action;
+    t->action[profile_index(b->type, b->code)].seq_button=b->seq_button;
+    if (b->type==EV_ABS && dev && (abs=libevdev_get_abs_info(dev, b->code))) {
+      span=abs->maximum-abs->minimum;
+      t->abs_low[b->code]=abs->minimum+span/2-span/4;
+      t->abs_high[b->code]=abs->minimum+span/2+span/4;
+    }
+  }
+}
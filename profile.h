@@ -0,0 +1,139 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+// roles a device can have. devices of no known role aren't used, and
+// unknown devices have to be matched against the profiles
+#define INPUT_ROLE_UNKNOWN	-1
+#define INPUT_ROLE_NONE		0
+#define INPUT_ROLE_JOYSTICK	1
+#define INPUT_ROLE_MOUSE	2
+
+// actions an event can be bound to
+#define PROFILE_ACTION_NONE	0
+#define PROFILE_ACTION_UP	1
+#define PROFILE_ACTION_DOWN	2
+#define PROFILE_ACTION_LEFT	3
+#define PROFILE_ACTION_RIGHT	4
+#define PROFILE_ACTION_AXIS_X	5
+#define PROFILE_ACTION_AXIS_Y	6
+#define PROFILE_ACTION_FIRE	7
+#define PROFILE_ACTION_MOUSE_X	8
+#define PROFILE_ACTION_MOUSE_Y	9
+#define PROFILE_ACTION_LMB	10
+#define PROFILE_ACTION_RMB	11
+#define PROFILE_ACTION_NORTH	12
+#define PROFILE_ACTION_EAST	13
+#define PROFILE_ACTION_WEST	14
+#define PROFILE_ACTION_TL	15
+#define PROFILE_ACTION_TR	16
+#define PROFILE_ACTION_START	17
+#define PROFILE_ACTION_SELECT	18
+#define PROFILE_ACTIONS		19
+
+// event codes covered by the dispatch tables: keys and buttons, then the
+// absolute and relative axes
+#define PROFILE_KEY_CODES	(KEY_MAX+1)
+#define PROFILE_ABS_CODES	(ABS_MAX+1)
+#define PROFILE_REL_CODES	(REL_MAX+1)
+#define PROFILE_TABLE_SIZE	(PROFILE_KEY_CODES+PROFILE_ABS_CODES+PROFILE_REL_CODES)
+
+// size of the profile database
+#define PROFILE_MAX_PROFILES	32
+#define PROFILE_MAX_BINDINGS	48
+#define PROFILE_MAX_REQUIRED	8
+#define PROFILE_NAME_LENGTH	32
+
+// an event code bound to an action, and optionally to a button which can
+// have autofire or a macro
+struct profile_binding {
+  uint16_t type;
+  uint16_t code;
+  uint8_t action;
+  int8_t seq_button;
+};
+
+// an event code a device must have
+struct profile_code {
+  uint16_t type;
+  uint16_t code;
+};
+
+// a controller profile. profiles with a vendor and product id are used for
+// those devices only, others for any device which has all the required
+// codes and, if the profile has fire buttons, at least one of them
+struct profile {
+  char name[PROFILE_NAME_LENGTH];
+  int role;
+  uint16_t vendor, product;
+  int required_total;
+  struct profile_code required[PROFILE_MAX_REQUIRED];
+  int binding_total;
+  struct profile_binding binding[PROFILE_MAX_BINDINGS];
+};
+
+// an entry of a compiled dispatch table
+struct profile_action {
+  uint8_t action;
+  int8_t seq_button;
+};
+
+// a compiled dispatch table for one device. absolute axes bound to the
+// joystick directions are left or up below the low threshold and right or
+// down above the high one
+struct profile_table {
+  const struct profile *profile;
+  struct profile_action action[PROFILE_TABLE_SIZE];
+  int32_t abs_low[PROFILE_ABS_CODES], abs_high[PROFILE_ABS_CODES];
+};
+
+struct libevdev;
+
+// start of each event type in the dispatch tables and the number of codes
+// of the type which are covered
+extern const uint16_t profile_type_base[EV_CNT], profile_type_codes[EV_CNT];
+
+// return the dispatch table index of an event, or -1 if the event type
+// isn't covered
+static inline int profile_index(unsigned int type, unsigned int code) {
+  if (type >= EV_CNT || code >= profile_type_codes[type]) return -1;
+  return profile_type_base[type]+code;
+}
+
+int profile_load(const char *path);
+int profile_may_match(uint16_t vendor, uint16_t product);
+const struct profile *profile_match_ids(uint16_t vendor, uint16_t product);
+const struct profile *profile_match(struct libevdev *dev);
+const struct profile *profile_default(int role);
+const struct profile *profile_find(const char *name);
+int profile_id(const struct profile *p);
+const struct profile *profile_by_id(int id);
+uint32_t profile_signature(void);
+void profile_compile(const struct profile *p, struct libevdev *dev, struct profile_table *t);
+
+#endif
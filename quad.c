@@ -0,0 +1,235 @@
+/*
+ * joyemu 
+ *
+ * Mouse quadrature output verifier
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "defaults.h"
+#include "io.h"
+#include "logging.h"
+#include "pinmap.h"
+#include "ports.h"
+#include "quad.h"
+#include "sim.h"
+#include "timing.h"
+
+// the encoder patterns repeat every 8 bits and have a quadrature state
+// every 2, so a unit of movement moves the encoder by the rotation left
+// over within the period
+#define QUAD_PATTERN_BITS	8
+#define QUAD_STATES		4
+
+// time to wait for the encoders to go quiet after the queue has drained,
+// and the least share of the step rate which counts as keeping up
+#define QUAD_SETTLE_MS		20
+#define QUAD_KEEP_UP		0.9
+
+// a decoder for the two pins of one axis as a host would see them
+struct quad_axis {
+  int e_bit, q_bit;  // GPIO bits of the encoder and quadrature pins
+  int state;  // last quadrature state, -1 before the first write
+  unsigned long forward, backward, lost;
+  uint64_t t_first, t_last;
+};
+
+struct quad_axis quad_axes[2];
+int quad_expander;
+
+// I2C clocks emulated by the simulated expander, 0 for none
+const int quad_bus_clocks[]={ 0, 100000, 400000, 1000000 };
+
+
+// quadrature state of an axis in the GPIO bits written. the states count
+// up in the order the encoder goes through them for positive movement
+static int quad_state(const struct quad_axis *a, uint16_t gpio) {
+  static const int state[4]={ 0, 1, 3, 2 };
+  return state[((gpio >> a->e_bit) & 1) | (((gpio >> a->q_bit) & 1) << 1)];
+}
+
+
+// output observer decoding both axes from every write to the expander of
+// the mouse port. a change of both pins at once can't be told apart from
+// a step either way, so it's counted as lost
+static void quad_observe(int expander, uint16_t gpio, uint64_t t_ns) {
+  struct quad_axis *a;
+  int axis, state;
+
+  if (expander!=quad_expander) return;
+  for(axis=0;axis<2;axis++) {
+    a=&quad_axes[axis];
+    state=quad_state(a, gpio);
+    if (a->state >= 0 && state!=a->state) {
+      switch ((state-a->state)&(QUAD_STATES-1)) {
+        case 1: a->forward++; break;
+        case 3: a->backward++; break;
+        default: a->lost++; break;
+      }
+      if (!a->t_first) a->t_first=t_ns;
+      a->t_last=t_ns;
+    }
+    a->state=state;
+  }
+}
+
+
+// send units of movement on both axes and wait for the encoders to go
+// quiet. returns nonzero if the queue didn't drain in time
+static int quad_send(int units, int rate) {
+  uint64_t t_end=timing_now_ns()+(2ULL*abs(units)*NSEC_PER_SEC/rate)+NSEC_PER_SEC;
+
+  mouse_queue_units(units, units);
+  while (mouse_backlog()) {
+    if (timing_now_ns() > t_end) return -1;
+    usleep(1000);
+  }
+  usleep(QUAD_SETTLE_MS*1000);
+  return 0;
+}
+
+
+// run the movement out and back at one step rate and check what the
+// decoders saw against what was sent. returns the counts per second of
+// the horizontal axis if there were no errors, or 0
+static double quad_run_rate(int units, int rate, int bits_per_unit) {
+  unsigned long expected=(unsigned long)units*abs(bits_per_unit)/(QUAD_PATTERN_BITS/QUAD_STATES);
+  unsigned long out[2], reversed[2], missing[2];
+  double counts_per_sec=0, elapsed;
+  int axis, failed=0;
+
+  mouse_set_step_rate(rate, rate);
+  for(axis=0;axis<2;axis++) {
+    quad_axes[axis].forward=quad_axes[axis].backward=quad_axes[axis].lost=0;
+    quad_axes[axis].t_first=quad_axes[axis].t_last=0;
+  }
+
+  // out in the positive direction and back again, after which steps the
+  // other way have gone in the wrong direction
+  if (quad_send(units, rate)) failed=1;
+  for(axis=0;axis<2;axis++) {
+    out[axis]=bits_per_unit > 0 ? quad_axes[axis].forward : quad_axes[axis].backward;
+    reversed[axis]=bits_per_unit > 0 ? quad_axes[axis].backward : quad_axes[axis].forward;
+  }
+
+  // the rate is measured on the way out, as the way back also spans the
+  // pause in between
+  elapsed=(double)(quad_axes[0].t_last-quad_axes[0].t_first)/NSEC_PER_SEC;
+  if (elapsed > 0) counts_per_sec=(out[0]+reversed[0]-1)/elapsed;
+  if (quad_send(-units, rate)) failed=1;
+  for(axis=0;axis<2;axis++) {
+    struct quad_axis *a=&quad_axes[axis];
+    unsigned long back=(bits_per_unit > 0 ? a->backward : a->forward)-reversed[axis];
+
+    reversed[axis]+=(bits_per_unit > 0 ? a->forward : a->backward)-out[axis];
+    missing[axis]=(out[axis] < expected ? expected-out[axis] : 0)+(back < expected ? expected-back : 0);
+    if (a->lost || reversed[axis] || missing[axis]) failed=1;
+  }
+
+  debug_log(LOGLEVEL_INFO, "%6d steps/s: %.0f counts/s, x %lu lost %lu reversed %lu missing, y %lu lost %lu reversed %lu missing%s",
+    rate, counts_per_sec,
+    quad_axes[0].lost, reversed[0], missing[0], quad_axes[1].lost, reversed[1], missing[1],
+    failed ? " - FAILED" : "");
+  return failed ? 0 : counts_per_sec;
+}
+
+
+// verify the quadrature output of the mouse encoders by decoding the pins
+// as they are written, sweeping the step rate and, on the simulated
+// expander, the I2C clock it emulates. returns nonzero if no rate was
+// error-free
+int quad_run(int mouse_port, int emulation, int units) {
+  int port=mouse_port-1, bits, rate, c, clocks, e_pin, q_pin, failed=0;
+  double counts_per_sec, best;
+  const int mouse_pins[2][2][2]={
+    { { 2, 4 }, { 1, 3 } },  // Amiga: X on pins 2 and 4, Y on pins 1 and 3
+    { { 2, 1 }, { 3, 4 } }   // Atari ST: X on pins 2 and 1, Y on pins 3 and 4
+  };
+
+  if (emulation > MOUSE_TYPE_ATARI_ST) {
+    debug_log(LOGLEVEL_ERROR, "The quadrature verifier needs an Amiga or Atari ST mouse");
+    return -1;
+  }
+
+  // how far a unit of movement turns the encoder patterns in the end, with
+  // the sign telling the direction. units are rounded up so that a run
+  // always ends on a whole quadrature state
+  bits=(QUAD_PATTERN_BITS-ENCODER_BITS_PER_UNIT%QUAD_PATTERN_BITS)%QUAD_PATTERN_BITS;
+  if (bits > QUAD_PATTERN_BITS/2) bits-=QUAD_PATTERN_BITS;
+  if (!bits) {
+    debug_log(LOGLEVEL_ERROR, "Encoder steps of %d bits don't move the quadrature at all", ENCODER_BITS_PER_UNIT);
+    return -1;
+  }
+  c=QUAD_PATTERN_BITS/QUAD_STATES;
+  if ((units*abs(bits))%c) units+=c-(units*abs(bits))%c;
+
+  quad_expander=pinmap_expander[port];
+  for(c=0;c<2;c++) {
+    e_pin=mouse_pins[emulation][c][0];
+    q_pin=mouse_pins[emulation][c][1];
+    quad_axes[c].e_bit=pinmap_gpio_bit(port, e_pin);
+    quad_axes[c].q_bit=pinmap_gpio_bit(port, q_pin);
+    quad_axes[c].state=-1;
+    if (quad_axes[c].e_bit==PINMAP_UNCONNECTED || quad_axes[c].q_bit==PINMAP_UNCONNECTED) {
+      debug_log(LOGLEVEL_ERROR, "Pins %d and %d of port %d have to be wired for the quadrature verifier", e_pin, q_pin, port+1);
+      return -1;
+    }
+  }
+  debug_log(LOGLEVEL_INFO, "Verifying mouse quadrature on port %d, %d units each way per rate, %.2f counts per unit",
+    port+1, units, (double)abs(bits)/(QUAD_PATTERN_BITS/QUAD_STATES));
+  io_set_observer(quad_observe);
+
+  // the bus clock can only be chosen for the simulated expander, with the
+  // other backends the sweep runs on the bus as it is
+  clocks=(io_backend==&io_backend_sim) ? sizeof(quad_bus_clocks)/sizeof(quad_bus_clocks[0]) : 1;
+  for(c=0;c<clocks;c++) {
+    if (io_backend==&io_backend_sim) {
+      sim_set_bus_clock(quad_bus_clocks[c]);
+      if (quad_bus_clocks[c]) debug_log(LOGLEVEL_INFO, "Simulated I2C bus at %d kHz:", quad_bus_clocks[c]/1000);
+      else debug_log(LOGLEVEL_INFO, "Simulated expander without bus delay:");
+    }
+    best=0;
+    for(rate=QUAD_MIN_RATE;rate<=QUAD_MAX_RATE;rate*=2) {
+      counts_per_sec=quad_run_rate(units, rate, bits);
+      if (counts_per_sec > best) best=counts_per_sec;
+
+      // once the encoders can't keep up with the rate any faster ones
+      // only show the same
+      if (!counts_per_sec || counts_per_sec < QUAD_KEEP_UP*rate*abs(bits)/(QUAD_PATTERN_BITS/QUAD_STATES)) break;
+    }
+    if (best) debug_log(LOGLEVEL_INFO, "Highest error-free mouse rate %.0f counts/s", best);
+    else {
+      debug_log(LOGLEVEL_ERROR, "No step rate was free of errors");
+      failed=1;
+    }
+  }
+  io_set_observer(NULL);
+  if (io_backend==&io_backend_sim) sim_set_bus_clock(0);
+  return failed;
+}
@@ -0,0 +1,191 @@
+/*
+ * joyemu 
+ *
+ * Recording of the input event stream to a file and replaying it.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "logging.h"
+#include "profile.h"
+#include "record.h"
+#include "timing.h"
+
+// recording file, its start time on the monotonic clock and the events
+// waiting to be written. only used by the input thread
+int record_fd=-1;
+uint64_t record_t_start=0;
+struct record_event record_buffer[RECORD_BUFFER_EVENTS];
+int record_buffered=0;
+unsigned long record_written=0;
+
+// mapped recording being replayed and the number of events in it
+const struct record_header *replay_map=NULL;
+uint64_t replay_count=0;
+
+
+// create a recording file and write its header. returns -1 on failure
+int record_open(const char *path) {
+  struct record_header h;
+  struct timespec ts;
+
+  record_fd=open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+  if (record_fd < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to create recording %s, errno %d", path, errno);
+    return -1;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  memset(&h, 0, sizeof(struct record_header));
+  h.magic=RECORD_MAGIC;
+  h.version=RECORD_VERSION;
+  h.header_size=sizeof(struct record_header);
+  h.record_size=sizeof(struct record_event);
+  h.t_start=(uint64_t)ts.tv_sec*NSEC_PER_SEC+ts.tv_nsec;
+  h.profiles=profile_signature();
+  if (write(record_fd, &h, sizeof(struct record_header))!=sizeof(struct record_header)) {
+    debug_log(LOGLEVEL_ERROR, "Failed to write recording %s, errno %d", path, errno);
+    close(record_fd);
+    record_fd=-1;
+    return -1;
+  }
+  record_t_start=timing_now_ns();
+  debug_log(LOGLEVEL_INFO, "Recording input events to %s", path);
+  return 0;
+}
+
+
+// add an event read from the device in a slot to the recording
+void record_event(int slot, const struct input_event *ev) {
+  struct record_event *r;
+  uint64_t t=(uint64_t)ev->input_event_sec*NSEC_PER_SEC+(uint64_t)ev->input_event_usec*NSEC_PER_USEC;
+
+  if (record_fd < 0) return;
+  if (record_buffered==RECORD_BUFFER_EVENTS) record_flush();
+  r=&record_buffer[record_buffered++];
+  r->t_ns=t > record_t_start ? t-record_t_start : 0;
+  r->value=ev->value;
+  r->code=ev->code;
+  r->type=ev->type;
+  r->slot=slot;
+}
+
+
+// add a record describing the device attached to a slot, stamped with the
+// time it's written
+void record_device(int slot, int type, uint16_t code, int32_t value) {
+  struct record_event *r;
+  uint64_t t=timing_now_ns();
+
+  if (record_fd < 0) return;
+  if (record_buffered==RECORD_BUFFER_EVENTS) record_flush();
+  r=&record_buffer[record_buffered++];
+  r->t_ns=t > record_t_start ? t-record_t_start : 0;
+  r->value=value;
+  r->code=code;
+  r->type=type;
+  r->slot=slot;
+}
+
+
+// write the buffered events, in one write per batch of events read
+void record_flush(void) {
+  ssize_t len=record_buffered*sizeof(struct record_event);
+
+  if (record_fd < 0 || !record_buffered) return;
+  if (write(record_fd, record_buffer, len)!=len) {
+    debug_log(LOGLEVEL_ERROR, "Failed to write recording, errno %d - recording stopped", errno);
+    close(record_fd);
+    record_fd=-1;
+  }
+  record_written+=record_buffered;
+  record_buffered=0;
+}
+
+
+// map a recording for replay. returns -1 if it can't be read
+int replay_open(const char *path) {
+  struct stat st;
+  void *map;
+  int fd=open(path, O_RDONLY|O_CLOEXEC);
+
+  if (fd < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to open recording %s, errno %d", path, errno);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct record_header)) {
+    debug_log(LOGLEVEL_ERROR, "%s is not a recording", path);
+    close(fd);
+    return -1;
+  }
+  map=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map==MAP_FAILED) {
+    debug_log(LOGLEVEL_ERROR, "Failed to map recording %s, errno %d", path, errno);
+    return -1;
+  }
+  replay_map=map;
+  if (replay_map->magic!=RECORD_MAGIC || replay_map->version!=RECORD_VERSION ||
+      replay_map->record_size!=sizeof(struct record_event) || replay_map->header_size > st.st_size) {
+    debug_log(LOGLEVEL_ERROR, "%s is not a recording of this version", path);
+    munmap(map, st.st_size);
+    replay_map=NULL;
+    return -1;
+  }
+  replay_count=(st.st_size-replay_map->header_size)/replay_map->record_size;
+  if (!replay_same_profiles()) {
+    debug_log(LOGLEVEL_INFO, "%s was recorded with other profiles, its devices are matched by their ids instead", path);
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Replaying %llu events from %s", (unsigned long long)replay_count, path);
+  return 0;
+}
+
+
+// return the nth event of the recording being replayed, or NULL past the end
+const struct record_event *replay_event(uint64_t n) {
+  if (!replay_map || n >= replay_count) return NULL;
+  return (const struct record_event *)((const uint8_t *)replay_map+replay_map->header_size)+n;
+}
+
+
+// return the number of events in the recording being replayed
+uint64_t replay_events(void) {
+  return replay_count;
+}
+
+
+// return nonzero if the recording being replayed was made with the same
+// profiles as are loaded, so that the profile ids in it can be used
+int replay_same_profiles(void) {
+  return replay_map && replay_map->profiles==profile_signature();
+}
@@ -0,0 +1,84 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+// identifies a recording and the version of its layout
+#define RECORD_MAGIC		0x524a594a
+#define RECORD_VERSION		2
+
+// slot number of mouse events, joystick events have their port index
+#define RECORD_SLOT_MOUSE	0xff
+
+// record types past the event types, describing the device attached to a
+// slot from that point of the recording on. a device record has the id of
+// the profile the device matched in the code and its vendor and product ids
+// in the upper and lower half of the value. it's followed by the thresholds
+// of the absolute axes the profile binds, with the axis in the code
+#define RECORD_TYPE_DEVICE	0xf0
+#define RECORD_TYPE_ABS_LOW	0xf1
+#define RECORD_TYPE_ABS_HIGH	0xf2
+
+// events buffered before they are written to the file
+#define RECORD_BUFFER_EVENTS	256
+
+// a recording is this header followed by fixed size event records up to
+// the end of the file, so it can be appended to while it's being read and
+// a reader can mmap it and index the events directly
+struct record_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint16_t record_size;
+  uint16_t pad[3];
+  uint64_t t_start;  // CLOCK_REALTIME time the recording was started, in ns
+  uint32_t profiles;  // profile_signature() of the profiles the devices matched
+  uint32_t pad2;
+  uint64_t reserved[4];
+};
+
+// one input event. the time is the kernel timestamp of the event on the
+// monotonic clock, relative to the start of the recording
+struct record_event {
+  uint64_t t_ns;
+  int32_t value;
+  uint16_t code;
+  uint8_t type;
+  uint8_t slot;
+};
+
+int record_open(const char *path);
+void record_event(int slot, const struct input_event *ev);
+void record_device(int slot, int type, uint16_t code, int32_t value);
+void record_flush(void);
+
+int replay_open(const char *path);
+const struct record_event *replay_event(uint64_t n);
+uint64_t replay_events(void);
+int replay_same_profiles(void);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * joyemu 
+ *
+ * Real-time scheduling, memory locking and CPU pinning for the time critical threads.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "logging.h"
+#include "rt.h"
+#include "stats.h"
+#include "timing.h"
+
+// a thread function and its argument, passed through the start trampoline
+struct rt_start {
+  void *(*fn)(void *);
+  void *arg;
+};
+
+// SCHED_FIFO priority of each thread, 0 if real-time mode is off
+int rt_priority[RT_THREADS]={0, 0};
+
+// CPU each thread is pinned to, -1 for any
+int rt_cpu[RT_THREADS]={-1, -1};
+
+const char *rt_thread_name[RT_THREADS]={"port I/O", "input"};
+
+
+// enable real-time mode with the given SCHED_FIFO priorities
+void rt_set_priorities(int port_priority, int input_priority) {
+  rt_priority[RT_THREAD_PORT]=port_priority;
+  rt_priority[RT_THREAD_INPUT]=input_priority;
+}
+
+
+// pin the port I/O and input threads to CPUs, -1 to leave a thread free
+void rt_set_cpus(int port_cpu, int input_cpu) {
+  rt_cpu[RT_THREAD_PORT]=port_cpu;
+  rt_cpu[RT_THREAD_INPUT]=input_cpu;
+}
+
+
+// return nonzero if real-time mode is on
+int rt_enabled(void) {
+  return rt_priority[RT_THREAD_PORT] > 0;
+}
+
+
+// lock all current and future memory of the process, so that a page fault
+// can't stall the real-time threads. returns -1 on failure
+int rt_setup(void) {
+  if (!rt_enabled()) return 0;
+  if (mlockall(MCL_CURRENT|MCL_FUTURE) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to lock memory, errno %d", errno);
+    return -1;
+  }
+  debug_log(LOGLEVEL_VERBOSE, "Locked process memory, port I/O thread priority %d, input thread priority %d",
+    rt_priority[RT_THREAD_PORT], rt_priority[RT_THREAD_INPUT]);
+  return 0;
+}
+
+
+// touch the top of the stack so it's faulted in and locked before the
+// thread does any time critical work
+static void rt_prefault_stack(void) {
+  volatile uint8_t stack[RT_STACK_PREFAULT];
+  memset((uint8_t *)stack, 0, RT_STACK_PREFAULT);
+}
+
+
+// start a thread with its stack prefaulted
+static void *rt_thread_start(void *params) {
+  struct rt_start start=*(struct rt_start *)params;
+
+  free(params);
+  rt_prefault_stack();
+  return start.fn(start.arg);
+}
+
+
+// create a thread with the scheduling policy, priority and CPU configured
+// for its role. without real-time mode or pinning this is pthread_create()
+int rt_create_thread(pthread_t *thread, int role, void *(*fn)(void *), void *arg) {
+  struct sched_param param;
+  struct rt_start *start;
+  pthread_attr_t attr;
+  cpu_set_t cpus;
+  int rc;
+
+  if (!rt_priority[role] && rt_cpu[role] < 0) return pthread_create(thread, NULL, fn, arg);
+
+  pthread_attr_init(&attr);
+  if (rt_priority[role]) {
+    memset(&param, 0, sizeof(struct sched_param));
+    param.sched_priority=rt_priority[role];
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+  }
+  if (rt_cpu[role] >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(rt_cpu[role], &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+  }
+
+  start=malloc(sizeof(struct rt_start));
+  if (!start) {
+    pthread_attr_destroy(&attr);
+    return ENOMEM;
+  }
+  start->fn=fn;
+  start->arg=arg;
+  rc=pthread_create(thread, &attr, rt_thread_start, start);
+  pthread_attr_destroy(&attr);
+  if (rc) {
+    free(start);
+    debug_log(LOGLEVEL_ERROR, "Failed to create %s thread with priority %d on CPU %d, error %d - real-time scheduling needs root or CAP_SYS_NICE",
+      rt_thread_name[role], rt_priority[role], rt_cpu[role], rc);
+  }
+  return rc;
+}
+
+
+// wake up at fixed absolute deadlines like the port I/O thread does and
+// record how late each wakeup is
+static void *rt_jitter_thread(void *params) {
+  struct stats_hist *jitter=params;
+  uint64_t t, t_next=timing_now_ns();
+  int i;
+
+  for(i=0;i<RT_JITTER_SAMPLES;i++) {
+    t_next+=RT_JITTER_INTERVAL_US*NSEC_PER_USEC;
+    timing_sleep_until_ns(t_next);
+    t=timing_now_ns();
+    stats_hist_add(jitter, t > t_next ? t-t_next : 0);
+  }
+  return NULL;
+}
+
+
+// measure the scheduling jitter of a thread running with the settings of
+// the port I/O thread, before the emulation starts
+void rt_measure_jitter(void) {
+  static struct stats_hist jitter;
+  pthread_t thread;
+
+  stats_hist_reset(&jitter);
+  if (rt_create_thread(&thread, RT_THREAD_PORT, rt_jitter_thread, &jitter)) return;
+  pthread_join(thread, NULL);
+  stats_hist_log(LOGLEVEL_INFO, "Scheduling jitter at startup", &jitter);
+}
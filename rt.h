@@ -0,0 +1,56 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RT_H_
+#define _RT_H_
+
+// threads which can be given real-time scheduling and a CPU of their own
+#define RT_THREAD_PORT		0
+#define RT_THREAD_INPUT		1
+#define RT_THREADS		2
+
+// default SCHED_FIFO priorities for the port I/O and input threads
+#define RT_PORT_PRIORITY	80
+#define RT_INPUT_PRIORITY	70
+
+// stack size of the real-time threads, and how much of it is touched
+// before the thread starts so that it's resident and locked
+#define RT_STACK_SIZE		(256*1024)
+#define RT_STACK_PREFAULT	(64*1024)
+
+// wakeups and the interval between them for measuring the scheduling
+// jitter at startup
+#define RT_JITTER_SAMPLES	1000
+#define RT_JITTER_INTERVAL_US	1000
+
+void rt_set_priorities(int port_priority, int input_priority);
+void rt_set_cpus(int port_cpu, int input_cpu);
+int rt_enabled(void);
+int rt_setup(void);
+int rt_create_thread(pthread_t *thread, int role, void *(*fn)(void *), void *arg);
+void rt_measure_jitter(void);
+
+#endif
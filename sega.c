@@ -0,0 +1,135 @@
+/*
+ * joyemu 
+ *
+ * Sega Mega Drive pad select responder
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "defaults.h"
+#include "io.h"
+#include "logging.h"
+#include "metrics.h"
+#include "pinmap.h"
+#include "ports.h"
+#include "sega.h"
+#include "stats.h"
+#include "timing.h"
+
+// a port emulating a Sega pad and where it is in its select cycle, owned
+// by the input thread of its expander
+struct sega_pad {
+  int port, six;
+  int phase, level;
+  uint64_t last_edge;
+  struct stats_hist latency;
+  char latency_name[48];
+  uint64_t report_time;
+  unsigned long missed, late;
+  struct metrics_hist *metric_latency;
+  int64_t *metric_missed, *metric_late;
+};
+
+struct sega_pad sega_pads[MAX_PORTS];
+
+
+// follow an edge of select to the next step of the cycle and put the pins
+// of that step out right away. an edge to the level select already had
+// means the one in between was missed, and a 6-button pad counts it all
+// the same so that it stays in step with the host
+static void sega_select(void *arg, int level, uint64_t t_edge) {
+  struct sega_pad *p=arg;
+  uint64_t t, dt;
+
+  if (level==p->level) {
+    p->missed++;
+    metrics_add(p->metric_missed, 1);
+    p->phase++;
+  }
+  if (!p->six || t_edge-p->last_edge > SEGA_TIMEOUT_US*NSEC_PER_USEC) {
+    p->phase=!level;
+  } else {
+    p->phase=(p->phase+1)&7;
+  }
+  p->level=level;
+  p->last_edge=t_edge;
+  port_set_pins(p->port, PORT_SEGA_PHASE_MASK, PORT_SEGA_PHASE(p->phase));
+  port_update_now();
+
+  t=timing_now_ns();
+  dt=t > t_edge ? t-t_edge : 0;
+  stats_hist_add(&p->latency, dt);
+  metrics_hist_add(p->metric_latency, dt);
+  if (dt > SEGA_RESPONSE_WINDOW_NS) {
+    p->late++;
+    metrics_add(p->metric_late, 1);
+  }
+  if (t >= p->report_time) {
+    stats_hist_log(LOGLEVEL_VERBOSE, p->latency_name, &p->latency);
+    debug_log(LOGLEVEL_VERBOSE, "Sega pad on port %d: %lu missed and %lu late select edges", p->port+1, p->missed, p->late);
+    stats_hist_reset(&p->latency);
+    p->report_time+=STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  }
+}
+
+
+// follow the select line of a Sega pad on a port once the expander input
+// threads are started. pin 7 has to be wired to a GPIO pin in the pin map,
+// and it's made an input. returns nonzero if select can't be read
+int sega_start(int port) {
+  struct sega_pad *p=&sega_pads[port-1];
+  int bit=pinmap_gpio_bit(port-1, SEGA_SELECT_PIN);
+  char labels[32];
+
+  if (bit==PINMAP_UNCONNECTED) {
+    debug_log(LOGLEVEL_ERROR, "The Sega pad needs pin %d of port %d wired in the pin map", SEGA_SELECT_PIN, port);
+    return -1;
+  }
+  if (!io_backend->fast_inputs) {
+    debug_log(LOGLEVEL_ERROR, "The Sega pad can't follow the select line through the %s backend - use '-o gpio'", io_backend->name);
+    return -1;
+  }
+  p->port=port-1;
+  p->six=(port_get_pad(port-1)==PORT_PAD_SEGA6);
+  p->phase=0;
+  p->level=-1;
+  p->last_edge=0;
+  p->missed=p->late=0;
+  stats_hist_reset(&p->latency);
+  snprintf(p->latency_name, sizeof(p->latency_name), "Sega pad on port %d select to response latency", port);
+  p->report_time=timing_now_ns()+STATS_REPORT_INTERVAL*NSEC_PER_SEC;
+  snprintf(labels, sizeof(labels), "port=\"%d\"", port);
+  p->metric_latency=metrics_histogram("joyemu_sega_response_seconds", "Time from a Sega pad select edge to the pin update", labels);
+  p->metric_missed=metrics_counter("joyemu_sega_missed_edges_total", "Sega pad select edges which were missed", labels);
+  p->metric_late=metrics_counter("joyemu_sega_late_edges_total", "Sega pad select edges answered after the host reads the pins", labels);
+  if (mcp_watch_input(pinmap_expander[port-1], bit, sega_select, p) < 0) {
+    debug_log(LOGLEVEL_ERROR, "Failed to read pin %d of port %d as an input", SEGA_SELECT_PIN, port);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * joyemu 
+ *
+ * Timed pin events run by the port I/O thread: autofire and input macros.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defaults.h"
+#include "logging.h"
+#include "ports.h"
+#include "sequencer.h"
+#include "stats.h"
+#include "timers.h"
+#include "timing.h"
+
+// pins a macro step drives: the four directions and the fire button
+#define SEQ_MACRO_PINS	(DB9_PIN(1)|DB9_PIN(2)|DB9_PIN(3)|DB9_PIN(4)|DB9_PIN(6))
+
+// timer argument naming the port and button a timer belongs to
+#define SEQ_TIMER_ARG(port, button)	(((port)<<8)|(button))
+
+// one step of a macro: the pins held down and for how long
+struct seq_step {
+  uint16_t pressed;
+  uint32_t ms;
+};
+
+// a button press passed from the input thread to the port I/O thread
+struct seq_command {
+  uint8_t port;
+  uint8_t button;
+  uint8_t pressed;
+  uint8_t pad;
+};
+
+// autofire rate in Hz and macro of each button, set on command line
+int seq_autofire_hz[SEQ_BUTTONS];
+struct seq_step seq_macro[SEQ_BUTTONS][SEQ_MAX_STEPS];
+int seq_macro_steps[SEQ_BUTTONS];
+
+const char *seq_button_name[SEQ_BUTTONS]={"north", "east", "south", "west", "tl", "tr"};
+const char *seq_pin_name[]={"up", "down", "left", "right", "fire", NULL};
+const int seq_pin_number[]={1, 2, 3, 4, 6};
+
+// ring of button presses from the input thread, head written by the input
+// thread and tail by the port I/O thread
+struct seq_command seq_commands[SEQ_COMMAND_RING];
+unsigned int seq_command_head=0, seq_command_tail=0;
+unsigned long seq_commands_dropped=0;
+
+// everything below is owned by the port I/O thread
+struct timer_wheel seq_wheel;
+
+// pending autofire toggle of each button on each port, and whether fire is
+// currently held down by it
+int seq_autofire_timer[MAX_PORTS][SEQ_BUTTONS];
+int seq_autofire_down[MAX_PORTS][SEQ_BUTTONS];
+
+// macro running on each port: its button, the current step and the timer
+// ending the step
+int seq_macro_button[MAX_PORTS], seq_macro_step[MAX_PORTS], seq_macro_timer[MAX_PORTS];
+
+
+// return the index of a button name or -1
+int seq_parse_button(const char *name, size_t len) {
+  int i;
+  for(i=0;i<SEQ_BUTTONS;i++) {
+    if (strlen(seq_button_name[i])==len && !strncmp(seq_button_name[i], name, len)) return i;
+  }
+  return -1;
+}
+
+
+// parse an autofire setting "button:hz". returns -1 if it's invalid
+int seq_parse_autofire(const char *spec) {
+  int button=seq_parse_button(spec, strcspn(spec, ":"));
+  int hz=0;
+
+  if (button < 0 || sscanf(spec+strcspn(spec, ":"), ":%d", &hz)!=1 || hz<1 || hz>SEQ_MAX_AUTOFIRE_HZ) return -1;
+  seq_autofire_hz[button]=hz;
+  return 0;
+}
+
+
+// parse a macro "button:step,step,..." where each step is "pins@ms" and
+// pins is "none" or pin names joined with '+', eg. "tr:down@50,right+fire@80".
+// returns -1 if it's invalid
+int seq_parse_macro(const char *spec) {
+  int button=seq_parse_button(spec, strcspn(spec, ":"));
+  const char *p=spec+strcspn(spec, ":");
+  struct seq_step *step;
+  size_t len;
+  int i, n=0;
+  char *end;
+
+  if (button < 0 || *p!=':') return -1;
+  do {
+    p++;
+    if (n >= SEQ_MAX_STEPS) return -1;
+    step=&seq_macro[button][n++];
+    step->pressed=0;
+    // pin names up to the '@'
+    while (*p && *p!='@') {
+      len=strcspn(p, "+@");
+      if (len==4 && !strncmp(p, "none", 4)) {
+        i=-1;
+      } else {
+        for(i=0;seq_pin_name[i];i++) {
+          if (strlen(seq_pin_name[i])==len && !strncmp(seq_pin_name[i], p, len)) break;
+        }
+        if (!seq_pin_name[i]) return -1;
+        step->pressed|=DB9_PIN(seq_pin_number[i]);
+      }
+      p+=len;
+      if (*p=='+') p++;
+    }
+    if (*p!='@') return -1;
+    step->ms=strtoul(p+1, &end, 10);
+    if (end==p+1 || step->ms<1) return -1;
+    p=end;
+  } while (*p==',');
+  if (*p) return -1;
+  seq_macro_steps[button]=n;
+  return 0;
+}
+
+
+// called from the input thread for a press or release of a button. returns
+// nonzero if the button has autofire or a macro, so that the event is taken
+// care of here
+int seq_button_event(int port, int button, int pressed) {
+  unsigned int head=seq_command_head;
+  struct seq_command *c;
+
+  if (button < 0 || button >= SEQ_BUTTONS || (!seq_autofire_hz[button] && !seq_macro_steps[button])) return 0;
+  if (pressed==2) return 1;  // key repeat, the button is still held
+  if (head-__atomic_load_n(&seq_command_tail, __ATOMIC_ACQUIRE) >= SEQ_COMMAND_RING) {
+    seq_commands_dropped++;
+    return 1;
+  }
+  c=&seq_commands[head % SEQ_COMMAND_RING];
+  c->port=port;
+  c->button=button;
+  c->pressed=pressed ? 1 : 0;
+  __atomic_store_n(&seq_command_head, head+1, __ATOMIC_RELEASE);
+  port_wake();
+  return 1;
+}
+
+
+// toggle the fire button for autofire and schedule the next toggle. the
+// next deadline follows from this one, so the rate doesn't drift however
+// late the timer runs
+static void seq_autofire_toggle(uint32_t arg, uint64_t deadline) {
+  int port=arg>>8, button=arg&0xff;
+  uint64_t half_period=NSEC_PER_SEC/(2*seq_autofire_hz[button]);
+
+  seq_autofire_down[port][button]=!seq_autofire_down[port][button];
+  port_set_pins(port, DB9_PIN(6), DB9_PIN_LEVEL(6, !seq_autofire_down[port][button]));
+  seq_autofire_timer[port][button]=timer_add(&seq_wheel, deadline+half_period, seq_autofire_toggle, arg);
+}
+
+
+// set the pins of the current macro step on a port and schedule the next
+// one, or release all pins after the last step
+static void seq_macro_next(uint32_t arg, uint64_t deadline) {
+  int port=arg>>8, button=seq_macro_button[port];
+  struct seq_step *step;
+
+  if (seq_macro_step[port] >= seq_macro_steps[button]) {
+    port_set_pins(port, SEQ_MACRO_PINS, SEQ_MACRO_PINS);
+    seq_macro_button[port]=-1;
+    seq_macro_timer[port]=-1;
+    return;
+  }
+  step=&seq_macro[button][seq_macro_step[port]++];
+  port_set_pins(port, SEQ_MACRO_PINS, SEQ_MACRO_PINS & ~step->pressed);
+  seq_macro_timer[port]=timer_add(&seq_wheel, deadline+step->ms*NSEC_PER_MSEC, seq_macro_next, arg);
+}
+
+
+// act on a button press or release from the input thread
+static void seq_command(struct seq_command *c, uint64_t now) {
+  int port=c->port, button=c->button;
+
+  if (seq_macro_steps[button]) {
+    // a press starts the macro over, a release lets it run to the end
+    if (!c->pressed) return;
+    timer_cancel(&seq_wheel, seq_macro_timer[port]);
+    seq_macro_button[port]=button;
+    seq_macro_step[port]=0;
+    seq_macro_next(SEQ_TIMER_ARG(port, button), now);
+  } else {
+    timer_cancel(&seq_wheel, seq_autofire_timer[port][button]);
+    seq_autofire_timer[port][button]=-1;
+    seq_autofire_down[port][button]=0;
+    if (c->pressed) seq_autofire_toggle(SEQ_TIMER_ARG(port, button), now);
+    else port_set_pins(port, DB9_PIN(6), DB9_PIN(6));
+  }
+}
+
+
+// start the timer wheel, called from the port I/O thread
+void seq_init(uint64_t now) {
+  int port, button;
+
+  timer_wheel_init(&seq_wheel, now);
+  for(port=0;port<MAX_PORTS;port++) {
+    for(button=0;button<SEQ_BUTTONS;button++) seq_autofire_timer[port][button]=-1;
+    seq_macro_button[port]=-1;
+    seq_macro_timer[port]=-1;
+  }
+}
+
+
+// return the time the port I/O thread should wake up at, the encoder step
+// time or the next timer tick if that's earlier
+uint64_t seq_next_deadline(uint64_t t_step) {
+  uint64_t t=timer_wheel_next(&seq_wheel);
+  return (t && t < t_step) ? t : t_step;
+}
+
+
+// return nonzero if button presses are queued for the port I/O thread
+int seq_pending(void) {
+  return __atomic_load_n(&seq_command_head, __ATOMIC_ACQUIRE)!=seq_command_tail;
+}
+
+
+// take the button presses queued by the input thread and run the timers
+// which have come due
+void seq_run(uint64_t now) {
+  unsigned int tail=seq_command_tail;
+  unsigned int head=__atomic_load_n(&seq_command_head, __ATOMIC_ACQUIRE);
+
+  while (tail != head) {
+    seq_command(&seq_commands[tail % SEQ_COMMAND_RING], now);
+    tail++;
+  }
+  __atomic_store_n(&seq_command_tail, tail, __ATOMIC_RELEASE);
+  timer_wheel_run(&seq_wheel, now);
+}
+
+
+// report how accurately the timers ran since the last report
+void seq_log_stats(void) {
+  if (!seq_wheel.lateness.count) return;
+  stats_hist_log(LOGLEVEL_VERBOSE, "Timer lateness", &seq_wheel.lateness);
+  debug_log(LOGLEVEL_VERBOSE, "Timers peaked at %d pending", seq_wheel.peak);
+  if (seq_commands_dropped) debug_log(LOGLEVEL_VERBOSE, "Dropped %lu button presses for timed events", seq_commands_dropped);
+  stats_hist_reset(&seq_wheel.lateness);
+  seq_wheel.peak=seq_wheel.active;
+}
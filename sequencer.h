@@ -0,0 +1,56 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SEQUENCER_H_
+#define _SEQUENCER_H_
+
+// gamepad buttons which can have autofire or a macro bound to them
+#define SEQ_BUTTON_NORTH	0
+#define SEQ_BUTTON_EAST		1
+#define SEQ_BUTTON_SOUTH	2
+#define SEQ_BUTTON_WEST		3
+#define SEQ_BUTTON_TL		4
+#define SEQ_BUTTON_TR		5
+#define SEQ_BUTTONS		6
+
+// longest macro and fastest autofire rate
+#define SEQ_MAX_STEPS		16
+#define SEQ_MAX_AUTOFIRE_HZ	50
+
+// button presses which can wait for the port I/O thread
+#define SEQ_COMMAND_RING	256
+
+int seq_parse_button(const char *name, size_t len);
+int seq_parse_autofire(const char *spec);
+int seq_parse_macro(const char *spec);
+int seq_button_event(int port, int button, int pressed);
+void seq_init(uint64_t now);
+uint64_t seq_next_deadline(uint64_t t_step);
+int seq_pending(void);
+void seq_run(uint64_t now);
+void seq_log_stats(void);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * joyemu 
+ *
+ * Simulated MCP23017 output backend for running without the I/O board.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "defaults.h"
+#include "io.h"
+#include "logging.h"
+#include "sim.h"
+#include "timing.h"
+
+// MCP23017 registers with special behaviour in BANK=0 mode
+#define MCP_IODIRA	0x00
+#define MCP_IODIRB	0x01
+#define MCP_IOCONA	0x0a
+#define MCP_IOCONB	0x0b
+#define MCP_GPIOA	0x12
+#define MCP_GPIOB	0x13
+#define MCP_OLATA	0x14
+#define MCP_OLATB	0x15
+
+// IOCON bit which disables the address pointer increment
+#define MCP_IOCON_SEQOP	0x20
+
+
+// register files used when no shared memory file was given
+struct sim_mcp_state sim_local_state[MAX_EXPANDERS];
+
+// the register files of the simulated expanders in the order they were
+// opened. the backend handle of an expander points to its entry here
+struct sim_mcp_state *sim_states[MAX_EXPANDERS];
+int sim_count=0;
+
+// GPIO bits of each expander watched as inputs and their last levels. the
+// inputs are driven by another process writing to the GPIO registers of a
+// shared memory file
+uint16_t sim_inputs[MAX_EXPANDERS], sim_levels[MAX_EXPANDERS];
+
+// I2C clock whose transaction times the writes take, 0 for none
+int sim_bus_clock=0;
+
+
+
+// return the state of the nth simulated expander, NULL before it's opened
+struct sim_mcp_state *sim_get_state(int n) {
+  return (n>=0 && n<sim_count) ? sim_states[n] : NULL;
+}
+
+
+// make the writes take as long as they would on an I2C bus running at a
+// clock, or return right away with 0
+void sim_set_bus_clock(int hz) {
+  __atomic_store_n(&sim_bus_clock, hz, __ATOMIC_RELAXED);
+}
+
+
+// put the registers to their power-on values, with all pins as inputs
+static void sim_reset(struct sim_mcp_state *st) {
+  memset(st, 0, sizeof(struct sim_mcp_state));
+  st->magic=SIM_MAGIC;
+  st->size=sizeof(struct sim_mcp_state);
+  st->regs[MCP_IODIRA]=0xff;
+  st->regs[MCP_IODIRB]=0xff;
+}
+
+
+// map a shared memory file to hold the register file
+static struct sim_mcp_state *sim_map_file(const char *path) {
+  struct sim_mcp_state *st;
+  int fd=open(path, O_RDWR|O_CREAT, 0644);
+
+  if (fd < 0) {
+    debug_log(LOGLEVEL_ERROR, "SIM: failed to open %s, errno %d", path, errno);
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(struct sim_mcp_state)) < 0) {
+    debug_log(LOGLEVEL_ERROR, "SIM: failed to resize %s, errno %d", path, errno);
+    close(fd);
+    return NULL;
+  }
+  st=mmap(NULL, sizeof(struct sim_mcp_state), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (st==MAP_FAILED) {
+    debug_log(LOGLEVEL_ERROR, "SIM: failed to map %s, errno %d", path, errno);
+    return NULL;
+  }
+  return st;
+}
+
+
+// create a simulated expander, in a shared memory file if a path is given.
+// the first expander uses the path as is and the others get ".n" appended
+static void *sim_backend_open(int bus, uint16_t addr, const char *arg) {
+  struct sim_mcp_state *st;
+  char path[512];
+
+  if (sim_count >= MAX_EXPANDERS) return NULL;
+  if (arg && *arg) {
+    if (sim_count) snprintf(path, sizeof(path), "%s.%d", arg, sim_count);
+    else snprintf(path, sizeof(path), "%s", arg);
+    st=sim_map_file(path);
+    if (!st) return NULL;
+    debug_log(LOGLEVEL_DEBUG, "SIM: simulating MCP23017 at 0x%02x on bus %d in %s", addr, bus, path);
+  } else {
+    st=&sim_local_state[sim_count];
+    debug_log(LOGLEVEL_DEBUG, "SIM: simulating MCP23017 at 0x%02x on bus %d in memory", addr, bus);
+  }
+  sim_reset(st);
+  sim_states[sim_count]=st;
+  return &sim_states[sim_count++];
+}
+
+
+// store one register. writes to GPIO go to the output latch, so both GPIO
+// and OLAT are kept showing the latch for pins configured as outputs
+static int sim_store(struct sim_mcp_state *sim_state, uint8_t regno, uint8_t data) {
+  int bank=regno&1;
+
+  switch (regno) {
+    case MCP_IOCONA:
+    case MCP_IOCONB:
+    sim_state->regs[MCP_IOCONA]=sim_state->regs[MCP_IOCONB]=data;
+    return 0;
+
+    case MCP_GPIOA:
+    case MCP_GPIOB:
+    case MCP_OLATA:
+    case MCP_OLATB:
+    sim_state->regs[MCP_OLATA+bank]=data;
+    sim_state->regs[MCP_GPIOA+bank]=(sim_state->regs[MCP_GPIOA+bank] & sim_state->regs[MCP_IODIRA+bank]) |
+                                    (data & ~sim_state->regs[MCP_IODIRA+bank]);
+    return 1;
+
+    default:
+    sim_state->regs[regno]=data;
+    return 0;
+  }
+}
+
+
+// write consecutive registers like a sequential I2C write would, and add
+// a timestamped entry to the write log if an output latch was written
+static int sim_backend_write(void *handle, uint8_t regno, const uint8_t *data, int len) {
+  struct sim_mcp_state *sim_state=*(struct sim_mcp_state **)handle;
+  struct sim_gpio_write *w;
+  uint8_t r=regno;
+  int i, gpio_written=0, clock=__atomic_load_n(&sim_bus_clock, __ATOMIC_RELAXED);
+  uint64_t t=timing_now_ns();
+
+  if (!sim_state || regno >= SIM_MCP_REGISTERS) return -1;
+  for(i=0;i<len;i++) {
+    gpio_written|=sim_store(sim_state, r, data[i]);
+    if (!(sim_state->regs[MCP_IOCONA] & MCP_IOCON_SEQOP)) r=(r+1)%SIM_MCP_REGISTERS;
+  }
+
+  if (gpio_written) {
+    w=&sim_state->log[sim_state->gpio_writes % SIM_LOG_ENTRIES];
+    w->t_ns=timing_now_ns();
+    w->gpio[0]=sim_state->regs[MCP_OLATA];
+    w->gpio[1]=sim_state->regs[MCP_OLATB];
+    __atomic_store_n(&sim_state->gpio_writes, sim_state->gpio_writes+1, __ATOMIC_RELEASE);
+  }
+  debug_log(LOGLEVEL_EXTRADEBUG, "SIM: wrote %d bytes to register 0x%02x", len, regno);
+
+  // the address and register bytes and the data, each with an ack bit
+  if (clock) timing_sleep_until_ns(t+(uint64_t)(len+2)*9*NSEC_PER_SEC/clock);
+  return 0;
+}
+
+
+// read a register from the simulated expander
+static int sim_backend_read(void *handle, uint8_t regno, uint8_t *data) {
+  struct sim_mcp_state *sim_state=*(struct sim_mcp_state **)handle;
+  if (!sim_state || regno >= SIM_MCP_REGISTERS) return -1;
+  *data=sim_state->regs[regno];
+  return 0;
+}
+
+
+// make a GPIO bit an input, so that writes to the GPIO register leave it
+// as it was set from outside, or an output driven from the latch again
+static int sim_backend_watch(void *handle, int bit, int input) {
+  struct sim_mcp_state **st=handle;
+  uint8_t *iodir, *gpio;
+  int n=st-sim_states, bank=bit/8, b=1<<(bit%8);
+
+  if (!*st) return -1;
+  iodir=&(*st)->regs[MCP_IODIRA+bank];
+  gpio=&(*st)->regs[MCP_GPIOA+bank];
+  if (!input) {
+    __atomic_and_fetch(&sim_inputs[n], ~(1<<bit), __ATOMIC_RELAXED);
+    *iodir&=~b;
+    __atomic_store_n(gpio, (*gpio & ~b) | ((*st)->regs[MCP_OLATA+bank] & b), __ATOMIC_RELEASE);
+    return 0;
+  }
+  *iodir|=b;
+  sim_levels[n]=(sim_levels[n] & ~(1<<bit)) | (((__atomic_load_n(gpio, __ATOMIC_ACQUIRE) >> (bit%8)) & 1) << bit);
+  __atomic_or_fetch(&sim_inputs[n], 1<<bit, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+// poll the watched inputs until one of them changes and return its level.
+// the change is stamped with the previous poll, the earliest it could have
+// happened
+static int sim_backend_wait(void *handle, int *bit, uint64_t *t_ns) {
+  struct sim_mcp_state **st=handle;
+  int n=st-sim_states;
+  uint16_t gpio, changed;
+  uint64_t t, t_seen=timing_now_ns();
+
+  do {
+    t=timing_now_ns();
+    gpio=__atomic_load_n(&(*st)->regs[MCP_GPIOA], __ATOMIC_ACQUIRE) |
+         (__atomic_load_n(&(*st)->regs[MCP_GPIOB], __ATOMIC_ACQUIRE) << 8);
+    changed=(gpio ^ sim_levels[n]) & __atomic_load_n(&sim_inputs[n], __ATOMIC_RELAXED);
+    if (changed) break;
+    t_seen=t;
+    timing_sleep_until_ns(timing_now_ns()+IO_INPUT_POLL_NS);
+  } while (1);
+  *t_ns=t_seen;
+  *bit=__builtin_ctz(changed);
+  sim_levels[n]^=1<<*bit;
+  return (sim_levels[n] >> *bit) & 1;
+}
+
+
+// an MCP23017 simulated in memory or in a shared memory file
+const struct io_backend io_backend_sim={
+  "sim",
+  sim_backend_open,
+  sim_backend_write,
+  sim_backend_read,
+  sim_backend_watch,
+  sim_backend_wait,
+  1
+};
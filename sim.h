@@ -0,0 +1,60 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+// register file size of the MCP23017 in BANK=0 addressing mode
+#define SIM_MCP_REGISTERS	0x16
+
+// number of GPIO writes kept in the timestamped write log
+#define SIM_LOG_ENTRIES		4096
+
+// identifies a shared memory file holding a simulated expander
+#define SIM_MAGIC		0x3233504d
+
+// one write to the GPIO or OLAT registers as seen by the simulated expander
+struct sim_gpio_write {
+  uint64_t t_ns;  // CLOCK_MONOTONIC time of the write
+  uint8_t gpio[2];  // output latches of GPIOA and GPIOB after the write
+  uint8_t pad[6];
+};
+
+// state of the simulated MCP23017. when backed by a file, other processes
+// can map it and follow the write log by polling gpio_writes
+struct sim_mcp_state {
+  uint32_t magic;
+  uint32_t size;
+  uint64_t gpio_writes;  // total number of GPIO writes, also the log head
+  uint8_t regs[SIM_MCP_REGISTERS];
+  uint8_t pad[2];
+  struct sim_gpio_write log[SIM_LOG_ENTRIES];
+};
+
+struct sim_mcp_state *sim_get_state(int n);
+void sim_set_bus_clock(int hz);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * joyemu 
+ *
+ * Histograms for latency and jitter measurements.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "logging.h"
+#include "stats.h"
+#include "timing.h"
+
+
+// map a value to its histogram bucket
+static int stats_hist_index(uint64_t v) {
+  int msb;
+  if (v < STATS_HIST_LINEAR) return (int)v;
+  msb=63-__builtin_clzll(v);
+  return STATS_HIST_LINEAR + (msb-4)*STATS_HIST_SUBBUCKETS + (int)((v >> (msb-3)) & (STATS_HIST_SUBBUCKETS-1));
+}
+
+
+// lowest value that maps to a histogram bucket
+static uint64_t stats_hist_bucket_floor(int i) {
+  int msb;
+  if (i < STATS_HIST_LINEAR) return i;
+  i-=STATS_HIST_LINEAR;
+  msb=i/STATS_HIST_SUBBUCKETS + 4;
+  return (1ULL<<msb) | ((uint64_t)(i%STATS_HIST_SUBBUCKETS) << (msb-3));
+}
+
+
+// clear all samples from a histogram
+void stats_hist_reset(struct stats_hist *h) {
+  memset(h, 0, sizeof(struct stats_hist));
+  h->min=UINT64_MAX;
+}
+
+
+// add a sample to a histogram
+void stats_hist_add(struct stats_hist *h, uint64_t v) {
+  h->bucket[stats_hist_index(v)]++;
+  h->count++;
+  h->sum+=v;
+  if (v < h->min) h->min=v;
+  if (v > h->max) h->max=v;
+}
+
+
+// estimate a percentile (given in permille) from the histogram buckets
+uint64_t stats_hist_percentile(const struct stats_hist *h, int permille) {
+  uint64_t rank, seen=0;
+  int i;
+
+  if (!h->count) return 0;
+  rank=(h->count*permille + 999)/1000;
+  if (rank < 1) rank=1;
+  for(i=0;i<STATS_HIST_BUCKETS;i++) {
+    seen+=h->bucket[i];
+    if (seen >= rank) {
+      // the bucket floor can't be below the smallest or above the largest sample
+      uint64_t v=stats_hist_bucket_floor(i);
+      if (v < h->min) v=h->min;
+      if (v > h->max) v=h->max;
+      return v;
+    }
+  }
+  return h->max;
+}
+
+
+// log a one-line summary of a histogram, values shown in microseconds
+void stats_hist_log(int level, const char *what, const struct stats_hist *h) {
+  if (!h->count) {
+    debug_log(level, "%s: no samples", what);
+    return;
+  }
+  debug_log(level, "%s: n=%llu min=%.1fus avg=%.1fus p50=%.1fus p99=%.1fus max=%.1fus", what,
+    (unsigned long long)h->count,
+    (double)h->min/NSEC_PER_USEC,
+    (double)(h->sum/h->count)/NSEC_PER_USEC,
+    (double)stats_hist_percentile(h, 500)/NSEC_PER_USEC,
+    (double)stats_hist_percentile(h, 990)/NSEC_PER_USEC,
+    (double)h->max/NSEC_PER_USEC);
+}
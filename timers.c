@@ -0,0 +1,191 @@
+/*
+ * joyemu 
+ *
+ * Hashed timer wheel for scheduling timed pin events.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "timers.h"
+#include "timing.h"
+
+
+// put all timers on the free list and start the wheel at the given time
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+  int i;
+
+  memset(w, 0, sizeof(struct timer_wheel));
+  w->t_tick=now;
+  for(i=0;i<TIMER_WHEEL_SLOTS;i++) w->slot[i]=TIMER_NONE;
+  for(i=0;i<TIMER_POOL_SIZE;i++) {
+    w->timers[i].slot=TIMER_NONE;
+    w->timers[i].next=(i+1<TIMER_POOL_SIZE) ? i+1 : TIMER_NONE;
+  }
+  w->free_list=0;
+  stats_hist_reset(&w->lateness);
+}
+
+
+// link a timer to the head of a slot
+static void timer_link(struct timer_wheel *w, int i, int slot) {
+  struct timer *t=&w->timers[i];
+
+  t->slot=slot;
+  t->prev=TIMER_NONE;
+  t->next=w->slot[slot];
+  if (t->next!=TIMER_NONE) w->timers[t->next].prev=i;
+  w->slot[slot]=i;
+}
+
+
+// unlink a timer from its slot and return it to the free list
+static void timer_free(struct timer_wheel *w, int i) {
+  struct timer *t=&w->timers[i];
+
+  if (t->prev!=TIMER_NONE) w->timers[t->prev].next=t->next;
+  else w->slot[t->slot]=t->next;
+  if (t->next!=TIMER_NONE) w->timers[t->next].prev=t->prev;
+  t->slot=TIMER_NONE;
+  t->generation=(t->generation+1) & TIMER_GENERATION_MASK;
+  t->next=w->free_list;
+  w->free_list=i;
+  w->active--;
+}
+
+
+// schedule a call to fn at the deadline. the timer goes in the slot of the
+// tick the deadline falls in. returns an id for cancelling the timer or -1
+// if all timers are in use
+int timer_add(struct timer_wheel *w, uint64_t deadline, timer_fn fn, uint32_t arg) {
+  uint64_t ticks, now;
+  struct timer *t;
+  int i=w->free_list;
+
+  if (i==TIMER_NONE) return -1;
+  t=&w->timers[i];
+  w->free_list=t->next;
+
+  // an idle wheel isn't run, so bring it up to the current tick first
+  if (!w->active) {
+    now=timing_now_ns();
+    if (now > w->t_tick) {
+      ticks=(now-w->t_tick)/TIMER_TICK_NS;
+      w->tick+=ticks;
+      w->t_tick+=ticks*TIMER_TICK_NS;
+    }
+  }
+
+  ticks=(deadline > w->t_tick) ? (deadline-w->t_tick)/TIMER_TICK_NS : 0;
+  t->deadline=deadline;
+  t->fn=fn;
+  t->arg=arg;
+  t->turns=ticks/TIMER_WHEEL_SLOTS;
+  timer_link(w, i, (w->tick+ticks)%TIMER_WHEEL_SLOTS);
+  w->active++;
+  if (w->active > w->peak) w->peak=w->active;
+  return TIMER_ID(t->generation, i);
+}
+
+
+// cancel a pending timer. ids of timers which have already expired or been
+// cancelled are ignored
+void timer_cancel(struct timer_wheel *w, int id) {
+  int i=id & 0xffff;
+
+  if (id < 0 || i >= TIMER_POOL_SIZE) return;
+  if (w->timers[i].slot==TIMER_NONE || w->timers[i].generation!=(uint16_t)(id>>16)) return;
+  timer_free(w, i);
+}
+
+
+// run the wheel up to now, calling the expired timers. a slot is left
+// once every timer due in this turn has run, and the timers for later
+// turns then have one turn less to go. the due timers are collected before
+// any is called, so that the callbacks are free to add and cancel timers
+void timer_wheel_run(struct timer_wheel *w, uint64_t now) {
+  int due[TIMER_POOL_SIZE];
+  struct timer *t;
+  int i, n, pending, slot;
+  uint64_t deadline;
+  timer_fn fn;
+  uint32_t arg;
+
+  while (w->active && w->t_tick <= now) {
+    slot=w->tick%TIMER_WHEEL_SLOTS;
+    n=0;
+    pending=0;
+    for(i=w->slot[slot];i!=TIMER_NONE;i=w->timers[i].next) {
+      t=&w->timers[i];
+      if (t->turns) continue;
+      if (t->deadline <= now) due[n++]=TIMER_ID(t->generation, i);
+      else pending++;
+    }
+
+    if (n) {
+      for(i=0;i<n;i++) {
+        t=&w->timers[due[i] & 0xffff];
+        if (t->slot==TIMER_NONE || t->generation!=(uint16_t)(due[i]>>16)) continue;
+        deadline=t->deadline;
+        fn=t->fn;
+        arg=t->arg;
+        timer_free(w, due[i] & 0xffff);
+        stats_hist_add(&w->lateness, timing_now_ns()-deadline);
+        fn(arg, deadline);
+      }
+      // look at the slot again for timers the callbacks added
+      continue;
+    }
+    if (pending) break;
+
+    for(i=w->slot[slot];i!=TIMER_NONE;i=w->timers[i].next) w->timers[i].turns--;
+    w->tick++;
+    w->t_tick+=TIMER_TICK_NS;
+  }
+}
+
+
+// return the time the wheel should next be run at: the earliest deadline
+// due in the first slot with timers in it, or the start of that slot if its
+// timers are for later turns. returns 0 if no timers are pending
+uint64_t timer_wheel_next(const struct timer_wheel *w) {
+  const struct timer *t;
+  uint64_t next=0;
+  int i, j;
+
+  if (!w->active) return 0;
+  for(i=0;i<TIMER_WHEEL_SLOTS;i++) {
+    j=w->slot[(w->tick+i)%TIMER_WHEEL_SLOTS];
+    if (j==TIMER_NONE) continue;
+    for(;j!=TIMER_NONE;j=t->next) {
+      t=&w->timers[j];
+      if (!t->turns && (!next || t->deadline < next)) next=t->deadline;
+    }
+    return next ? next : w->t_tick+i*TIMER_TICK_NS;
+  }
+  return w->t_tick;
+}
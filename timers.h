@@ -0,0 +1,78 @@
+/*
+ * joyemu 
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TIMERS_H_
+#define _TIMERS_H_
+
+// resolution of the timer wheel and the number of slots in it. timers
+// further away than one turn of the wheel stay in their slot for more turns
+#define TIMER_TICK_NS		(250*NSEC_PER_USEC)
+#define TIMER_WHEEL_SLOTS	256
+
+// number of timers which can be pending at the same time
+#define TIMER_POOL_SIZE		256
+
+// marks the end of a timer list
+#define TIMER_NONE		-1
+
+// a timer id holds the generation of the pool entry above its index. the
+// generation wraps at 15 bits so that ids never go negative
+#define TIMER_GENERATION_MASK	0x7fff
+#define TIMER_ID(generation, i)	((int)(((generation) & TIMER_GENERATION_MASK) << 16) | (i))
+
+// called when a timer expires, with its argument and deadline
+typedef void (*timer_fn)(uint32_t arg, uint64_t deadline);
+
+struct timer {
+  uint64_t deadline;
+  timer_fn fn;
+  uint32_t arg;
+  uint32_t turns;  // whole turns of the wheel left before the timer is due
+  int16_t prev, next;
+  int16_t slot;  // TIMER_NONE while the timer is free
+  uint16_t generation;  // tells a stale timer id from a reused timer
+};
+
+// a hashed timer wheel. adding and cancelling a timer take constant time,
+// and running the wheel only looks at the slots which have come due. it is
+// used by a single thread
+struct timer_wheel {
+  uint64_t t_tick;  // start time of the current tick
+  unsigned int tick;
+  int active, peak;
+  int16_t free_list;
+  int16_t slot[TIMER_WHEEL_SLOTS];
+  struct timer timers[TIMER_POOL_SIZE];
+  struct stats_hist lateness;  // expiry time against the deadline
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+int timer_add(struct timer_wheel *w, uint64_t deadline, timer_fn fn, uint32_t arg);
+void timer_cancel(struct timer_wheel *w, int id);
+void timer_wheel_run(struct timer_wheel *w, uint64_t now);
+uint64_t timer_wheel_next(const struct timer_wheel *w);
+
+#endif
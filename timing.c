@@ -0,0 +1,63 @@
+/*
+ * joyemu 
+ *
+ * Functions for reading and sleeping on the monotonic clock.
+ *
+ *
+ * Copyright (c) 2017 Noora Halme
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list
+ *    of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this
+ *    list of conditions and the following disclaimer in the documentation and/or other
+ *    materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include "timing.h"
+
+
+// current time on the monotonic clock in nanoseconds. unlike gettimeofday()
+// this is not affected by wall-clock adjustments
+uint64_t timing_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+// convert a nanosecond count to a timespec
+void timing_ns_to_timespec(uint64_t ns, struct timespec *ts) {
+  ts->tv_sec=ns/NSEC_PER_SEC;
+  ts->tv_nsec=ns%NSEC_PER_SEC;
+}
+
+
+// sleep until an absolute deadline on the monotonic clock. returns
+// immediately if the deadline has already passed
+int timing_sleep_until_ns(uint64_t deadline) {
+  struct timespec ts;
+  int rc;
+
+  timing_ns_to_timespec(deadline, &ts);
+  do {
+    rc=clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  } while (rc==EINTR);
+  return rc;
+}